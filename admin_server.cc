@@ -0,0 +1,54 @@
+#include "admin_server.h"
+#include "metrics.h"
+
+#include <muduo/base/Logging.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <stdio.h>
+
+using namespace zy;
+
+admin_server::admin_server(muduo::net::EventLoop *loop, const muduo::net::InetAddress &addr)
+  : server_(loop, addr, "admin_server")
+{
+  server_.setMessageCallback(boost::bind(&admin_server::onMessage, this, _1, _2, _3));
+}
+
+void admin_server::onMessage(const muduo::net::TcpConnectionPtr &con, muduo::net::Buffer *buf, muduo::Timestamp)
+{
+  const char crlf2[] = "\r\n\r\n";
+  const char* end = std::search(buf->peek(), buf->peek() + buf->readableBytes(), crlf2, crlf2 + 4);
+  if(end == buf->peek() + buf->readableBytes())
+  {
+    if(buf->readableBytes() > kMaxRequest)
+    {
+      buf->retrieveAll();
+      reply(con, "431 Request Header Fields Too Large", std::string());
+    }
+    return;
+  }
+  // 只看请求行: 方法和路径
+  const char* eol = buf->findCRLF();
+  std::string line(buf->peek(), eol);
+  buf->retrieveAll();
+  size_t sp1 = line.find(' ');
+  size_t sp2 = sp1 == std::string::npos ? std::string::npos : line.find(' ', sp1 + 1);
+  std::string method(line, 0, sp1);
+  std::string path = sp2 == std::string::npos ? std::string() : line.substr(sp1 + 1, sp2 - sp1 - 1);
+  if(method != "GET")
+    reply(con, "405 Method Not Allowed", std::string());
+  else if(path == "/metrics")
+    reply(con, "200 OK", metrics::render());
+  else
+    reply(con, "404 Not Found", std::string());
+}
+
+void admin_server::reply(const muduo::net::TcpConnectionPtr &con, const char *status, const std::string &body)
+{
+  char header[256];
+  snprintf(header, sizeof header, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+           "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body.size());
+  con->send(header);
+  con->send(body.data(), static_cast<int>(body.size()));
+  con->shutdown();
+}
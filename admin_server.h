@@ -0,0 +1,26 @@
+#pragma once
+
+#include <muduo/net/TcpServer.h>
+#include <boost/noncopyable.hpp>
+
+namespace zy
+{
+// 管理端口, 和代理的端口分开: GET /metrics 返回Prometheus文本格式的指标, 每个请求回答后关闭连接
+class admin_server : boost::noncopyable
+{
+ public:
+  admin_server(muduo::net::EventLoop* loop, const muduo::net::InetAddress& addr);
+
+  void start() { server_.start(); }
+
+ private:
+  // request headers longer than this are refused
+  const static size_t kMaxRequest = 8192;
+
+  void onMessage(const muduo::net::TcpConnectionPtr& con, muduo::net::Buffer* buf, muduo::Timestamp);
+
+  void reply(const muduo::net::TcpConnectionPtr& con, const char* status, const std::string& body);
+
+  muduo::net::TcpServer server_;
+};
+}
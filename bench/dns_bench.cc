@@ -0,0 +1,169 @@
+// queries per second and udp syscalls per query of dns_resolver
+// usage: dns_bench [queries] [window]
+//
+// an in-process responder thread answers every query at once with one A record, batching its own
+// io with recvmmsg/sendmmsg so it isn't the bottleneck. the resolver runs in the main thread like an
+// io loop and keeps window lookups of distinct names in flight until queries have been answered.
+
+#include "dns_resolver.h"
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/base/Timestamp.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+namespace
+{
+
+const size_t kBatch = 64;
+const size_t kPacket = 1500;
+
+void die(const char* what)
+{
+  perror(what);
+  exit(1);
+}
+
+// turn the query in packet into an answer with one A record, returns its length or 0
+size_t make_answer(char* packet, size_t len)
+{
+  if(len < 12)
+    return 0;
+  size_t off = 12;
+  while(off < len && packet[off] != 0)
+    off += static_cast<uint8_t>(packet[off]) + 1;
+  off += 5;  // root label, type and class
+  if(off > len)
+    return 0;
+  packet[2] = static_cast<char>(0x80 | (packet[2] & 0x01));
+  packet[3] = static_cast<char>(0x80);
+  packet[6] = 0;
+  packet[7] = 1;
+  packet[10] = packet[11] = 0;  // drop the OPT record
+  const char rr[] = {static_cast<char>(0xc0), 0x0c, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 127, 0, 0, 1};
+  memcpy(packet + off, rr, sizeof rr);
+  return off + sizeof rr;
+}
+
+void respond(int fd, const std::atomic<bool>* stop)
+{
+  std::vector<char> packets(kBatch * kPacket);
+  std::vector<struct mmsghdr> msgs(kBatch);
+  std::vector<struct iovec> iovecs(kBatch);
+  std::vector<struct sockaddr_in> peers(kBatch);
+  while(!*stop)
+  {
+    for(size_t i = 0; i < kBatch; ++i)
+    {
+      iovecs[i].iov_base = &packets[i * kPacket];
+      iovecs[i].iov_len = kPacket;
+      memset(&msgs[i], 0, sizeof msgs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &peers[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof peers[i];
+    }
+    // block for the first datagram only, SO_RCVTIMEO lets stop be noticed
+    int n = ::recvmmsg(fd, msgs.data(), kBatch, MSG_WAITFORONE, nullptr);
+    if(n <= 0)
+      continue;
+    for(int i = 0; i < n; ++i)
+      iovecs[i].iov_len = make_answer(&packets[static_cast<size_t>(i) * kPacket], msgs[i].msg_len);
+    int sent = 0;
+    while(sent < n)
+    {
+      int m = ::sendmmsg(fd, &msgs[sent], static_cast<unsigned int>(n - sent), 0);
+      if(m <= 0)
+        break;
+      sent += m;
+    }
+  }
+}
+
+double cpu_seconds()
+{
+  struct rusage usage;
+  ::getrusage(RUSAGE_THREAD, &usage);
+  return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+         + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  int queries = argc > 1 ? atoi(argv[1]) : 200000;
+  int window = argc > 2 ? atoi(argv[2]) : 256;
+
+  int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof addr;
+  if(fd < 0 || ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0
+     || ::getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0)
+    die("bind");
+  int bufsize = 8 * 1024 * 1024;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize);
+  // the timeout argument of recvmmsg is only checked after a datagram arrives
+  struct timeval timeout = {0, 100 * 1000};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  std::atomic<bool> stop(false);
+  std::thread responder(respond, fd, &stop);
+
+  muduo::net::EventLoop loop;
+  // no negative cache, every name is new so the cache never answers
+  zy::dns_resolver resolver(&loop, 2, 0);
+  resolver.set_servers(std::vector<muduo::net::InetAddress>(1, muduo::net::InetAddress(addr)));
+
+  int issued = 0, answered = 0, failed = 0;
+  boost::function<void()> next;
+  zy::dns_resolver::ResolveCallback done = [&](const zy::dns_resolver::AddressList& addrs) {
+    ++answered;
+    if(addrs.empty())
+      ++failed;
+    if(answered == queries)
+      loop.quit();
+    else
+      next();
+  };
+  next = [&] {
+    if(issued < queries)
+      resolver.resolve("h" + std::to_string(issued++) + ".bench", done);
+  };
+
+  muduo::Timestamp start = muduo::Timestamp::now();
+  double cpu_start = cpu_seconds();
+  loop.runInLoop([&] {
+    for(int i = 0; i < window; ++i)
+      next();
+  });
+  loop.loop();
+  double seconds = muduo::timeDifference(muduo::Timestamp::now(), start);
+  double cpu = cpu_seconds() - cpu_start;
+  stop = true;
+  responder.join();
+  ::close(fd);
+
+  const zy::dns_resolver::io_stats& io = resolver.io();
+  printf("%d queries, window %d, %d failed\n", queries, window, failed);
+  printf("%.3f s, %.0f queries/s, resolver cpu %.3f s (%.2f us/query)\n",
+         seconds, queries / seconds, cpu, cpu * 1e6 / queries);
+  printf("sendmmsg %llu calls for %llu datagrams, recvmmsg %llu calls for %llu datagrams\n",
+         static_cast<unsigned long long>(io.send_calls), static_cast<unsigned long long>(io.sent),
+         static_cast<unsigned long long>(io.recv_calls), static_cast<unsigned long long>(io.received));
+  printf("%.3f syscalls/query\n", static_cast<double>(io.send_calls + io.recv_calls) / queries);
+  return 0;
+}
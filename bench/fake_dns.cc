@@ -0,0 +1,218 @@
+// stand-in udp dns server for trying the resolver against slow or lossy upstreams
+// usage: fake_dns [-a address] [-p port] [-d delay_ms] [-j jitter_ms] [-l loss] [-n answers] [-t ttl]
+//
+// answers every A/AAAA question with n addresses (127.0.0.1.. or ::1..), names starting with "nx"
+// get NXDOMAIN. each query is dropped with probability loss, the others are answered after
+// delay +- jitter milliseconds. run several on different ports and list them all as dns servers,
+// counters are printed on SIGINT/SIGTERM.
+
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace
+{
+
+volatile sig_atomic_t g_stop = 0;
+
+void on_signal(int)
+{
+  g_stop = 1;
+}
+
+void die(const char* what)
+{
+  perror(what);
+  exit(1);
+}
+
+int64_t now_us()
+{
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct pending
+{
+  int64_t due;
+  struct sockaddr_storage peer;
+  socklen_t peer_len;
+  std::string packet;
+};
+
+struct options
+{
+  std::string address = "127.0.0.1";
+  int port = 5353;
+  double delay_ms = 0;
+  double jitter_ms = 0;
+  double loss = 0;
+  int answers = 1;
+  uint32_t ttl = 60;
+};
+
+// the answer to query, empty if it isn't a single question we understand
+std::string answer(const options& opt, const char* query, size_t len)
+{
+  if(len < 12 || (query[2] & 0x80) || query[4] != 0 || query[5] != 1)
+    return std::string();
+  size_t off = 12;
+  while(off < len && query[off] != 0)
+  {
+    if((query[off] & 0xc0) != 0)
+      return std::string();
+    off += static_cast<size_t>(query[off]) + 1;
+  }
+  if(off + 5 > len)
+    return std::string();
+  size_t question_end = off + 5;
+  uint16_t qtype = static_cast<uint16_t>((static_cast<uint8_t>(query[off + 1]) << 8) | static_cast<uint8_t>(query[off + 2]));
+  bool nx = len > 14 && query[13] == 'n' && query[14] == 'x';
+
+  std::string out(query, question_end);
+  out[2] = static_cast<char>(0x80 | (query[2] & 0x01));  // QR, keep RD
+  out[3] = static_cast<char>(nx ? 0x83 : 0x80);          // RA, RCODE
+  out[10] = out[11] = 0;                                 // no OPT in the answer
+  int count = 0;
+  if(!nx && (qtype == 1 || qtype == 28))
+  {
+    for(int i = 0; i < opt.answers; ++i)
+    {
+      uint16_t rdlength = qtype == 1 ? 4 : 16;
+      char rr[12] = {static_cast<char>(0xc0), 0x0c, 0, static_cast<char>(qtype), 0, 1,
+                     static_cast<char>(opt.ttl >> 24), static_cast<char>(opt.ttl >> 16),
+                     static_cast<char>(opt.ttl >> 8), static_cast<char>(opt.ttl), 0, static_cast<char>(rdlength)};
+      out.append(rr, sizeof rr);
+      char data[16] = {0};
+      if(qtype == 1)
+        data[0] = 127;
+      data[rdlength - 2] = static_cast<char>((i + 1) >> 8);
+      data[rdlength - 1] = static_cast<char>(i + 1);
+      out.append(data, rdlength);
+      ++count;
+    }
+  }
+  out[6] = static_cast<char>(count >> 8);
+  out[7] = static_cast<char>(count);
+  out[8] = out[9] = 0;
+  return out;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  options opt;
+  int c;
+  while((c = ::getopt(argc, argv, "a:p:d:j:l:n:t:")) != -1)
+  {
+    switch(c)
+    {
+      case 'a': opt.address = optarg; break;
+      case 'p': opt.port = atoi(optarg); break;
+      case 'd': opt.delay_ms = atof(optarg); break;
+      case 'j': opt.jitter_ms = atof(optarg); break;
+      case 'l': opt.loss = atof(optarg); break;
+      case 'n': opt.answers = atoi(optarg); break;
+      case 't': opt.ttl = static_cast<uint32_t>(atoi(optarg)); break;
+      default:
+        fprintf(stderr, "usage: %s [-a address] [-p port] [-d delay_ms] [-j jitter_ms] [-l loss] [-n answers] [-t ttl]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  struct sockaddr_storage addr;
+  memset(&addr, 0, sizeof addr);
+  socklen_t addr_len;
+  struct sockaddr_in* addr4 = reinterpret_cast<struct sockaddr_in*>(&addr);
+  struct sockaddr_in6* addr6 = reinterpret_cast<struct sockaddr_in6*>(&addr);
+  if(::inet_pton(AF_INET, opt.address.c_str(), &addr4->sin_addr) == 1)
+  {
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(static_cast<uint16_t>(opt.port));
+    addr_len = sizeof(struct sockaddr_in);
+  }
+  else if(::inet_pton(AF_INET6, opt.address.c_str(), &addr6->sin6_addr) == 1)
+  {
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(static_cast<uint16_t>(opt.port));
+    addr_len = sizeof(struct sockaddr_in6);
+  }
+  else
+  {
+    fprintf(stderr, "invalid address %s\n", opt.address.c_str());
+    return 1;
+  }
+  int fd = ::socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0 || ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), addr_len) < 0)
+    die("bind");
+  ::signal(SIGINT, on_signal);
+  ::signal(SIGTERM, on_signal);
+
+  std::mt19937 rng(std::random_device{}());
+  std::uniform_real_distribution<double> unit(0, 1);
+  std::deque<pending> queue;  // sorted by due time
+  uint64_t received = 0, dropped = 0, answered = 0;
+  char buf[65536];
+  while(!g_stop)
+  {
+    int64_t now = now_us();
+    while(!queue.empty() && queue.front().due <= now)
+    {
+      const pending& p = queue.front();
+      if(::sendto(fd, p.packet.data(), p.packet.size(), 0, reinterpret_cast<const struct sockaddr*>(&p.peer), p.peer_len) > 0)
+        ++answered;
+      queue.pop_front();
+    }
+    int timeout = queue.empty() ? 100 : static_cast<int>((queue.front().due - now + 999) / 1000);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if(::poll(&pfd, 1, timeout) <= 0)
+      continue;
+    for(;;)
+    {
+      pending p;
+      p.peer_len = sizeof p.peer;
+      ssize_t n = ::recvfrom(fd, buf, sizeof buf, 0, reinterpret_cast<struct sockaddr*>(&p.peer), &p.peer_len);
+      if(n < 0)
+      {
+        if(errno != EAGAIN && errno != EINTR)
+          perror("recvfrom");
+        break;
+      }
+      ++received;
+      if(unit(rng) < opt.loss)
+      {
+        ++dropped;
+        continue;
+      }
+      p.packet = answer(opt, buf, static_cast<size_t>(n));
+      if(p.packet.empty())
+        continue;
+      double delay = opt.delay_ms + opt.jitter_ms * (2 * unit(rng) - 1);
+      p.due = now_us() + static_cast<int64_t>(delay > 0 ? delay * 1000 : 0);
+      // jitter may reorder, insert from the back
+      auto it = queue.end();
+      while(it != queue.begin() && (it - 1)->due > p.due)
+        --it;
+      queue.insert(it, std::move(p));
+    }
+  }
+  printf("%s:%d received %llu dropped %llu answered %llu\n", opt.address.c_str(), opt.port,
+         static_cast<unsigned long long>(received), static_cast<unsigned long long>(dropped),
+         static_cast<unsigned long long>(answered));
+  return 0;
+}
@@ -0,0 +1,784 @@
+// end to end load test of proxy_server: requests/s, Gbit/s, latency percentiles and proxy cpu time
+// usage: proxy_bench [-t proxy_threads] [-w client_threads] [-c connections] [-r rate] [-d seconds]
+//                    [-m connect,get,post] [-s response_bytes] [-b post_bytes] [-n names] [-S]
+//                    [-x ip:port] [-D dns_port]
+//
+// an origin http server, a fake dns server answering every A question with 127.0.0.1 and the proxy
+// run on loopback; the proxy is forked, so its cpu time is its own. connections are split between
+// CONNECT tunnels, which then send GETs through the tunnel, and plain http ones sending GET or POST,
+// by the weights of -m. without -r every connection sends its next request as soon as the answer
+// arrives (closed loop); with -r requests are due at that total rate whether or not earlier ones are
+// done (open loop) and latency counts from when a request was due, so a stalled proxy shows up in
+// the tail instead of slowing the load down. -x drives a proxy started elsewhere (e.g. another
+// build) with --dns-server 127.0.0.1:dns_port instead, its cpu time isn't measured then.
+
+#include "proxy_server.h"
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/base/Logging.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+namespace
+{
+
+const size_t kReadChunk = 64 * 1024;
+const int kMaxEvents = 256;
+
+enum kind
+{
+  kTunnel,  // GET through a CONNECT tunnel
+  kGet,
+  kPost,
+  kKinds
+};
+
+struct options
+{
+  int proxy_threads = 1;
+  int client_threads = 2;
+  int connections = 64;
+  double rate = 0;        // requests per second of all client threads, 0 is closed loop
+  double seconds = 10;
+  int weights[kKinds] = {20, 60, 20};
+  size_t response_bytes = 1024;
+  size_t post_bytes = 1024;
+  int names = 16;         // origin0.bench .. , every one is looked up and connected on its own
+  bool splice = false;
+  std::string proxy;      // ip:port of a proxy started elsewhere
+  int dns_port = 0;
+};
+
+void die(const char* what)
+{
+  perror(what);
+  exit(1);
+}
+
+int64_t now_us()
+{
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct sockaddr_in loopback(uint16_t port)
+{
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+// a socket of type bound to 127.0.0.1:port, listening if it is tcp; port 0 picks a free one
+int bind_loopback(int type, uint16_t* port)
+{
+  int fd = ::socket(AF_INET, type | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr = loopback(*port);
+  socklen_t len = sizeof addr;
+  int on = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+  if(fd < 0 || ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0
+     || (type == SOCK_STREAM && ::listen(fd, 1024) < 0)
+     || ::getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0)
+    die("bind");
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+// value of Content-Length in the header data[0, end), 0 if there is none
+size_t content_length(const std::string& data, size_t end)
+{
+  static const char kName[] = "\r\ncontent-length:";
+  for(size_t pos = data.find("\r\n"); pos != std::string::npos && pos < end; pos = data.find("\r\n", pos + 2))
+  {
+    if(strncasecmp(data.c_str() + pos, kName, sizeof kName - 1) == 0)
+      return static_cast<size_t>(strtoul(data.c_str() + pos + sizeof kName - 1, nullptr, 10));
+  }
+  return 0;
+}
+
+// write as much of out as the socket takes, false on error
+bool flush(int fd, std::string* out, size_t* offset, uint64_t* bytes)
+{
+  while(*offset < out->size())
+  {
+    ssize_t n = ::write(fd, out->data() + *offset, out->size() - *offset);
+    if(n < 0)
+      return errno == EAGAIN || errno == EINTR;
+    *offset += static_cast<size_t>(n);
+    *bytes += static_cast<uint64_t>(n);
+  }
+  out->clear();
+  *offset = 0;
+  return true;
+}
+
+// read everything available into in, false on eof or error
+bool fill(int fd, std::string* in, uint64_t* bytes)
+{
+  char buf[kReadChunk];
+  for(;;)
+  {
+    ssize_t n = ::read(fd, buf, sizeof buf);
+    if(n > 0)
+    {
+      in->append(buf, static_cast<size_t>(n));
+      *bytes += static_cast<uint64_t>(n);
+      continue;
+    }
+    return n < 0 && (errno == EAGAIN || errno == EINTR);
+  }
+}
+
+void set_events(int epfd, int fd, uint32_t events, void* ptr, int op = EPOLL_CTL_MOD)
+{
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = ptr;
+  ::epoll_ctl(epfd, op, fd, &ev);
+}
+
+// origin: every request is answered with 200 and response_bytes of body, request bodies are read and dropped
+struct origin_peer
+{
+  int fd;
+  std::string in;
+  std::string out;
+  size_t offset;
+  bool writing;
+};
+
+void serve_origin(int listenfd, const std::string* response, const std::atomic<bool>* stop)
+{
+  int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+  // the listener is shared by every origin thread, only one of them is woken per connection
+  set_events(epfd, listenfd, EPOLLIN | EPOLLEXCLUSIVE, nullptr, EPOLL_CTL_ADD);
+  std::unordered_map<int, origin_peer*> peers;
+  struct epoll_event events[kMaxEvents];
+  uint64_t bytes = 0;
+  while(!*stop)
+  {
+    int n = ::epoll_wait(epfd, events, kMaxEvents, 100);
+    for(int i = 0; i < n; ++i)
+    {
+      origin_peer* p = static_cast<origin_peer*>(events[i].data.ptr);
+      if(p == nullptr)
+      {
+        int fd = ::accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0)
+          continue;
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        p = new origin_peer{fd, std::string(), std::string(), 0, false};
+        peers[fd] = p;
+        set_events(epfd, fd, EPOLLIN, p, EPOLL_CTL_ADD);
+        continue;
+      }
+      bool ok = true;
+      if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      {
+        ok = fill(p->fd, &p->in, &bytes);
+        for(;;)
+        {
+          size_t end = p->in.find("\r\n\r\n");
+          if(end == std::string::npos)
+            break;
+          size_t total = end + 4 + content_length(p->in, end);
+          if(p->in.size() < total)
+            break;
+          p->in.erase(0, total);
+          p->out.append(*response);
+        }
+      }
+      ok = flush(p->fd, &p->out, &p->offset, &bytes) && ok;
+      if(!ok)
+      {
+        peers.erase(p->fd);
+        ::close(p->fd);
+        delete p;
+        continue;
+      }
+      bool writing = !p->out.empty();
+      if(writing != p->writing)
+      {
+        p->writing = writing;
+        set_events(epfd, p->fd, EPOLLIN | (writing ? EPOLLOUT : 0u), p);
+      }
+    }
+  }
+  for(const auto& peer : peers)
+  {
+    ::close(peer.first);
+    delete peer.second;
+  }
+  ::close(epfd);
+}
+
+// fake dns: A questions get 127.0.0.1, anything else an empty NOERROR answer so only ipv4 is tried
+size_t make_answer(char* packet, size_t len)
+{
+  if(len < 12)
+    return 0;
+  size_t off = 12;
+  while(off < len && packet[off] != 0)
+    off += static_cast<uint8_t>(packet[off]) + 1;
+  if(off + 5 > len)
+    return 0;
+  bool a = packet[off + 1] == 0 && packet[off + 2] == 1;
+  off += 5;  // root label, type and class
+  packet[2] = static_cast<char>(0x80 | (packet[2] & 0x01));
+  packet[3] = static_cast<char>(0x80);
+  packet[6] = 0;
+  packet[7] = a ? 1 : 0;
+  packet[8] = packet[9] = 0;
+  packet[10] = packet[11] = 0;  // drop the OPT record
+  if(!a)
+    return off;
+  const char rr[] = {static_cast<char>(0xc0), 0x0c, 0, 1, 0, 1, 0, 0, 0x0e, 0x10, 0, 4, 127, 0, 0, 1};
+  memcpy(packet + off, rr, sizeof rr);
+  return off + sizeof rr;
+}
+
+void serve_dns(int fd, const std::atomic<bool>* stop)
+{
+  char packet[1500];
+  while(!*stop)
+  {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof peer;
+    // SO_RCVTIMEO lets stop be noticed
+    ssize_t n = ::recvfrom(fd, packet, sizeof packet, 0, reinterpret_cast<struct sockaddr*>(&peer), &len);
+    if(n <= 0)
+      continue;
+    size_t answer = make_answer(packet, static_cast<size_t>(n));
+    if(answer > 0)
+      ::sendto(fd, packet, answer, 0, reinterpret_cast<struct sockaddr*>(&peer), len);
+  }
+}
+
+// clients
+struct requests
+{
+  std::vector<std::string> connect;      // per origin name
+  std::vector<std::string> of[kKinds];
+};
+
+struct client_con
+{
+  int fd;
+  bool tunnel;       // sends its requests through a CONNECT tunnel
+  int name;
+  enum { kConnecting, kTunnelling, kIdle, kBusy } state;
+  int64_t started;   // when the request in flight was due
+  std::string in;
+  std::string out;
+  size_t offset;
+  bool writing;
+};
+
+struct client_result
+{
+  std::vector<int64_t> latencies;  // microseconds, of requests answered before the end
+  uint64_t bytes = 0;              // written and read by the clients
+  uint64_t errors = 0;             // non 200 answers and connections lost with a request in flight
+  uint64_t reconnects = 0;
+  uint64_t unsent = 0;             // open loop requests that never found a free connection
+};
+
+struct due_request
+{
+  int64_t due;
+  kind k;
+};
+
+class client
+{
+ public:
+  client(const options& opt, const requests& reqs, const struct sockaddr_in& proxy,
+         int first, int count, int tunnels, double rate, client_result* result)
+    : opt_(opt), reqs_(reqs), proxy_(proxy), rate_(rate), result_(result),
+      epfd_(::epoll_create1(EPOLL_CLOEXEC)), cons_(static_cast<size_t>(count)), rng_(static_cast<unsigned>(first + 1)),
+      has_tunnels_(false), has_http_(false)
+  {
+    for(int i = 0; i < count; ++i)
+    {
+      client_con& con = cons_[static_cast<size_t>(i)];
+      // global index below tunnels are the CONNECT connections
+      con.tunnel = first + i < tunnels;
+      con.name = (first + i) % opt_.names;
+      has_tunnels_ = has_tunnels_ || con.tunnel;
+      has_http_ = has_http_ || !con.tunnel;
+      open(&con);
+    }
+  }
+
+  ~client()
+  {
+    for(auto& con : cons_)
+    {
+      if(con.fd >= 0)
+        ::close(con.fd);
+    }
+    ::close(epfd_);
+  }
+
+  void run(int64_t start, int64_t end)
+  {
+    int64_t interval = rate_ > 0 ? static_cast<int64_t>(1e6 / rate_) : 0;
+    int64_t next_due = start;
+    struct epoll_event events[kMaxEvents];
+    for(;;)
+    {
+      int64_t now = now_us();
+      if(now >= end)
+        break;
+      int timeout = static_cast<int>((end - now + 999) / 1000);
+      if(interval > 0)
+      {
+        for(; next_due <= now; next_due += std::max<int64_t>(interval, 1))
+          dispatch(due_request{next_due, pick(has_tunnels_, has_http_)});
+        timeout = std::min(timeout, static_cast<int>((next_due - now) / 1000));
+      }
+      int n = ::epoll_wait(epfd_, events, kMaxEvents, timeout);
+      for(int i = 0; i < n; ++i)
+        handle(static_cast<client_con*>(events[i].data.ptr), end);
+    }
+    for(int k = 0; k < 2; ++k)
+      result_->unsent += backlog_[k].size();
+  }
+
+ private:
+  // a kind by the weights of -m among those this client has connections for
+  kind pick(bool tunnel, bool http)
+  {
+    int weights[kKinds] = {tunnel ? opt_.weights[kTunnel] : 0,
+                           http ? opt_.weights[kGet] : 0,
+                           http ? opt_.weights[kPost] : 0};
+    int total = weights[kTunnel] + weights[kGet] + weights[kPost];
+    if(total == 0)
+      return tunnel ? kTunnel : kGet;
+    int r = std::uniform_int_distribution<int>(0, total - 1)(rng_);
+    for(int k = 0; k < kKinds; ++k)
+    {
+      if(r < weights[k])
+        return static_cast<kind>(k);
+      r -= weights[k];
+    }
+    return kGet;
+  }
+
+  void open(client_con* con)
+  {
+    con->fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(con->fd < 0)
+      die("socket");
+    int on = 1;
+    ::setsockopt(con->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    if(::connect(con->fd, reinterpret_cast<const struct sockaddr*>(&proxy_), sizeof proxy_) < 0 && errno != EINPROGRESS)
+      die("connect");
+    con->state = client_con::kConnecting;
+    con->in.clear();
+    con->out.clear();
+    con->offset = 0;
+    con->writing = true;
+    set_events(epfd_, con->fd, EPOLLOUT, con, EPOLL_CTL_ADD);
+  }
+
+  void reopen(client_con* con)
+  {
+    if(con->state == client_con::kBusy)
+      ++ result_->errors;
+    ++ result_->reconnects;
+    ::close(con->fd);
+    open(con);
+  }
+
+  void send(client_con* con, const std::string& data)
+  {
+    con->out.append(data);
+    if(!flush(con->fd, &con->out, &con->offset, &result_->bytes))
+      return;
+    update(con);
+  }
+
+  void update(client_con* con)
+  {
+    bool writing = !con->out.empty();
+    if(writing != con->writing)
+    {
+      con->writing = writing;
+      set_events(epfd_, con->fd, EPOLLIN | (writing ? EPOLLOUT : 0u), con);
+    }
+  }
+
+  void start(client_con* con, const due_request& r)
+  {
+    con->state = client_con::kBusy;
+    con->started = r.due;
+    send(con, reqs_.of[r.k][static_cast<size_t>(con->name)]);
+  }
+
+  // the connection can take a request
+  void ready(client_con* con)
+  {
+    con->state = client_con::kIdle;
+    std::deque<due_request>& backlog = backlog_[con->tunnel ? 0 : 1];
+    if(rate_ <= 0)
+    {
+      start(con, due_request{now_us(), con->tunnel ? kTunnel : pick(false, true)});
+    }
+    else if(!backlog.empty())
+    {
+      start(con, backlog.front());
+      backlog.pop_front();
+    }
+    else
+    {
+      idle_[con->tunnel ? 0 : 1].push_back(con);
+    }
+  }
+
+  void dispatch(const due_request& r)
+  {
+    int which = r.k == kTunnel ? 0 : 1;
+    std::vector<client_con*>& idle = idle_[which];
+    while(!idle.empty())
+    {
+      client_con* con = idle.back();
+      idle.pop_back();
+      // a connection lost while idle is reopened, it comes back through ready()
+      if(con->state == client_con::kIdle)
+      {
+        start(con, r);
+        return;
+      }
+    }
+    backlog_[which].push_back(r);
+  }
+
+  void handle(client_con* con, int64_t end)
+  {
+    if(con->state == client_con::kConnecting)
+    {
+      int error = 0;
+      socklen_t len = sizeof error;
+      ::getsockopt(con->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+      if(error != 0)
+      {
+        errno = error;
+        die("connect to proxy");
+      }
+      set_events(epfd_, con->fd, EPOLLIN, con);
+      con->writing = false;
+      if(con->tunnel)
+      {
+        con->state = client_con::kTunnelling;
+        send(con, reqs_.connect[static_cast<size_t>(con->name)]);
+      }
+      else
+      {
+        ready(con);
+      }
+      return;
+    }
+    bool ok = fill(con->fd, &con->in, &result_->bytes);
+    ok = flush(con->fd, &con->out, &con->offset, &result_->bytes) && ok;
+    for(;;)
+    {
+      size_t header = con->in.find("\r\n\r\n");
+      if(header == std::string::npos)
+        break;
+      size_t total = header + 4;
+      bool success = con->in.compare(0, 12, "HTTP/1.1 200") == 0 || con->in.compare(0, 12, "HTTP/1.0 200") == 0;
+      if(con->state == client_con::kTunnelling)
+      {
+        con->in.erase(0, total);
+        if(!success)
+        {
+          fprintf(stderr, "CONNECT refused by the proxy\n");
+          exit(1);
+        }
+        ready(con);
+        continue;
+      }
+      total += content_length(con->in, header);
+      if(con->in.size() < total || con->state != client_con::kBusy)
+        break;
+      con->in.erase(0, total);
+      int64_t now = now_us();
+      if(!success)
+        ++ result_->errors;
+      else if(now < end)
+        result_->latencies.push_back(now - con->started);
+      ready(con);
+    }
+    if(!ok)
+    {
+      reopen(con);
+      return;
+    }
+    update(con);
+  }
+
+  const options& opt_;
+  const requests& reqs_;
+  struct sockaddr_in proxy_;
+  double rate_;
+  client_result* result_;
+  int epfd_;
+  std::vector<client_con> cons_;  // never resized, epoll keeps pointers into it
+  std::mt19937 rng_;
+  bool has_tunnels_;
+  bool has_http_;
+  std::vector<client_con*> idle_[2];         // tunnel, http
+  std::deque<due_request> backlog_[2];
+};
+
+requests make_requests(const options& opt, uint16_t origin_port)
+{
+  requests reqs;
+  std::string body(opt.post_bytes, 'x');
+  for(int i = 0; i < opt.names; ++i)
+  {
+    std::string host = "origin" + std::to_string(i) + ".bench:" + std::to_string(origin_port);
+    reqs.connect.push_back("CONNECT " + host + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n");
+    reqs.of[kTunnel].push_back("GET /bench HTTP/1.1\r\nHost: " + host + "\r\n\r\n");
+    reqs.of[kGet].push_back("GET http://" + host + "/bench HTTP/1.1\r\nHost: " + host + "\r\n\r\n");
+    reqs.of[kPost].push_back("POST http://" + host + "/bench HTTP/1.1\r\nHost: " + host
+                             + "\r\nContent-Length: " + std::to_string(opt.post_bytes) + "\r\n\r\n" + body);
+  }
+  return reqs;
+}
+
+// proxy_server in a child process, before any thread of this one exists
+pid_t start_proxy(const options& opt, uint16_t port, uint16_t dns_port)
+{
+  pid_t pid = ::fork();
+  if(pid < 0)
+    die("fork");
+  if(pid > 0)
+    return pid;
+  muduo::Logger::setLogLevel(muduo::Logger::WARN);
+  muduo::net::EventLoop loop;
+  zy::proxy_server server(&loop, muduo::net::InetAddress("127.0.0.1", port), opt.proxy_threads);
+  server.set_dns_servers(std::vector<muduo::net::InetAddress>(1, muduo::net::InetAddress("127.0.0.1", dns_port)));
+  server.set_splice(opt.splice);
+  server.start();
+  loop.loop();
+  _exit(0);
+}
+
+void wait_for_proxy(const struct sockaddr_in& proxy)
+{
+  for(int i = 0; i < 500; ++i)
+  {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ok = ::connect(fd, reinterpret_cast<const struct sockaddr*>(&proxy), sizeof proxy) == 0;
+    ::close(fd);
+    if(ok)
+      return;
+    ::usleep(10 * 1000);
+  }
+  fprintf(stderr, "proxy doesn't accept connections\n");
+  exit(1);
+}
+
+double seconds_of(const struct timeval& tv)
+{
+  return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6;
+}
+
+double percentile_ms(const std::vector<int64_t>& sorted, double p)
+{
+  if(sorted.empty())
+    return 0;
+  size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())));
+  return static_cast<double>(sorted[index]) / 1000;
+}
+
+void usage(const char* name)
+{
+  fprintf(stderr, "usage: %s [-t proxy_threads] [-w client_threads] [-c connections] [-r rate] [-d seconds]\n"
+                  "       [-m connect,get,post] [-s response_bytes] [-b post_bytes] [-n names] [-S]\n"
+                  "       [-x ip:port] [-D dns_port]\n", name);
+  exit(1);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  options opt;
+  int c;
+  while((c = ::getopt(argc, argv, "t:w:c:r:d:m:s:b:n:Sx:D:")) != -1)
+  {
+    switch(c)
+    {
+      case 't': opt.proxy_threads = atoi(optarg); break;
+      case 'w': opt.client_threads = atoi(optarg); break;
+      case 'c': opt.connections = atoi(optarg); break;
+      case 'r': opt.rate = atof(optarg); break;
+      case 'd': opt.seconds = atof(optarg); break;
+      case 'm':
+        if(sscanf(optarg, "%d,%d,%d", &opt.weights[kTunnel], &opt.weights[kGet], &opt.weights[kPost]) != 3)
+          usage(argv[0]);
+        break;
+      case 's': opt.response_bytes = static_cast<size_t>(atol(optarg)); break;
+      case 'b': opt.post_bytes = static_cast<size_t>(atol(optarg)); break;
+      case 'n': opt.names = atoi(optarg); break;
+      case 'S': opt.splice = true; break;
+      case 'x': opt.proxy = optarg; break;
+      case 'D': opt.dns_port = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  int total_weight = opt.weights[kTunnel] + opt.weights[kGet] + opt.weights[kPost];
+  if(opt.proxy_threads < 0 || opt.client_threads < 1 || opt.connections < opt.client_threads || opt.names < 1
+     || opt.seconds <= 0 || opt.rate < 0 || opt.weights[kTunnel] < 0 || opt.weights[kGet] < 0 || opt.weights[kPost] < 0
+     || total_weight == 0)
+    usage(argv[0]);
+  ::signal(SIGPIPE, SIG_IGN);
+
+  uint16_t origin_port = 0;
+  int origin_fd = bind_loopback(SOCK_STREAM, &origin_port);
+  ::fcntl(origin_fd, F_SETFL, O_NONBLOCK);
+  uint16_t dns_port = static_cast<uint16_t>(opt.dns_port);
+  int dns_fd = bind_loopback(SOCK_DGRAM, &dns_port);
+  struct timeval timeout = {0, 100 * 1000};
+  ::setsockopt(dns_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+  struct sockaddr_in proxy;
+  pid_t proxy_pid = -1;
+  if(opt.proxy.empty())
+  {
+    // a free port for the proxy, nothing else binds loopback ports in the meantime
+    uint16_t port = 0;
+    ::close(bind_loopback(SOCK_STREAM, &port));
+    proxy = loopback(port);
+    proxy_pid = start_proxy(opt, port, dns_port);
+  }
+  else
+  {
+    size_t colon = opt.proxy.rfind(':');
+    proxy = loopback(0);
+    if(colon == std::string::npos || ::inet_pton(AF_INET, opt.proxy.substr(0, colon).c_str(), &proxy.sin_addr) != 1)
+      usage(argv[0]);
+    proxy.sin_port = htons(static_cast<uint16_t>(atoi(opt.proxy.c_str() + colon + 1)));
+  }
+
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(opt.response_bytes) + "\r\n\r\n"
+                         + std::string(opt.response_bytes, 'x');
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> servers;
+  for(int i = 0; i < opt.client_threads; ++i)
+    servers.emplace_back(serve_origin, origin_fd, &response, &stop);
+  servers.emplace_back(serve_dns, dns_fd, &stop);
+  wait_for_proxy(proxy);
+
+  // 按-m的权重分配连接, CONNECT连接只发隧道里的请求
+  int tunnels = 0;
+  if(opt.weights[kTunnel] > 0)
+    tunnels = std::max(1, static_cast<int>(static_cast<int64_t>(opt.connections) * opt.weights[kTunnel] / total_weight));
+  if(opt.weights[kGet] + opt.weights[kPost] == 0)
+    tunnels = opt.connections;
+  else if(tunnels == opt.connections)
+    tunnels = opt.connections - 1;
+
+  requests reqs = make_requests(opt, origin_port);
+  if(proxy_pid > 0)
+    printf("proxy_server on 127.0.0.1:%u, %d io threads%s", ntohs(proxy.sin_port), opt.proxy_threads,
+           opt.splice ? ", splice" : "");
+  else
+    printf("external proxy %s", opt.proxy.c_str());
+  printf(", origin 127.0.0.1:%u, dns 127.0.0.1:%u\n", origin_port, dns_port);
+  printf("%d connections (%d CONNECT), mix connect %d get %d post %d, %s, %.1f s, response %zu bytes, post %zu bytes\n",
+         opt.connections, tunnels, opt.weights[kTunnel], opt.weights[kGet], opt.weights[kPost],
+         opt.rate > 0 ? ("open loop " + std::to_string(static_cast<long long>(opt.rate)) + " req/s").c_str() : "closed loop",
+         opt.seconds, opt.response_bytes, opt.post_bytes);
+
+  std::vector<client_result> results(static_cast<size_t>(opt.client_threads));
+  std::vector<std::thread> clients;
+  int64_t start = now_us() + 100 * 1000;
+  int64_t end = start + static_cast<int64_t>(opt.seconds * 1e6);
+  for(int i = 0; i < opt.client_threads; ++i)
+  {
+    // consecutive connections per thread, so both kinds are spread when tunnels are few
+    int first = opt.connections * i / opt.client_threads;
+    int count = opt.connections * (i + 1) / opt.client_threads - first;
+    clients.emplace_back([&, i, first, count] {
+      client cl(opt, reqs, proxy, first, count, tunnels, opt.rate / opt.client_threads, &results[static_cast<size_t>(i)]);
+      while(now_us() < start)
+        ::usleep(1000);
+      cl.run(start, end);
+    });
+  }
+  for(auto& t : clients)
+    t.join();
+  double seconds = static_cast<double>(now_us() - start) / 1e6;
+
+  double proxy_cpu = -1;
+  if(proxy_pid > 0)
+  {
+    ::kill(proxy_pid, SIGTERM);
+    int status = 0;
+    struct rusage usage;
+    if(::wait4(proxy_pid, &status, 0, &usage) == proxy_pid)
+      proxy_cpu = seconds_of(usage.ru_utime) + seconds_of(usage.ru_stime);
+  }
+  stop = true;
+  for(auto& t : servers)
+    t.join();
+  ::close(origin_fd);
+  ::close(dns_fd);
+
+  client_result total;
+  for(const auto& r : results)
+  {
+    total.latencies.insert(total.latencies.end(), r.latencies.begin(), r.latencies.end());
+    total.bytes += r.bytes;
+    total.errors += r.errors;
+    total.reconnects += r.reconnects;
+    total.unsent += r.unsent;
+  }
+  std::sort(total.latencies.begin(), total.latencies.end());
+  size_t answered = total.latencies.size();
+  printf("%zu requests, %llu errors, %llu reconnects, %llu never sent\n", answered,
+         static_cast<unsigned long long>(total.errors), static_cast<unsigned long long>(total.reconnects),
+         static_cast<unsigned long long>(total.unsent));
+  printf("%.0f req/s, %.3f Gbit/s through the client sockets\n",
+         static_cast<double>(answered) / seconds, static_cast<double>(total.bytes) * 8 / 1e9 / seconds);
+  printf("latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+         percentile_ms(total.latencies, 0.5), percentile_ms(total.latencies, 0.99),
+         percentile_ms(total.latencies, 0.999), percentile_ms(total.latencies, 1));
+  if(proxy_cpu >= 0)
+    printf("proxy cpu %.3f s (%.1f%% of one core), %.2f us/request\n", proxy_cpu, proxy_cpu * 100 / seconds,
+           answered > 0 ? proxy_cpu * 1e6 / static_cast<double>(answered) : 0);
+  else
+    printf("proxy cpu not measured\n");
+  return 0;
+}
@@ -0,0 +1,109 @@
+// microbenchmark of the character scanning kernels used by http header parsing
+// usage: scan_bench [iterations]
+
+#include "../simd_scan.h"
+#include "../http_header.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace zy;
+
+namespace
+{
+
+// a typical browser request, a few hundred bytes of headers
+const char kRequest[] =
+    "GET http://www.example.com/static/js/app.2f1c9b.js?v=20171017 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/61.0.3163.100 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: zh-CN,zh;q=0.8,en-US;q=0.6,en;q=0.4\r\n"
+    "Cookie: session_id=0123456789abcdef0123456789abcdef; theme=dark; _ga=GA1.2.1234567890.1234567890\r\n"
+    "If-None-Match: \"5a1c9b-2f1c\"\r\n"
+    "If-Modified-Since: Tue, 17 Oct 2017 08:00:00 GMT\r\n"
+    "\r\n";
+
+const char kHost[] = "static-content.cdn-cache.edge-node-0042.www.example-service.com";
+
+double now_ns()
+{
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// byte at a time versions, equal to what the parser did before
+size_t count_lines_bytewise(const char* begin, const char* end)
+{
+  size_t lines = 0;
+  for(const char* p = begin; p != end; ++p)
+  {
+    if(*p == '\n')
+      ++lines;
+  }
+  return lines;
+}
+
+size_t count_lines(const char* begin, const char* end)
+{
+  size_t lines = 0;
+  const char* p = begin;
+  while((p = scan::find_char(p, end, '\n')) != end)
+  {
+    ++lines;
+    ++p;
+  }
+  return lines;
+}
+
+volatile size_t g_sink;
+
+template <typename Func>
+void run(const char* name, int iterations, size_t bytes, Func func)
+{
+  double start = now_ns();
+  for(int i = 0; i < iterations; ++i)
+    func();
+  double elapsed = now_ns() - start;
+  printf("  %-28s %8.1f ns/op %10.1f MB/s\n", name, elapsed / iterations,
+         static_cast<double>(bytes) * iterations / elapsed * 1e3);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+  const char* begin = kRequest;
+  const char* end = kRequest + sizeof(kRequest) - 1;
+  std::string buffer(begin, end);
+  std::string host(kHost);
+  std::vector<scan::isa> isas;
+  for(int i = scan::kScalar; i <= scan::detect_isa(); ++i)
+    isas.push_back(static_cast<scan::isa>(i));
+
+  printf("request %zu bytes, host %zu bytes, %d iterations, best isa %s\n",
+         buffer.size(), host.size(), iterations, scan::isa_name(scan::detect_isa()));
+  printf("baseline\n");
+  run("find '\\n' bytewise", iterations, buffer.size(), [&]() { g_sink = count_lines_bytewise(begin, end); });
+
+  for(auto which : isas)
+  {
+    scan::use_isa(which);
+    printf("%s\n", scan::isa_name(scan::current_isa()));
+    run("find '\\n'", iterations, buffer.size(), [&]() { g_sink = count_lines(begin, end); });
+    run("find_non_label_char", iterations, host.size(),
+        [&]() { g_sink = static_cast<size_t>(scan::find_non_label_char(host.data(), host.data() + host.size()) - host.data()); });
+    run("http_request::parse", iterations / 10, buffer.size(), [&]() {
+      http_request request;
+      g_sink = request.parse(begin, buffer.size());
+    });
+  }
+  scan::use_isa(scan::detect_isa());
+}
@@ -0,0 +1,214 @@
+// throughput and cpu cost of forwarding a CONNECT tunnel through user space Buffers vs splice(2)
+// usage: splice_bench [megabytes] [rounds]
+//
+// sender -> [tcp] -> forwarder -> [tcp] -> receiver, all on loopback. the forwarder is a single
+// epoll thread like an io loop; "buffer" reads into a 64KiB user buffer and writes it out like
+// muduo Buffer does, "splice" moves the bytes through a pipe as splicer does.
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+namespace
+{
+
+const size_t kChunk = 64 * 1024;
+const size_t kPipeSize = 1024 * 1024;  // the same as the tunnel high water mark
+
+enum mode
+{
+  kBuffer,
+  kSplice
+};
+
+void die(const char* what)
+{
+  perror(what);
+  exit(1);
+}
+
+// connected loopback pair
+void tcp_pair(int* client, int* server)
+{
+  int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof addr;
+  if(listener < 0 || ::bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0
+     || ::listen(listener, 1) < 0 || ::getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr), &len) < 0)
+    die("listen");
+  *client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(*client < 0 || ::connect(*client, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+    die("connect");
+  *server = ::accept(listener, nullptr, nullptr);
+  if(*server < 0)
+    die("accept");
+  ::close(listener);
+}
+
+void send_all(int fd, size_t total)
+{
+  std::vector<char> buf(kChunk, 'x');
+  size_t sent = 0;
+  while(sent < total)
+  {
+    ssize_t n = ::write(fd, buf.data(), std::min(buf.size(), total - sent));
+    if(n <= 0)
+      die("send");
+    sent += static_cast<size_t>(n);
+  }
+  ::shutdown(fd, SHUT_WR);
+}
+
+void receive_all(int fd, size_t* received)
+{
+  std::vector<char> buf(kChunk);
+  ssize_t n;
+  while((n = ::read(fd, buf.data(), buf.size())) > 0)
+    *received += static_cast<size_t>(n);
+}
+
+void wait_for(int epfd, int fd, uint32_t events)
+{
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  ::epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  struct epoll_event out;
+  while(::epoll_wait(epfd, &out, 1, -1) < 0 && errno == EINTR)
+  {
+  }
+}
+
+// forward from -> to until eof, return cpu seconds used by this thread
+double forward(mode m, int from, int to)
+{
+  int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev;
+  ev.events = 0;
+  ev.data.fd = from;
+  ::epoll_ctl(epfd, EPOLL_CTL_ADD, from, &ev);
+  ev.data.fd = to;
+  ::epoll_ctl(epfd, EPOLL_CTL_ADD, to, &ev);
+
+  std::vector<char> buf(kChunk);
+  int fds[2] = {-1, -1};
+  if(m == kSplice)
+  {
+    if(::pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+      die("pipe2");
+    ::fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(kPipeSize));
+  }
+
+  bool eof = false;
+  size_t pending = 0;   // bytes read but not written yet
+  size_t offset = 0;
+  while(!eof || pending > 0)
+  {
+    if(pending == 0)
+    {
+      ssize_t n = (m == kSplice)
+          ? ::splice(from, nullptr, fds[1], nullptr, kPipeSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+          : ::read(from, buf.data(), buf.size());
+      if(n == 0)
+      {
+        eof = true;
+        continue;
+      }
+      if(n < 0)
+      {
+        if(errno != EAGAIN)
+          die("read");
+        wait_for(epfd, from, EPOLLIN);
+        continue;
+      }
+      pending = static_cast<size_t>(n);
+      offset = 0;
+    }
+    ssize_t n = (m == kSplice)
+        ? ::splice(fds[0], nullptr, to, nullptr, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+        : ::write(to, buf.data() + offset, pending);
+    if(n < 0)
+    {
+      if(errno != EAGAIN)
+        die("write");
+      wait_for(epfd, to, EPOLLOUT);
+      continue;
+    }
+    pending -= static_cast<size_t>(n);
+    offset += static_cast<size_t>(n);
+  }
+  ::shutdown(to, SHUT_WR);
+  if(fds[0] >= 0)
+  {
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+  ::close(epfd);
+
+  struct rusage usage;
+  ::getrusage(RUSAGE_THREAD, &usage);
+  return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+      + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void run(mode m, size_t bytes)
+{
+  int sender, in, out, receiver;
+  tcp_pair(&sender, &in);
+  tcp_pair(&out, &receiver);
+  ::fcntl(in, F_SETFL, O_NONBLOCK);
+  ::fcntl(out, F_SETFL, O_NONBLOCK);
+
+  size_t received = 0;
+  double cpu = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::thread forwarder([&] { cpu = forward(m, in, out); });
+  std::thread reader(receive_all, receiver, &received);
+  send_all(sender, bytes);
+  forwarder.join();
+  reader.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if(received != bytes)
+  {
+    fprintf(stderr, "received %zu of %zu bytes\n", received, bytes);
+    exit(1);
+  }
+  double gb = static_cast<double>(bytes) / 1e9;
+  printf("%-8s %8.1f MB/s   %6.3f Gbit/s   forwarder cpu %6.3f s/GB\n", m == kSplice ? "splice" : "buffer",
+         static_cast<double>(bytes) / 1e6 / seconds, gb * 8 / seconds, cpu / gb);
+  ::close(sender);
+  ::close(in);
+  ::close(out);
+  ::close(receiver);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  size_t megabytes = argc > 1 ? static_cast<size_t>(atol(argv[1])) : 2048;
+  int rounds = argc > 2 ? atoi(argv[2]) : 3;
+  size_t bytes = megabytes * 1024 * 1024;
+  printf("forward %zu MiB through one tunnel, %d rounds\n", megabytes, rounds);
+  for(int i = 0; i < rounds; ++i)
+  {
+    run(kBuffer, bytes);
+    run(kSplice, bytes);
+  }
+}
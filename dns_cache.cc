@@ -0,0 +1,448 @@
+#include "dns_cache.h"
+#include "metrics.h"
+
+#include <muduo/base/Logging.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+using namespace zy;
+
+namespace impl
+{
+
+// a shard smaller than this isn't worth the trouble
+const size_t kMinSlots = 16;
+
+// bits of dns_cache::shard::state
+const uint8_t kHits = 0x7f;
+const uint8_t kRefreshing = 0x80;
+
+// 快照文件: 文件头后面是变长的记录, 本机字节序, 只给同一台机器上重启的进程读
+const char kSnapshotMagic[4] = {'z', 'y', 'd', 'c'};
+const uint32_t kSnapshotVersion = 1;
+
+struct snapshot_header
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+};
+
+// followed by name_length bytes of the name and count addresses of 4 or 16 bytes
+struct snapshot_record
+{
+  int64_t expire;  // microseconds since epoch
+  uint8_t ipv6;
+  uint8_t name_length;
+  uint8_t count;
+  uint8_t reserved;
+};
+
+}
+
+static_assert(dns_cache::kShards == 16, "shard_of takes the top 4 bits of the hash");
+
+dns_cache::dns_cache(size_t byte_budget)
+  : shards_(new shard[kShards])
+{
+  set_byte_budget(byte_budget);
+}
+
+void dns_cache::set_byte_budget(size_t byte_budget)
+{
+  size_t slots = impl::kMinSlots;
+  while(slots * 2 * sizeof(entry) * kShards <= byte_budget)
+    slots *= 2;
+  for(size_t k = 0; k < kShards; ++k)
+  {
+    shard& s = shards_[k];
+    muduo::MutexLockGuard lock(s.mutex);
+    std::vector<entry> table(slots);
+    for(auto& e : table)
+      e.used = false;
+    s.table.swap(table);
+    s.state.reset(new std::atomic<uint8_t>[slots]);
+    for(size_t i = 0; i < slots; ++i)
+      s.state[i].store(0, std::memory_order_relaxed);
+    s.sequence.store(0, std::memory_order_relaxed);
+    s.mask = slots - 1;
+    s.size = 0;
+    // 线性探测在装载率超过3/4后变慢
+    s.limit = slots / 4 * 3;
+    s.hand = 0;
+  }
+}
+
+size_t dns_cache::size() const
+{
+  size_t size = 0;
+  for(size_t k = 0; k < kShards; ++k)
+  {
+    muduo::MutexLockGuard lock(shards_[k].mutex);
+    size += shards_[k].size;
+  }
+  return size;
+}
+
+uint64_t dns_cache::hash_of(const std::string &name, bool ipv6)
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for(char c : name)
+  {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  hash ^= ipv6 ? 28 : 1;
+  hash *= 1099511628211ULL;
+  // 乘法只把低位扩散到高位, 下标用的是低位, 再把高位混回来(murmur3的fmix64)
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+long dns_cache::find(const shard &s, uint64_t hash, const std::string &name, bool ipv6)
+{
+  // 读者看到的可能是写到一半的表, 最多探测整个表一遍
+  size_t i = hash & s.mask;
+  for(size_t n = 0; n <= s.mask && s.table[i].used; ++n, i = (i + 1) & s.mask)
+  {
+    const entry& e = s.table[i];
+    if(e.hash == hash && e.ipv6 == ipv6 && e.name_length == name.size()
+       && memcmp(e.name, name.data(), name.size()) == 0)
+      return static_cast<long>(i);
+  }
+  return -1;
+}
+
+void dns_cache::erase(shard &s, size_t i)
+{
+  s.table[i].used = false;
+  -- s.size;
+  // 后面同一段连续的槽位里, 不在原位的元素向前移动填补空位
+  for(size_t j = (i + 1) & s.mask; s.table[j].used; j = (j + 1) & s.mask)
+  {
+    size_t home = s.table[j].hash & s.mask;
+    bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+    if(stays)
+      continue;
+    s.table[i] = s.table[j];
+    s.state[i].store(s.state[j].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    s.table[j].used = false;
+    i = j;
+  }
+}
+
+void dns_cache::evict(shard &s, int64_t now)
+{
+  // every entry loses its bit at most once, two rounds always find one
+  for(;;)
+  {
+    // 指针越过淘汰的槽位, 否则补位上来的元素接连在同一处被淘汰, 那里的连续段越挤越长
+    size_t i = s.hand;
+    s.hand = (s.hand + 1) & s.mask;
+    const entry& e = s.table[i];
+    if(!e.used)
+      continue;
+    if(e.expire <= now)
+    {
+      metrics::add(metrics::kDnsCacheExpirations);
+      erase(s, i);
+      return;
+    }
+    if((s.state[i].load(std::memory_order_relaxed) & impl::kHits) == 0)
+    {
+      metrics::add(metrics::kDnsCacheEvictions);
+      erase(s, i);
+      return;
+    }
+    // 第二次机会, 命中次数重新计算, 保留刷新标记
+    s.state[i].fetch_and(impl::kRefreshing, std::memory_order_relaxed);
+  }
+}
+
+dns_cache::result dns_cache::lookup(const std::string &name, bool ipv6, muduo::Timestamp now, AddressList *addrs, bool* refresh)
+{
+  if(refresh)
+    *refresh = false;
+  if(name.size() > kMaxName)
+    return kMiss;
+  uint64_t hash = hash_of(name, ipv6);
+  const shard& s = shard_of(hash);
+  entry e;
+  long i;
+  // seqlock: 把槽位复制出来, 序号没变才说明复制的时候没有写入; 写入很少, 几乎不会重读
+  for(;;)
+  {
+    uint32_t sequence = s.sequence.load(std::memory_order_acquire);
+    if(sequence & 1)
+    {
+      // 写入者持锁时可能被换下cpu
+      ::sched_yield();
+      continue;
+    }
+    i = find(s, hash, name, ipv6);
+    if(i >= 0)
+      memcpy(&e, &s.table[static_cast<size_t>(i)], sizeof e);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(s.sequence.load(std::memory_order_relaxed) == sequence)
+      break;
+  }
+  // 过期的槽位留给写入者淘汰, 读者不改表
+  if(i < 0 || e.expire <= now.microSecondsSinceEpoch())
+    return kMiss;
+  // 槽位此后可能被改写, 状态记到别的条目上也只影响淘汰和刷新的时机
+  std::atomic<uint8_t>& state = s.state[static_cast<size_t>(i)];
+  uint8_t old = state.load(std::memory_order_relaxed);
+  if((old & impl::kHits) < kHotHits)
+  {
+    // 计数丢失一次没有关系, 不重试
+    state.compare_exchange_weak(old, static_cast<uint8_t>(old + 1), std::memory_order_relaxed);
+  }
+  else if(refresh && !(old & impl::kRefreshing) && e.count > 0 && e.refresh <= now.microSecondsSinceEpoch())
+  {
+    *refresh = state.compare_exchange_strong(old, static_cast<uint8_t>(old | impl::kRefreshing), std::memory_order_relaxed);
+  }
+  if(e.count == 0)
+    return kNegative;
+  addrs->clear();
+  for(uint8_t k = 0; k < e.count; ++k)
+  {
+    if(e.ipv6)
+    {
+      struct sockaddr_in6 addr6;
+      memset(&addr6, 0, sizeof addr6);
+      addr6.sin6_family = AF_INET6;
+      memcpy(&addr6.sin6_addr, e.addrs[k], 16);
+      addrs->push_back(muduo::net::InetAddress(addr6));
+    }
+    else
+    {
+      struct sockaddr_in addr4;
+      memset(&addr4, 0, sizeof addr4);
+      addr4.sin_family = AF_INET;
+      memcpy(&addr4.sin_addr, e.addrs[k], 4);
+      addrs->push_back(muduo::net::InetAddress(addr4));
+    }
+  }
+  return kHit;
+}
+
+void dns_cache::insert(const std::string &name, bool ipv6, const AddressList &addrs, double ttl, muduo::Timestamp now)
+{
+  if(name.size() > kMaxName || ttl <= 0)
+    return;
+  int64_t expire = muduo::addTime(now, ttl).microSecondsSinceEpoch();
+  int64_t refresh = muduo::addTime(now, ttl * (1 - kRefreshAhead)).microSecondsSinceEpoch();
+  uint64_t hash = hash_of(name, ipv6);
+  shard& s = shard_of(hash);
+  entry e;
+  memset(&e, 0, sizeof e);
+  e.hash = hash;
+  e.expire = expire;
+  e.refresh = refresh;
+  e.used = true;
+  e.ipv6 = ipv6;
+  e.name_length = static_cast<uint8_t>(name.size());
+  memcpy(e.name, name.data(), name.size());
+  e.count = 0;
+  for(const auto& addr : addrs)
+  {
+    if(e.count == kMaxAddresses)
+      break;
+    const struct sockaddr* sa = addr.getSockAddr();
+    if(ipv6 && sa->sa_family == AF_INET6)
+      memcpy(e.addrs[e.count++], &reinterpret_cast<const struct sockaddr_in6*>(sa)->sin6_addr, 16);
+    else if(!ipv6 && sa->sa_family == AF_INET)
+      memcpy(e.addrs[e.count++], &reinterpret_cast<const struct sockaddr_in*>(sa)->sin_addr, 4);
+  }
+
+  muduo::MutexLockGuard lock(s.mutex);
+  // 序号变成奇数后才改表, 改完再变回偶数
+  s.sequence.store(s.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  long found = find(s, hash, name, ipv6);
+  size_t i;
+  uint8_t state = 0;
+  if(found >= 0)
+  {
+    // 刷新后的条目仍然是热的, 下次快过期时接着刷新
+    i = static_cast<size_t>(found);
+    state = s.state[i].load(std::memory_order_relaxed) & impl::kHits;
+  }
+  else
+  {
+    if(s.size >= s.limit)
+      evict(s, now.microSecondsSinceEpoch());
+    for(i = hash & s.mask; s.table[i].used; i = (i + 1) & s.mask)
+    {
+    }
+    ++ s.size;
+  }
+  s.table[i] = e;
+  s.state[i].store(state, std::memory_order_relaxed);
+  s.sequence.store(s.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool dns_cache::save(const std::string &path, muduo::Timestamp now) const
+{
+  // 持锁时只把活着的条目复制出来, 写文件在锁外
+  std::vector<entry> live;
+  for(size_t k = 0; k < kShards; ++k)
+  {
+    const shard& s = shards_[k];
+    muduo::MutexLockGuard lock(s.mutex);
+    for(const auto& e : s.table)
+    {
+      if(e.used && e.expire > now.microSecondsSinceEpoch())
+        live.push_back(e);
+    }
+  }
+  size_t length = sizeof(impl::snapshot_header);
+  for(const auto& e : live)
+    length += sizeof(impl::snapshot_record) + e.name_length + e.count * (e.ipv6 ? 16 : 4);
+
+  std::string temporary(path + ".tmp");
+  int fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0)
+  {
+    LOG_SYSERR << "open " << temporary;
+    return false;
+  }
+  void* map = MAP_FAILED;
+  if(::ftruncate(fd, static_cast<off_t>(length)) == 0)
+    map = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    LOG_SYSERR << "map " << temporary;
+    ::close(fd);
+    ::unlink(temporary.c_str());
+    return false;
+  }
+  char* out = static_cast<char*>(map);
+  impl::snapshot_header header;
+  memcpy(header.magic, impl::kSnapshotMagic, sizeof header.magic);
+  header.version = impl::kSnapshotVersion;
+  header.count = live.size();
+  memcpy(out, &header, sizeof header);
+  out += sizeof header;
+  for(const auto& e : live)
+  {
+    impl::snapshot_record record;
+    memset(&record, 0, sizeof record);
+    record.expire = e.expire;
+    record.ipv6 = e.ipv6;
+    record.name_length = e.name_length;
+    record.count = e.count;
+    memcpy(out, &record, sizeof record);
+    out += sizeof record;
+    memcpy(out, e.name, e.name_length);
+    out += e.name_length;
+    size_t width = e.ipv6 ? 16 : 4;
+    for(uint8_t i = 0; i < e.count; ++i)
+    {
+      memcpy(out, e.addrs[i], width);
+      out += width;
+    }
+  }
+  bool ok = ::msync(map, length, MS_SYNC) == 0;
+  ::munmap(map, length);
+  ::close(fd);
+  // 改名是原子的, 读者看到的总是完整的旧文件或新文件
+  if(!ok || ::rename(temporary.c_str(), path.c_str()) != 0)
+  {
+    LOG_SYSERR << "save dns cache snapshot " << path;
+    ::unlink(temporary.c_str());
+    return false;
+  }
+  LOG_INFO << "saved " << live.size() << " dns cache entries to " << path;
+  return true;
+}
+
+size_t dns_cache::load(const std::string &path, muduo::Timestamp now)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+  {
+    LOG_INFO << "no dns cache snapshot " << path;
+    return 0;
+  }
+  struct stat st;
+  if(::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(impl::snapshot_header))
+  {
+    ::close(fd);
+    LOG_WARN << "ignore dns cache snapshot " << path << ", too short";
+    return 0;
+  }
+  size_t length = static_cast<size_t>(st.st_size);
+  void* map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(map == MAP_FAILED)
+  {
+    LOG_SYSERR << "map " << path;
+    return 0;
+  }
+  const char* in = static_cast<const char*>(map);
+  const char* end = in + length;
+  impl::snapshot_header header;
+  memcpy(&header, in, sizeof header);
+  in += sizeof header;
+  size_t loaded = 0;
+  if(memcmp(header.magic, impl::kSnapshotMagic, sizeof header.magic) != 0 || header.version != impl::kSnapshotVersion)
+  {
+    LOG_WARN << "ignore dns cache snapshot " << path << ", unknown format";
+    header.count = 0;
+  }
+  AddressList addrs;
+  for(uint64_t n = 0; n < header.count; ++n)
+  {
+    impl::snapshot_record record;
+    if(static_cast<size_t>(end - in) < sizeof record)
+      break;
+    memcpy(&record, in, sizeof record);
+    in += sizeof record;
+    size_t width = record.ipv6 ? 16 : 4;
+    size_t rest = record.name_length + record.count * width;
+    // 截断或损坏的文件, 到此为止
+    if(record.name_length == 0 || record.name_length > kMaxName || record.count > kMaxAddresses
+       || static_cast<size_t>(end - in) < rest)
+      break;
+    std::string name(in, record.name_length);
+    in += record.name_length;
+    addrs.clear();
+    for(uint8_t i = 0; i < record.count; ++i, in += width)
+    {
+      if(record.ipv6)
+      {
+        struct sockaddr_in6 addr6;
+        memset(&addr6, 0, sizeof addr6);
+        addr6.sin6_family = AF_INET6;
+        memcpy(&addr6.sin6_addr, in, 16);
+        addrs.push_back(muduo::net::InetAddress(addr6));
+      }
+      else
+      {
+        struct sockaddr_in addr4;
+        memset(&addr4, 0, sizeof addr4);
+        addr4.sin_family = AF_INET;
+        memcpy(&addr4.sin_addr, in, 4);
+        addrs.push_back(muduo::net::InetAddress(addr4));
+      }
+    }
+    double ttl = static_cast<double>(record.expire - now.microSecondsSinceEpoch()) / muduo::Timestamp::kMicroSecondsPerSecond;
+    if(ttl <= 0)
+      continue;
+    insert(name, record.ipv6 != 0, addrs, ttl, now);
+    ++ loaded;
+  }
+  ::munmap(map, length);
+  LOG_INFO << "loaded " << loaded << " dns cache entries from " << path;
+  return loaded;
+}
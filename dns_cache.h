@@ -0,0 +1,112 @@
+#pragma once
+
+#include <muduo/net/InetAddress.h>
+#include <muduo/base/Timestamp.h>
+#include <muduo/base/Mutex.h>
+#include <boost/noncopyable.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace zy
+{
+// dns_resolver的缓存, 可以被所有loop线程的resolver共享: 按hash分成kShards个分片, 每个分片是开放寻址(线性探测)的平坦数组,
+// 名字和地址都内联在槽位里. 读不加锁也不写共享数据: 分片带seqlock序号, 读的过程中分片被改过就重读; 写按分片加锁
+// 过期按真实的ttl, 满了以后用CLOCK算法淘汰; 常用的条目在过期前交给一个调用者提前刷新
+class dns_cache : boost::noncopyable
+{
+ public:
+  typedef std::vector<muduo::net::InetAddress> AddressList;
+
+  // writers of different shards don't wait for each other
+  const static size_t kShards = 16;
+  // hits since the CLOCK hand last passed that make an entry hot
+  const static uint8_t kHotHits = 4;
+  // a hot entry is refreshed in this last part of its ttl
+  constexpr static double kRefreshAhead = 0.1;
+
+  // the longest name dns allows, so every name fits inline
+  const static size_t kMaxName = 253;
+  // addresses kept for one name, the rest of a larger answer is dropped
+  const static size_t kMaxAddresses = 8;
+
+  enum result
+  {
+    kMiss,
+    kHit,       // addresses found
+    kNegative   // the name is known to have no address of the type
+  };
+
+  explicit dns_cache(size_t byte_budget = 8 * 1024 * 1024);
+
+  // the table takes at most byte_budget bytes, it is emptied; call it before the cache is shared
+  void set_byte_budget(size_t byte_budget);
+
+  // from any thread, never blocks; *refresh is set on a hit of a hot entry about to expire, only one caller
+  // gets it until the entry is inserted again and should ask for the name while the old answer is served
+  result lookup(const std::string& name, bool ipv6, muduo::Timestamp now, AddressList* addrs, bool* refresh = nullptr);
+
+  // from any thread; empty addrs is a negative entry; ttl in seconds, nothing is stored if it isn't positive
+  void insert(const std::string& name, bool ipv6, const AddressList& addrs, double ttl, muduo::Timestamp now);
+
+  // entries of all shards, a snapshot while others insert
+  size_t size() const;
+
+  size_t capacity() const { return (shards_[0].mask + 1) * kShards; }
+
+  size_t bytes() const { return capacity() * sizeof(entry); }
+
+  // 快照: 未过期的条目按绝对过期时间写入文件, 重启后读回来, 不必从空缓存开始
+  // write the live entries to path through a temporary file renamed over it, false on an io error
+  bool save(const std::string& path, muduo::Timestamp now) const;
+
+  // insert the entries of a snapshot that haven't expired by now, returns how many
+  size_t load(const std::string& path, muduo::Timestamp now);
+
+ private:
+  struct entry
+  {
+    uint64_t hash;
+    int64_t expire;        // microseconds since epoch
+    int64_t refresh;       // a hot entry is refreshed from then on
+    bool used;
+    bool ipv6;
+    uint8_t name_length;
+    uint8_t count;         // addresses, 0 for a negative entry
+    char name[kMaxName];
+    uint8_t addrs[kMaxAddresses][16];  // 4 bytes of ipv4 or 16 bytes of ipv6, network order
+  };
+
+  struct shard
+  {
+    mutable muduo::MutexLock mutex;  // held by writers
+    std::atomic<uint32_t> sequence;  // seqlock, odd while the table is being changed
+    std::vector<entry> table;        // size is a power of two
+    // 每个槽位的状态, 查找不持锁修改: 低7位是CLOCK指针上次经过后的命中次数(到kHotHits为止), 最高位表示已有调用者在刷新
+    // 和表分开存放, 热条目命中时只读不写
+    std::unique_ptr<std::atomic<uint8_t>[]> state;
+    size_t mask;
+    size_t size;
+    size_t limit;  // most entries before evicting, keeps probe sequences short
+    size_t hand;   // CLOCK hand
+  };
+
+  static uint64_t hash_of(const std::string& name, bool ipv6);
+
+  // the top bits pick the shard, the low bits the slot in it
+  shard& shard_of(uint64_t hash) { return shards_[hash >> 60]; }
+
+  // slot of the entry, -1 if absent; readers check the sequence afterwards
+  static long find(const shard& s, uint64_t hash, const std::string& name, bool ipv6);
+
+  // free slot i and shift the following run back, so no tombstone is needed
+  static void erase(shard& s, size_t i);
+
+  // free one slot by CLOCK, expired entries go first; counted in metrics of the calling thread
+  static void evict(shard& s, int64_t now);
+
+  std::unique_ptr<shard[]> shards_;
+};
+}
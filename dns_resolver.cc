@@ -1,94 +1,80 @@
 #include "dns_resolver.h"
+#include "simd_scan.h"
+#include "metrics.h"
 #include <muduo/base/Logging.h>
 
 #include <muduo/net/SocketsOps.h>
 #include <muduo/net/EventLoop.h>
 #include <boost/bind.hpp>
 #include <muduo/net/Channel.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <arpa/inet.h>
 
 using namespace zy;
 
 namespace impl
 {
-int createNonblockingUdpOrDie(sa_family_t family)
+// 1-65535 in decimal
+bool parse_port(const std::string& text, uint16_t* port)
 {
-  int sockfd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
-  if(sockfd < 0)
-  {
-    LOG_FATAL << "zy::createNonblockingOrDie";
-  }
-  return sockfd;
+  if(text.empty() || text.size() > 5 || text.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  unsigned long value = ::strtoul(text.c_str(), nullptr, 10);
+  if(value == 0 || value > 65535)
+    return false;
+  *port = static_cast<uint16_t>(value);
+  return true;
 }
 
+// RCODE of a failed lookup worth remembering
+const uint8_t kServerFailure = 2;
+const uint8_t kNameError = 3;
+// RCODE of a server that doesn't understand the query, e.g. an old one without EDNS0
+const uint8_t kFormatError = 1;
+
+// TYPE of the EDNS0 pseudo record
+const uint16_t kOptType = 41;
+
 bool convert_host(const std::string& host, muduo::net::Buffer* buf)
 {
-  std::string label;
-  for(auto& ch : host)
+  const char* label = host.data();
+  const char* end = label + host.size();
+  while(label != end)
   {
-    if(std::isalpha(ch) || std::isdigit(ch))
-    {
-      label.push_back(ch);
-    }
-    else if( ch == '_')
+    const char* dot = zy::scan::find_char(label, end, '.');
+    size_t length = static_cast<size_t>(dot - label);
+    if(length == 0)
     {
-      if(label.empty())
-      {
-        LOG_ERROR << "label can't start with " << ch;
-        return false;
-      }
-      else
-        label.push_back(ch);
-    }
-    else if(ch == '.')
-    {
-      if(label.empty())
-      {
-        LOG_ERROR << "invalid . pos";
-        return false;
-      }
-      else if(label.back() == '_')
-      {
-        LOG_ERROR << "label can't stop with " << ch;
-        return false;
-      }
-      else if (label.size() > 63)
-      {
-        LOG_ERROR << "label can't be longer than 63 bytes";
-        return false;
-      }
-      else
-      {
-        uint8_t length = static_cast<uint8_t>(label.size());
-        buf->appendInt8(length);
-        buf->append(label.c_str());
-        label.clear();
-      }
+      LOG_ERROR << "invalid . pos";
+      return false;
     }
-    else
+    if(zy::scan::find_non_label_char(label, dot) != dot)
     {
       LOG_ERROR << "invalid character in label";
       return false;
     }
-  }
-  if(!label.empty())
-  {
-    if(label.back() == '_')
+    if(*label == '_' || *label == '-')
     {
-      LOG_ERROR << "label can't stop with " << label.back();
+      LOG_ERROR << "label can't start with " << *label;
       return false;
     }
-    if(label.size() > 63)
+    if(*(dot - 1) == '_' || *(dot - 1) == '-')
     {
-      LOG_ERROR << "label can't be longer than 63 bytes";
+      LOG_ERROR << "label can't stop with " << *(dot - 1);
       return false;
     }
-    else
+    if(length > 63)
     {
-      // 长度是8bit
-      uint8_t length = static_cast<uint8_t>(label.size());
-      buf->appendInt8(length);
-      buf->append(label.c_str());
+      LOG_ERROR << "label can't be longer than 63 bytes";
+      return false;
     }
+    // 长度是8bit
+    buf->appendInt8(static_cast<int8_t>(length));
+    buf->append(label, length);
+    // a trailing dot means the root label
+    label = (dot == end) ? end : dot + 1;
   }
   //末尾是0
   buf->appendInt8(0);
@@ -98,7 +84,7 @@ bool convert_host(const std::string& host, muduo::net::Buffer* buf)
 // todo: check ptr or domain_name
 bool retrieve_name(muduo::net::Buffer* buf)
 {
-  if(buf->readableBytes() <= 1)
+  if(buf->readableBytes() < 1)
   {
     return false;
   }
@@ -107,6 +93,9 @@ bool retrieve_name(muduo::net::Buffer* buf)
   while (buf->readableBytes() >= 1 && (label_length = static_cast<uint8_t>(buf->readInt8())) != 0) {
     if((label_length >> 6 & 0x3) == 0x3)
     {
+      // 压缩指针的第二个字节
+      if(buf->readableBytes() < 1)
+        return false;
       buf->retrieve(1);
       break;
     }
@@ -132,8 +121,8 @@ struct flag1
   uint8_t QR () const { return flag1 >> 7 & 1; }
   uint8_t Opcode() const { return flag1 >> 3 & 0xf; }
   uint8_t AA() const { return flag1 >> 2 & 1; }
-  uint8_t RD() const { return flag1 >> 1 & 1; }
-  uint8_t RA() const { return flag1 & 1; }
+  uint8_t TC() const { return flag1 >> 1 & 1; }
+  uint8_t RD() const { return flag1 & 1; }
 }__attribute__((__packed__));
 
 struct flag2
@@ -170,39 +159,284 @@ struct query_tail
 
 }
 
-dns_resolver::dns_resolver(muduo::net::EventLoop *loop, double timeout)
-    : sockfd_(impl::createNonblockingUdpOrDie(AF_INET)),
-      loop_(loop),
-      channel_(new muduo::net::Channel(loop_, sockfd_)),
-      dns_datas_(),
+dns_resolver::dns_resolver(muduo::net::EventLoop *loop, double timeout, double negative_ttl)
+    : loop_(loop),
+      servers_(),
+      retired_(),
+      slots_(kSlots),
+      free_(kSlots),
+      deadlines_(),
+      rng_(std::random_device()()),
+      queryBuffer_(),
       inputBuffer_(),
-      outputBuffer_(),
+      packets_(),
+      packet_size_(0),
+      recvMsgs_(kRecvBatch),
+      recvIovecs_(kRecvBatch),
+      sendMsgs_(),
+      sendIovecs_(),
+      flush_queued_(false),
+      io_(),
       timeout_(timeout),
-      mutex_(),
-      v4_buffers_(TTL),
-      v6_buffers_(TTL),
-      v4_datas_(),
-      v6_datas_()
+      attempt_timeout_(timeout / (MAX_TIMEOUT + 1)),
+      hosts_(new hosts_file(loop)),
+      cache_(new dns_cache()),
+      lookups_(),
+      inflight_(),
+      negative_ttl_(negative_ttl),
+      edns_payload_(0),
+      sweep_timer_()
 {
-  // 系统内置dns在127.0.1.1上面监听
-  muduo::net::InetAddress local_dns("127.0.1.1", 53, false);
+  for(size_t i = 0; i < kSlots; ++i)
+    free_[i] = static_cast<uint16_t>(i);
+  set_edns_payload(kDefaultEdnsPayload);
+
+  set_servers(system_servers());
+  sweep_timer_ = loop_->runEvery(kSweepInterval, boost::bind(&dns_resolver::sweep, this));
+}
 
-  // connect error, fatal
-  // bind to local dns server
-  if(muduo::net::sockets::connect(sockfd_, local_dns.getSockAddr()) == -1)
+dns_resolver::~dns_resolver()
+{
+  loop_->cancel(sweep_timer_);
+  for(const auto& server : servers_)
   {
-    LOG_FATAL << "connect to local dns server error! " << ::strerror(errno);
+    for(const auto& sock : server.sockets)
+      close_socket(sock);
   }
+  for(const auto& retired : retired_)
+    close_socket(retired.first);
+}
 
-  v4_buffers_.resize(TTL);
-  v6_buffers_.resize(TTL);
+size_t dns_resolver::set_servers(const std::vector<muduo::net::InetAddress> &servers)
+{
+  for(const auto& server : servers_)
+  {
+    for(const auto& sock : server.sockets)
+      close_socket(sock);
+  }
+  servers_.clear();
+  for(const auto& addr : servers)
+  {
+    if(servers_.size() == kMaxServers)
+    {
+      LOG_WARN << "only the first " << kMaxServers << " dns servers are used";
+      break;
+    }
+    servers_.push_back(upstream(addr));
+    size_t index = servers_.size() - 1;
+    upstream& server = servers_.back();
+    for(size_t i = 0; i < kSocketsPerServer; ++i)
+    {
+      udp_socket sock = open_socket(index);
+      if(sock.fd >= 0)
+        server.sockets.push_back(sock);
+    }
+    if(server.sockets.empty())
+    {
+      LOG_ERROR << "dns server " << addr.toIpPort() << " can't be used";
+      servers_.pop_back();
+      continue;
+    }
+    server.stream.reset(new dns_stream(loop_, addr));
+    server.stream->setAnswerCallback(boost::bind(&dns_resolver::onStreamAnswer, this, index, _1));
+    server.stream->setFailCallback(boost::bind(&dns_resolver::onStreamFail, this, _1));
+    LOG_INFO << "dns server " << addr.toIpPort();
+  }
+  if(servers_.empty())
+    LOG_ERROR << "no dns server can be used!";
+  return servers_.size();
+}
 
-  channel_->setReadCallback(boost::bind(&dns_resolver::handleRead, this, _1));
-  channel_->setWriteCallback(boost::bind(&dns_resolver::handleWrite, this));
-  channel_->setWriteCallback(boost::bind(&dns_resolver::handleError, this));
-  // enable reading from socket
-  channel_->enableReading();
-  loop_->runEvery(1.0, boost::bind(&dns_resolver::onTimer, this));
+std::vector<muduo::net::InetAddress> dns_resolver::system_servers(const char *path)
+{
+  std::vector<muduo::net::InetAddress> servers;
+  std::ifstream in(path);
+  std::string line;
+  while(std::getline(in, line))
+  {
+    std::istringstream fields(line);
+    std::string key, value;
+    if(!(fields >> key >> value) || key != "nameserver")
+      continue;
+    muduo::net::InetAddress addr;
+    // 带scope的链路本地地址(fe80::1%eth0)不支持
+    if(parse_server(value, &addr))
+      servers.push_back(addr);
+    else
+      LOG_WARN << "ignore nameserver " << value << " in " << path;
+  }
+  if(servers.empty())
+    servers.push_back(muduo::net::InetAddress("127.0.0.1", 53, false));
+  return servers;
+}
+
+bool dns_resolver::parse_server(const std::string &text, muduo::net::InetAddress *addr)
+{
+  std::string ip(text);
+  uint16_t port = 53;
+  size_t colon = text.rfind(':');
+  if(!text.empty() && text[0] == '[')
+  {
+    size_t close = text.find(']');
+    if(close == std::string::npos)
+      return false;
+    ip = text.substr(1, close - 1);
+    if(close + 1 != text.size() && (text[close + 1] != ':' || !impl::parse_port(text.substr(close + 2), &port)))
+      return false;
+  }
+  else if(colon != std::string::npos && text.find(':') == colon)
+  {
+    // ipv4:port, a bare ipv6 address has several ':'
+    ip = text.substr(0, colon);
+    if(!impl::parse_port(text.substr(colon + 1), &port))
+      return false;
+  }
+  struct sockaddr_in addr4;
+  ::bzero(&addr4, sizeof(addr4));
+  if(::inet_pton(AF_INET, ip.c_str(), &addr4.sin_addr) == 1)
+  {
+    addr4.sin_family = AF_INET;
+    addr4.sin_port = muduo::net::sockets::hostToNetwork16(port);
+    *addr = muduo::net::InetAddress(addr4);
+    return true;
+  }
+  struct sockaddr_in6 addr6;
+  ::bzero(&addr6, sizeof(addr6));
+  if(::inet_pton(AF_INET6, ip.c_str(), &addr6.sin6_addr) == 1)
+  {
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = muduo::net::sockets::hostToNetwork16(port);
+    *addr = muduo::net::InetAddress(addr6);
+    return true;
+  }
+  return false;
+}
+
+bool dns_resolver::parse_literal(const std::string &host, muduo::net::InetAddress *addr)
+{
+  // 名字的最后一段不会全是数字, ipv6地址一定有':'
+  if(host.empty() || (host.find(':') == std::string::npos && !::isdigit(static_cast<unsigned char>(host.back()))))
+    return false;
+  std::string ip(host);
+  if(host.size() > 2 && host.front() == '[' && host.back() == ']')
+    ip = host.substr(1, host.size() - 2);
+  struct sockaddr_in addr4;
+  ::bzero(&addr4, sizeof(addr4));
+  if(::inet_pton(AF_INET, ip.c_str(), &addr4.sin_addr) == 1)
+  {
+    addr4.sin_family = AF_INET;
+    *addr = muduo::net::InetAddress(addr4);
+    return true;
+  }
+  struct sockaddr_in6 addr6;
+  ::bzero(&addr6, sizeof(addr6));
+  if(::inet_pton(AF_INET6, ip.c_str(), &addr6.sin6_addr) == 1)
+  {
+    addr6.sin6_family = AF_INET6;
+    *addr = muduo::net::InetAddress(addr6);
+    return true;
+  }
+  return false;
+}
+
+void dns_resolver::set_edns_payload(uint16_t size)
+{
+  edns_payload_ = size;
+  // 没有EDNS0时回答不超过512字节, 更大的回答会带MSG_TRUNC, 按截断处理
+  packet_size_ = std::max<size_t>(512, size);
+  packets_.resize(kRecvBatch * packet_size_);
+  for(size_t i = 0; i < kRecvBatch; ++i)
+  {
+    recvIovecs_[i].iov_base = &packets_[i * packet_size_];
+    recvIovecs_[i].iov_len = packet_size_;
+  }
+}
+
+dns_resolver::udp_socket dns_resolver::open_socket(size_t server)
+{
+  const muduo::net::InetAddress& addr = servers_[server].addr;
+  udp_socket sock;
+  int fd = ::socket(addr.family(), SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+  if(fd < 0)
+  {
+    LOG_SYSERR << "dns udp socket";
+    return sock;
+  }
+  // connect之后内核随机分配源端口, 并且只收这个服务器发来的包
+  if(muduo::net::sockets::connect(fd, addr.getSockAddr()) < 0)
+  {
+    LOG_SYSERR << "connect to dns server " << addr.toIpPort();
+    ::close(fd);
+    return sock;
+  }
+  sock.fd = fd;
+  sock.channel.reset(new muduo::net::Channel(loop_, fd));
+  sock.channel->setReadCallback(boost::bind(&dns_resolver::handleRead, this, server, fd, _1));
+  sock.channel->setErrorCallback(boost::bind(&dns_resolver::handleError, this, fd));
+  sock.channel->enableReading();
+  return sock;
+}
+
+void dns_resolver::close_socket(const udp_socket &sock)
+{
+  sock.channel->disableAll();
+  sock.channel->remove();
+  ::close(sock.fd);
+}
+
+size_t dns_resolver::choose_server(uint32_t tried)
+{
+  bool untried = has_untried(tried);
+  size_t best = servers_.size();
+  double best_score = 0;
+  for(size_t i = 0; i < servers_.size(); ++i)
+  {
+    if(untried && (tried >> i & 1))
+      continue;
+    double score = servers_[i].srtt * (1 + servers_[i].failures);
+    if(best == servers_.size() || score < best_score || (score == best_score && (rng_() & 1)))
+    {
+      best = i;
+      best_score = score;
+    }
+  }
+  // 第一次回答之前按超时估计, 不会在它超时之前把所有查询都发给它
+  if(!servers_[best].measured)
+    servers_[best].srtt = std::max(servers_[best].srtt, attempt_timeout_);
+  // 没被选中的服务器srtt慢慢变小, 变慢或者失败过的服务器过一段时间会再被尝试
+  for(size_t i = 0; i < servers_.size(); ++i)
+  {
+    if(i != best)
+      servers_[i].srtt *= 0.98;
+  }
+  return best;
+}
+
+bool dns_resolver::has_untried(uint32_t tried) const
+{
+  for(size_t i = 0; i < servers_.size(); ++i)
+  {
+    if(!(tried >> i & 1))
+      return true;
+  }
+  return false;
+}
+
+void dns_resolver::on_answered(size_t server, muduo::Timestamp sent, muduo::Timestamp now)
+{
+  upstream& up = servers_[server];
+  double rtt = muduo::timeDifference(now, sent);
+  // 和tcp一样的平滑rtt
+  up.srtt = up.measured ? up.srtt + (rtt - up.srtt) / 8 : rtt;
+  up.measured = true;
+  up.failures = 0;
+}
+
+void dns_resolver::on_timeout(size_t server)
+{
+  upstream& up = servers_[server];
+  ++ up.failures;
+  up.srtt = std::max(up.srtt, attempt_timeout_);
 }
 
 bool dns_resolver::resolve(const std::string &host, const dns_resolver::ResolveCallback& cb, bool ipv6)
@@ -212,347 +446,595 @@ bool dns_resolver::resolve(const std::string &host, const dns_resolver::ResolveC
     LOG_ERROR << "domain length is over " << 255;
     return false;
   }
-  if(dns_datas_.size() + 1 >= UINT16_MAX)
+  AddressList addrs;
+  muduo::net::InetAddress literal;
+  if(parse_literal(host, &literal))
   {
-    LOG_ERROR << "dns_datas_ is full!"; // fixme: fatal instead ?
-    return false;
+    // 另一种地址族的ip地址没有这个类型的地址
+    if((literal.family() == AF_INET6) == ipv6)
+      addrs.push_back(literal);
+    ++ lookups_.local;
+    metrics::add(metrics::kDnsLocal);
+    cb(addrs);
+    return true;
   }
+  if(hosts_->lookup(host, ipv6, &addrs))
   {
-    muduo::MutexLockGuard lock(mutex_);
-    if(ipv6)
+    ++ lookups_.local;
+    metrics::add(metrics::kDnsLocal);
+    cb(addrs);
+    return true;
+  }
+  bool refresh = false;
+  dns_cache::result cached = cache_->lookup(host, ipv6, muduo::Timestamp::now(), &addrs, &refresh);
+  if(cached != dns_cache::kMiss)
+  {
+    if(cached == dns_cache::kHit)
     {
-      auto it = v6_datas_.find(host);
-      if(it != v6_datas_.end())
-      {
-        auto entry = (it->second).lock();
-        if(entry){
-          cb(muduo::net::InetAddress(entry->addr6));
-          return true;
-        }
-        else
-        {
-          v6_datas_.erase(it);
-        }
-      }
+      ++ lookups_.hits;
+      metrics::add(metrics::kDnsCacheHits);
     }
     else
     {
-      auto it = v4_datas_.find(host);
-      if(it != v4_datas_.end())
-      {
-        auto entry = (it->second).lock();
-        if(entry) {
-          cb(muduo::net::InetAddress(entry->addr4));
-          return true;
-        }
-        else
-        {
-          v4_datas_.erase(it);
-        }
-      }
+      ++ lookups_.negative_hits;
+      metrics::add(metrics::kDnsCacheNegativeHits);
+    }
+    // 常用的名字快过期了, 在后台重新查询, 回答到达前仍然用旧的地址
+    if(refresh && query(host, ResolveCallback(), ipv6))
+    {
+      ++ lookups_.refreshes;
+      metrics::add(metrics::kDnsRefreshes);
     }
+    cb(addrs);
+    return true;
+  }
+  ++ lookups_.misses;
+  metrics::add(metrics::kDnsCacheMisses);
+  return query(host, cb, ipv6);
+}
+
+bool dns_resolver::query(const std::string &host, const dns_resolver::ResolveCallback &cb, bool ipv6)
+{
+  if(servers_.empty())
+  {
+    LOG_ERROR << "no dns server to resolve " << host;
+    return false;
+  }
+  // 已经有相同的查询在等待回答, 不再发送
+  std::string key(query_key(host, ipv6));
+  auto inflight = inflight_.find(key);
+  if(inflight != inflight_.end())
+  {
+    assert(slots_[inflight->second].used);
+    if(cb)
+      slots_[inflight->second].waiters.push_back(cb);
+    return true;
   }
-  muduo::net::Buffer buf;
-  uint16_t transaction_id = static_cast<uint16_t>(dns_datas_.size() + 1);
-  buf.appendInt16(transaction_id);
+  int slot_id = allocate_slot();
+  if(slot_id < 0)
+  {
+    LOG_ERROR << "every transaction id is in use!";
+    return false;
+  }
+  uint16_t transaction_id = static_cast<uint16_t>(slot_id);
+  queryBuffer_.retrieveAll();
+  queryBuffer_.appendInt16(transaction_id);
   struct packet::flag query;
-  buf.append(&query, sizeof(query));
+  queryBuffer_.append(&query, sizeof(query));
   struct packet::count query_count;
   query_count.question_count = muduo::net::sockets::hostToNetwork16(1);
-  buf.append(&query_count, sizeof(query_count));
-  if(!impl::convert_host(host, &buf))
+  query_count.ar_count = muduo::net::sockets::hostToNetwork16(edns_payload_ > 0 ? 1 : 0);
+  queryBuffer_.append(&query_count, sizeof(query_count));
+  if(!impl::convert_host(host, &queryBuffer_))
+  {
+    free_.push_back(transaction_id);
     return false;
+  }
   uint16_t query_class = 1;
   u_int16_t query_type = (ipv6 ? 28 : 1);
-  buf.appendInt16(query_type);
-  buf.appendInt16(query_class);
-  auto timer_id = loop_->runAfter(timeout_, boost::bind(&dns_resolver::handleTimeout, this, transaction_id));
-  dns_datas_[transaction_id] =  std::make_shared<Entry>(cb, host, ipv6, 1, timer_id);
-  send(&buf);
+  queryBuffer_.appendInt16(query_type);
+  queryBuffer_.appendInt16(query_class);
+  size_t question_end = queryBuffer_.readableBytes();
+  if(edns_payload_ > 0)
+  {
+    // OPT: root name, TYPE 41, CLASS is the udp payload size, no extended flags, no options
+    queryBuffer_.appendInt8(0);
+    queryBuffer_.appendInt16(impl::kOptType);
+    queryBuffer_.appendInt16(static_cast<int16_t>(edns_payload_));
+    queryBuffer_.appendInt32(0);
+    queryBuffer_.appendInt16(0);
+  }
+  transaction& slot = slots_[transaction_id];
+  slot.used = true;
+  slot.ipv6 = ipv6;
+  slot.tcp = false;
+  slot.count = 0;
+  slot.server = 0;
+  slot.tried = 0;
+  slot.question_end = question_end;
+  slot.domain.assign(host);
+  slot.packet.assign(queryBuffer_.peek(), queryBuffer_.readableBytes());
+  if(cb)
+    slot.waiters.push_back(cb);
+  inflight_[key] = transaction_id;
+  send_query(transaction_id, true);
   return true;
 }
 
-// never come here ?
-void dns_resolver::handleWrite()
+int dns_resolver::allocate_slot()
 {
-  loop_->assertInLoopThread();
-  if(channel_->isWriting())
+  if(free_.empty())
+    return -1;
+  // 随机取一个未使用的ID, 和末尾交换后弹出
+  size_t i = std::uniform_int_distribution<size_t>(0, free_.size() - 1)(rng_);
+  std::swap(free_[i], free_.back());
+  uint16_t id = free_.back();
+  free_.pop_back();
+  return id;
+}
+
+void dns_resolver::send_query(uint16_t transaction_id, bool next_server)
+{
+  transaction& slot = slots_[transaction_id];
+  if(next_server)
   {
-    ssize_t n = muduo::net::sockets::write(channel_->fd(), outputBuffer_.peek(), outputBuffer_.readableBytes());
-    if(n > 0)
-    {
-      outputBuffer_.retrieve(n);
-      // remain no data, disable writing
-      if(outputBuffer_.readableBytes() == 0)
-      {
-        channel_->disableWriting();
-      }
-    }
-    else
+    size_t server = choose_server(slot.tried);
+    if(slot.tcp && server != slot.server)
+      servers_[slot.server].stream->cancel(transaction_id);
+    slot.server = server;
+    slot.tried |= 1u << server;
+  }
+  muduo::Timestamp now = muduo::Timestamp::now();
+  ++ slot.count;
+  slot.sent = now;
+  slot.deadline = muduo::addTime(now, attempt_timeout_);
+  deadlines_.push_back(std::make_pair(transaction_id, slot.deadline));
+  upstream& server = servers_[slot.server];
+  if(slot.tcp)
+  {
+    server.stream->send(transaction_id, slot.packet);
+    return;
+  }
+  server.outgoing.push_back(transaction_id);
+  if(!flush_queued_)
+  {
+    // 同一轮事件处理中的查询攒在一起, 在这一轮结束时用sendmmsg发出
+    flush_queued_ = true;
+    loop_->queueInLoop(boost::bind(&dns_resolver::flush, this));
+  }
+}
+
+dns_resolver::udp_socket& dns_resolver::socket_for(size_t server, size_t queries)
+{
+  upstream& up = servers_[server];
+  udp_socket& sock = up.sockets[std::uniform_int_distribution<size_t>(0, up.sockets.size() - 1)(rng_)];
+  if(sock.sent >= kQueriesPerSocket)
+  {
+    // 换一个新的源端口, 旧的socket再等timeout_接收迟到的回答
+    udp_socket fresh = open_socket(server);
+    if(fresh.fd >= 0)
     {
-      LOG_SYSERR << "dns_channel::handleWrit";
+      retired_.push_back(std::make_pair(sock, muduo::addTime(muduo::Timestamp::now(), timeout_)));
+      sock = fresh;
     }
+    sock.sent = 0;
   }
+  sock.sent += static_cast<int>(queries);
+  return sock;
 }
 
-// send function, must call in loop thread
-// fixme: change here ?
-void dns_resolver::sendInLoop(const void *data, size_t len)
+void dns_resolver::flush()
 {
-  loop_->assertInLoopThread();
-  ssize_t nwrote = 0;
-  size_t remain = len;
-  bool faultError = false;
-  if(!channel_->isWriting() && outputBuffer_.readableBytes() == 0)
+  flush_queued_ = false;
+  for(size_t i = 0; i < servers_.size(); ++i)
   {
-    nwrote = muduo::net::sockets::write(channel_->fd(), data, len);
-    if(nwrote >= 0)
+    upstream& server = servers_[i];
+    if(server.outgoing.empty())
+      continue;
+    if(sendMsgs_.size() < server.outgoing.size())
     {
-      remain = len - nwrote;
+      sendMsgs_.resize(server.outgoing.size());
+      sendIovecs_.resize(server.outgoing.size());
     }
-    else
+    size_t count = 0;
+    for(uint16_t transaction_id : server.outgoing)
     {
-      nwrote = 0;
-      if(errno != EWOULDBLOCK)
+      const transaction& slot = slots_[transaction_id];
+      // answered, moved to tcp or to another server since it was queued
+      if(!slot.used || slot.tcp || slot.server != i)
+        continue;
+      sendIovecs_[count].iov_base = const_cast<char*>(slot.packet.data());
+      sendIovecs_[count].iov_len = slot.packet.size();
+      ::bzero(&sendMsgs_[count], sizeof(struct mmsghdr));
+      sendMsgs_[count].msg_hdr.msg_iov = &sendIovecs_[count];
+      sendMsgs_[count].msg_hdr.msg_iovlen = 1;
+      ++count;
+    }
+    server.outgoing.clear();
+    if(count == 0)
+      continue;
+    const udp_socket& sock = socket_for(i, count);
+    size_t done = 0;
+    while(done < count)
+    {
+      int n = ::sendmmsg(sock.fd, &sendMsgs_[done], static_cast<unsigned int>(count - done), 0);
+      ++ io_.send_calls;
+      if(n < 0)
       {
-        LOG_SYSERR << "TcpConnection::sendInLoop " << errno << " : " << muduo::strerror_tl(errno) ;
-        // msg size if too big -> EMSGSIZE
-        if(errno == EPIPE || errno == ECONNRESET || errno == EMSGSIZE)
-          faultError = true;
+        if(errno == EINTR)
+          continue;
+        // udp不缓存, 没发出去的和丢包一样等超时后重试
+        LOG_SYSERR << "send " << count - done << " dns queries to " << server.addr.toIpPort();
+        break;
       }
+      done += static_cast<size_t>(n);
     }
+    io_.sent += done;
+  }
+}
+
+bool dns_resolver::question_matches(const transaction &slot, const char *data, size_t len)
+{
+  const std::string& query = slot.packet;
+  if(len < slot.question_end)
+    return false;
+  // QDCOUNT of the answer
+  if(data[4] != query[4] || data[5] != query[5])
+    return false;
+  // 名字不区分大小写, 类型和类别必须相同
+  size_t name_end = slot.question_end - sizeof(packet::query_tail);
+  for(size_t i = sizeof(packet::flag) + sizeof(packet::count) + 2; i < name_end; ++i)
+  {
+    if(::tolower(static_cast<unsigned char>(data[i])) != ::tolower(static_cast<unsigned char>(query[i])))
+      return false;
   }
-  assert(remain <= len);
-  if(!faultError && remain > 0)
+  return memcmp(data + name_end, query.data() + name_end, sizeof(packet::query_tail)) == 0;
+}
+
+void dns_resolver::finish(uint16_t transaction_id, const AddressList &addrs)
+{
+  transaction& slot = slots_[transaction_id];
+  auto it = inflight_.find(query_key(slot.domain, slot.ipv6));
+  if(it != inflight_.end() && it->second == transaction_id)
+    inflight_.erase(it);
+  if(slot.tcp)
+    servers_[slot.server].stream->cancel(transaction_id);
+  // the waiters may resolve again from their callbacks, the slot must be free before
+  std::vector<ResolveCallback> waiters;
+  waiters.swap(slot.waiters);
+  slot.used = false;
+  free_.push_back(transaction_id);
+  for(const auto& cb : waiters)
+    cb(addrs);
+}
+
+void dns_resolver::sweep()
+{
+  muduo::Timestamp now = muduo::Timestamp::now();
+  while(!deadlines_.empty() && !(now < deadlines_.front().second))
   {
-    outputBuffer_.append(static_cast<const char*>(data) + nwrote, remain);
-    if(!channel_->isWriting())
+    uint16_t transaction_id = deadlines_.front().first;
+    muduo::Timestamp deadline = deadlines_.front().second;
+    deadlines_.pop_front();
+    const transaction& slot = slots_[transaction_id];
+    // answered already, or sent again with a later deadline
+    if(!slot.used || !(slot.deadline == deadline))
+      continue;
+    on_timeout(slot.server);
+    if(slot.count <= MAX_TIMEOUT)
     {
-      channel_->enableWriting();
+      LOG_WARN << "transaction_id " << transaction_id << " timeout on "
+               << servers_[slot.server].addr.toIpPort() << ", try again!";
+      send_query(transaction_id, true);
     }
+    else
+    {
+      // a timeout may be temporary, it is not cached
+      LOG_ERROR << "resolve " << slot.domain << " timeout!";
+      metrics::add(metrics::kDnsTimeouts);
+      finish(transaction_id, AddressList());
+    }
+  }
+  while(!retired_.empty() && !(now < retired_.front().second))
+  {
+    close_socket(retired_.front().first);
+    retired_.pop_front();
   }
 }
 
-void dns_resolver::send(muduo::net::Buffer *buf)
+bool dns_resolver::resolve_all(const std::string &host, const dns_resolver::ResolveCallback &cb)
 {
-  if(loop_->isInLoopThread())
+  // 和glibc一样, hosts文件里有这个名字就只用文件里的地址, 不再向服务器查询另一种地址
+  AddressList addrs;
+  muduo::net::InetAddress literal;
+  if(parse_literal(host, &literal))
   {
-    sendInLoop(buf->peek(), buf->readableBytes());
-    buf->retrieveAll();
+    ++ lookups_.local;
+    metrics::add(metrics::kDnsLocal);
+    cb(AddressList(1, literal));
+    return true;
   }
-  else
-    loop_->runInLoop(boost::bind(&dns_resolver::sendInLoop, this, buf->peek(), buf->readableBytes()));
+  if(hosts_->lookup_all(host, &addrs))
+  {
+    ++ lookups_.local;
+    metrics::add(metrics::kDnsLocal);
+    cb(addrs);
+    return true;
+  }
+  DualQueryPtr query(std::make_shared<dual_query>());
+  query->cb = cb;
+  // 任一查询发不出去时另一个仍然有效, 它的回答会结束查询
+  bool v6 = resolve(host, boost::bind(&dns_resolver::onDualAnswer, this, query, true, _1), true);
+  if(!v6)
+    query->v6_done = true;
+  bool v4 = resolve(host, boost::bind(&dns_resolver::onDualAnswer, this, query, false, _1), false);
+  if(!v4)
+  {
+    query->v4_done = true;
+    if(v6 && query->v6_done)
+      finish_dual(query);
+  }
+  return v6 || v4;
 }
 
-void dns_resolver::handleRead(muduo::Timestamp receiveTime)
+void dns_resolver::onDualAnswer(const DualQueryPtr &query, bool ipv6, const AddressList &addrs)
 {
-  loop_->assertInLoopThread();
-  int savedErrno = 0;
-  // buffer size of 65536, big enough for udp packet
-  ssize_t n = inputBuffer_.readFd(channel_->fd(), &savedErrno);
-  if(n > 0)
+  if(ipv6)
+  {
+    query->v6 = addrs;
+    query->v6_done = true;
+  }
+  else
   {
-    MessageCallback(receiveTime);
+    query->v4 = addrs;
+    query->v4_done = true;
   }
-  else if(n == 0)
+  if(query->v6_done && query->v4_done)
+    finish_dual(query);
+  else if(!addrs.empty())
+    loop_->runAfter(kResolutionDelay, boost::bind(&dns_resolver::finish_dual, query));
+}
+
+void dns_resolver::finish_dual(const DualQueryPtr &query)
+{
+  if(query->finished)
+    return;
+  query->finished = true;
+  AddressList addrs(query->v6);
+  addrs.insert(addrs.end(), query->v4.begin(), query->v4.end());
+  query->cb(addrs);
+}
+
+void dns_resolver::handleRead(size_t server, int fd, muduo::Timestamp receiveTime)
+{
+  loop_->assertInLoopThread();
+  for(int round = 0; round < kMaxRecvRounds; ++round)
   {
-    LOG_SYSERR << "empty udp packet";
+    for(size_t i = 0; i < kRecvBatch; ++i)
+    {
+      ::bzero(&recvMsgs_[i], sizeof(struct mmsghdr));
+      recvMsgs_[i].msg_hdr.msg_iov = &recvIovecs_[i];
+      recvMsgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = ::recvmmsg(fd, recvMsgs_.data(), static_cast<unsigned int>(kRecvBatch), MSG_DONTWAIT, nullptr);
+    ++ io_.recv_calls;
+    if(n < 0)
+    {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      LOG_SYSERR << "dns_resolver::handleRead " << servers_[server].addr.toIpPort();
+      // ICMP port unreachable, nothing listens on the server
+      if(errno == ECONNREFUSED)
+        on_timeout(server);
+      break;
+    }
+    io_.received += static_cast<uint64_t>(n);
+    for(int i = 0; i < n; ++i)
+    {
+      char* packet = &packets_[static_cast<size_t>(i) * packet_size_];
+      size_t length = recvMsgs_[i].msg_len;
+      // 比缓冲区大的回答被截掉了尾部, 置上TC位改用tcp查询
+      if((recvMsgs_[i].msg_hdr.msg_flags & MSG_TRUNC) && length > 2)
+        packet[2] = static_cast<char>(packet[2] | 0x02);
+      inputBuffer_.append(packet, length);
+      MessageCallback(&inputBuffer_, server, false);
+      inputBuffer_.retrieveAll();
+    }
+    if(static_cast<size_t>(n) < kRecvBatch)
+      break;
   }
-  else if (n < 0)
+}
+
+void dns_resolver::onStreamAnswer(size_t server, muduo::net::Buffer *answer)
+{
+  MessageCallback(answer, server, true);
+}
+
+void dns_resolver::onStreamFail(uint16_t transaction_id)
+{
+  const transaction& slot = slots_[transaction_id];
+  if(slot.used && slot.tcp)
   {
-    errno = savedErrno;
-    LOG_SYSERR << "dns_channel::handleRead";
+    LOG_ERROR << "resolve " << slot.domain << " over tcp failed!";
+    finish(transaction_id, AddressList());
   }
-  // only store one packet
-  inputBuffer_.retrieveAll();
 }
 
-//fixme: right way ?
-void dns_resolver::MessageCallback(muduo::Timestamp receiveTime) {
+void dns_resolver::MessageCallback(muduo::net::Buffer* buf, size_t server, bool tcp) {
   // never happen
-  if (inputBuffer_.readableBytes() < 12) {
+  if (buf->readableBytes() < 12) {
     LOG_ERROR << "not a valid dns response packet!";
     return;
   }
-  uint16_t transaction_id = static_cast<uint16_t > (inputBuffer_.readInt16());
-  if (!dns_datas_.count(transaction_id)) {
+  uint16_t transaction_id = static_cast<uint16_t > (buf->peekInt16());
+  transaction& slot = slots_[transaction_id];
+  if (!slot.used) {
     LOG_ERROR << "can't find specified transaction id " << transaction_id;
     return;
   }
-  auto entry = dns_datas_[transaction_id];
-  loop_->cancel(entry->timerId());
-  dns_datas_.erase(transaction_id);
+  if (!(slot.tried >> server & 1)) {
+    LOG_WARN << "answer of transaction id " << transaction_id << " from " << servers_[server].addr.toIpPort() << " which wasn't asked";
+    return;
+  }
+  // 改用tcp以后迟到的udp回答, 或者已经超时的tcp回答
+  if (slot.tcp != tcp) {
+    LOG_DEBUG << "ignore " << (tcp ? "tcp" : "udp") << " answer of transaction id " << transaction_id;
+    return;
+  }
+  // 伪造的或者迟到的回答, 丢弃它并继续等待真正的回答
+  if (!question_matches(slot, buf->peek(), buf->readableBytes())) {
+    LOG_WARN << "answer of transaction id " << transaction_id << " doesn't match the question of " << slot.domain;
+    return;
+  }
+  // 之前超时的服务器迟到的回答也接受, 但rtt只算最后一次发送的
+  if (server == slot.server && !tcp)
+    on_answered(server, slot.sent, muduo::Timestamp::now());
+  buf->retrieveInt16();
+  const bool ipv6 = slot.ipv6;
+  const std::string domain(slot.domain);
+  const size_t question_length = slot.question_end - sizeof(packet::flag) - sizeof(packet::count) - 2;
   struct packet::flag flag;
-  memcpy(&flag, inputBuffer_.peek(), sizeof(flag));
-  inputBuffer_.retrieveInt16();
-  // fixme: truncated use tcp to query dns ?
-  if (flag.flag1.QR() != 0x01 || flag.flag2.RCODE() != 0 || flag.flag1.RD() != 0) {
-    entry->resolveCb(muduo::net::InetAddress());
+  memcpy(&flag, buf->peek(), sizeof(flag));
+  buf->retrieveInt16();
+  if (flag.flag1.QR() != 0x01) {
+    finish(transaction_id, AddressList());
     return;
   }
-  uint16_t question_count = static_cast<uint16_t>(inputBuffer_.readInt16());
-  uint16_t answer_count = static_cast<uint16_t>(inputBuffer_.readInt16());
-  uint16_t ns_count = static_cast<uint16_t>(inputBuffer_.readInt16());
-  uint16_t ar_count = static_cast<uint16_t>(inputBuffer_.readInt16());
-  // todo: what if ns_count and ar_count != 0
-  if (question_count != 1 && ns_count != 0 && ar_count != 0) {
-    entry->resolveCb(muduo::net::InetAddress());
+  // 和glibc一样, SERVFAIL时先问下一个服务器
+  if (flag.flag2.RCODE() == impl::kServerFailure && slot.count <= MAX_TIMEOUT && has_untried(slot.tried)) {
+    LOG_WARN << servers_[server].addr.toIpPort() << " failed to resolve " << domain << ", ask the next server";
+    send_query(transaction_id, true);
     return;
   }
-  uint8_t label_length;
-  // process with question
-  while (inputBuffer_.readableBytes() >= 1 && (label_length = static_cast<uint8_t>(inputBuffer_.readInt8())) != 0) {
-    if (inputBuffer_.readableBytes() < label_length) {
-      LOG_ERROR << "error label length";
-      entry->resolveCb(muduo::net::InetAddress());
-      return;
-    }
-    inputBuffer_.retrieve(label_length);
+  if (flag.flag2.RCODE() == impl::kNameError || flag.flag2.RCODE() == impl::kServerFailure) {
+    // 没有人等待的是刷新, 服务器失败时保留旧的回答直到过期
+    if (flag.flag2.RCODE() == impl::kNameError || !slot.waiters.empty())
+      add_negative(domain, ipv6);
+    finish(transaction_id, AddressList());
+    return;
   }
-  if (inputBuffer_.readableBytes() < 2 * 2)
-  {
-    LOG_ERROR << "error question packet!";
-    entry->resolveCb(muduo::net::InetAddress());
+  // 不支持EDNS0的服务器, 去掉OPT记录再问一次
+  if (flag.flag2.RCODE() == impl::kFormatError && slot.packet.size() > slot.question_end) {
+    LOG_WARN << "dns server doesn't support EDNS0, ask " << domain << " again without it";
+    slot.packet.resize(slot.question_end);
+    slot.packet[10] = 0;
+    slot.packet[11] = 0;
+    send_query(transaction_id, false);
     return;
   }
-  uint16_t query_type = static_cast<uint16_t>(inputBuffer_.readInt16());
-  uint16_t query_class = static_cast<uint16_t>(inputBuffer_.readInt16());
-  (void)query_class;
-  uint16_t valid_query_type = entry->ipv6() ? 28 : 1;
-  if(valid_query_type != query_type)
-  {
-    LOG_ERROR << "query type not equal!";
-    entry->resolveCb(muduo::net::InetAddress());
+  if (flag.flag2.RCODE() != 0) {
+    finish(transaction_id, AddressList());
+    return;
+  }
+  // 回答被截断, 通过tcp重新查询
+  if (flag.flag1.TC()) {
+    if (tcp) {
+      LOG_ERROR << "truncated tcp answer of " << domain;
+      finish(transaction_id, AddressList());
+    } else {
+      LOG_DEBUG << "truncated answer of " << domain << ", ask again over tcp";
+      slot.tcp = true;
+      send_query(transaction_id, false);
+    }
     return;
   }
+  buf->retrieveInt16();  // question_count, checked by question_matches
+  uint16_t answer_count = static_cast<uint16_t>(buf->readInt16());
+  uint16_t ns_count = static_cast<uint16_t>(buf->readInt16());
+  uint16_t ar_count = static_cast<uint16_t>(buf->readInt16());
+  // the question is the same as ours, checked by question_matches
+  buf->retrieve(question_length);
+  uint16_t valid_query_type = ipv6 ? 28 : 1;
 
-  for(int i = 0; i < answer_count; ++i)
+  // 收集回答中所有的地址, CNAME等其他记录跳过; authority和additional里只看OPT
+  AddressList addrs;
+  uint32_t min_ttl = TTL - 1;
+  const int record_count = answer_count + ns_count + ar_count;
+  for(int i = 0; i < record_count; ++i)
   {
-    if(!impl::retrieve_name(&inputBuffer_))
+    if(!impl::retrieve_name(buf))
     {
-      entry->resolveCb(muduo::net::InetAddress());
+      finish(transaction_id, AddressList());
       return;
     }
-    if(inputBuffer_.readableBytes() < 10)
+    if(buf->readableBytes() < 10)
     {
       LOG_ERROR << "invalid answer packet!";
-      entry->resolveCb(muduo::net::InetAddress());
+      finish(transaction_id, AddressList());
       return;
     }
-    uint8_t answer_type = static_cast<uint16_t>(inputBuffer_.readInt16());
-    uint8_t answer_class = static_cast<uint16_t>(inputBuffer_.readInt16());
+    uint16_t answer_type = static_cast<uint16_t>(buf->readInt16());
+    uint16_t answer_class = static_cast<uint16_t>(buf->readInt16());
     (void)answer_class;
-    uint32_t ttl = static_cast<uint32_t>(inputBuffer_.readInt32());
-    uint16_t data_length = static_cast<uint16_t>(inputBuffer_.readInt16());
-    if(data_length > inputBuffer_.readableBytes())
+    uint32_t ttl = static_cast<uint32_t>(buf->readInt32());
+    uint16_t data_length = static_cast<uint16_t>(buf->readInt16());
+    if(data_length > buf->readableBytes())
     {
       LOG_ERROR << "can't get entire data!";
-      entry->resolveCb(muduo::net::InetAddress());
+      finish(transaction_id, AddressList());
       return;
     }
-    ttl = (ttl >= TTL ? TTL - 1 : ttl);
-    if(answer_type == valid_query_type)
+    if(i >= answer_count)
+    {
+      // OPT的TTL字段最高字节是扩展RCODE, 比如BADVERS
+      if(i >= answer_count + ns_count && answer_type == impl::kOptType && (ttl >> 24) != 0)
+      {
+        LOG_ERROR << "extended rcode " << (ttl >> 24) << " in the answer of " << domain;
+        finish(transaction_id, AddressList());
+        return;
+      }
+    }
+    else if(answer_type == valid_query_type)
     {
       // ipv6
-      if(entry->ipv6() && data_length == 16)
+      if(ipv6 && data_length == 16)
       {
         struct sockaddr_in6 data;
         ::bzero(&data, sizeof(data));
         data.sin6_family = AF_INET6;
-        memcpy(&data.sin6_addr, inputBuffer_.peek(), 16);
-
-        {
-          muduo::MutexLockGuard lock(mutex_);
-          V6EntryPtr ptr = std::make_shared<AF_INET6_Entry>(data);
-          WkV6EntryPtr wk_ptr(ptr);
-          v6_datas_[entry->domain()] = wk_ptr;
-          v6_buffers_.at(ttl).insert(ptr);
-        }
-
-        entry->resolveCb(muduo::net::InetAddress(data));
-        return;
+        memcpy(&data.sin6_addr, buf->peek(), 16);
+        addrs.push_back(muduo::net::InetAddress(data));
+        min_ttl = std::min(min_ttl, ttl);
       }// ipv4
-      else if (!entry->ipv6() && data_length == 4)
+      else if (!ipv6 && data_length == 4)
       {
         struct sockaddr_in data;
         ::bzero(&data, sizeof(data));
         data.sin_family = AF_INET;
-        memcpy(&data.sin_addr.s_addr, inputBuffer_.peek(), 4);
-
-        {
-          muduo::MutexLockGuard lock(mutex_);
-          V4EntryPtr ptr = std::make_shared<AF_INET_Entry>(data);
-          WkV4EntryPtr wk_ptr(ptr);
-          v4_datas_[entry->domain()] = wk_ptr;
-          v4_buffers_.at(ttl).insert(ptr);
-        }
-
-        entry->resolveCb(muduo::net::InetAddress(data));
-        return;
+        memcpy(&data.sin_addr.s_addr, buf->peek(), 4);
+        addrs.push_back(muduo::net::InetAddress(data));
+        min_ttl = std::min(min_ttl, ttl);
       }
     }
-    else
-      inputBuffer_.retrieve(data_length);
+    buf->retrieve(data_length);
+  }
+  if(addrs.empty())
+  {
+    // NODATA, e.g. AAAA of an ipv4 only host
+    add_negative(domain, ipv6);
+  }
+  else
+  {
+    // the whole answer lives as long as its shortest ttl
+    cache_->insert(domain, ipv6, addrs, min_ttl, muduo::Timestamp::now());
   }
-  entry->resolveCb(muduo::net::InetAddress());
+  finish(transaction_id, addrs);
 }
 
-void dns_resolver::handleError()
+void dns_resolver::handleError(int fd)
 {
-  int err = muduo::net::sockets::getSocketError(channel_->fd());
+  int err = muduo::net::sockets::getSocketError(fd);
   // strerror_tl is a wrapper function for strerror_r
-  LOG_ERROR << "dns_channel::handleError [" << sockfd_ << "] - SO_ERROR = " << err << muduo::strerror_tl(err);
+  LOG_ERROR << "dns_resolver::handleError [" << fd << "] - SO_ERROR = " << err << muduo::strerror_tl(err);
 }
 
-// call by timeout function
-void dns_resolver::resolve(uint16_t transaction_id)
+std::string dns_resolver::query_key(const std::string &host, bool ipv6)
 {
-  assert(dns_datas_.count(transaction_id));
-  auto& entry = dns_datas_[transaction_id];
-  muduo::net::Buffer buf;
-  buf.appendInt16(transaction_id);
-  struct packet::flag query;
-  buf.append(&query, sizeof(query));
-  struct packet::count query_count;
-  query_count.question_count = muduo::net::sockets::hostToNetwork16(1);
-  buf.append(&query_count, sizeof(query_count));
-  if(!impl::convert_host(entry->domain(), &buf))
-  {
-    LOG_FATAL << "convert_host error !";
-  }
-  uint16_t query_class = 1;
-  u_int16_t query_type = (entry->ipv6() ? 28 : 1);
-  buf.appendInt16(query_class);
-  buf.appendInt16(query_type);
-  auto timer_id = loop_->runAfter(timeout_, boost::bind(&dns_resolver::handleTimeout, this, transaction_id));
-  entry->set_timer_id(timer_id);
-  send(&buf);
+  return host + (ipv6 ? "/AAAA" : "/A");
 }
 
-void dns_resolver::onTimer()
+void dns_resolver::add_negative(const std::string &domain, bool ipv6)
 {
-  muduo::MutexLockGuard lock(mutex_);
-  v4_buffers_.push_back(V4Bucket());
-  v6_buffers_.push_back(V6Bucket());
+  if(negative_ttl_ > 0)
+    cache_->insert(domain, ipv6, AddressList(), negative_ttl_, muduo::Timestamp::now());
 }
-
-// try to resolve again
-void dns_resolver::handleTimeout(uint16_t transaction_id)
-{
-  LOG_ERROR <<"transaction_id "<< transaction_id << " timeout, try again!";
-  if(!dns_datas_.count(transaction_id))
-  {
-    LOG_ERROR << "can't find transaction_id " << transaction_id << " at dns_datas_";
-    return;
-  }
-  auto entry = dns_datas_[transaction_id];
-  if(entry->add_count_and_get() > MAX_TIMEOUT)
-  {
-    // use 0.0.0.0 to call resolveCallback function, notify client that the resolve is error!
-    entry->resolveCb(muduo::net::InetAddress());
-    dns_datas_.erase(transaction_id);
-    return;
-  }
-  else
-    resolve(transaction_id);
-}
\ No newline at end of file
@@ -9,9 +9,16 @@
 #include <muduo/net/TimerId.h>
 #include <muduo/net/InetAddress.h>
 #include <stdint.h>
-#include <boost/circular_buffer.hpp>
-#include <unordered_set>
-#include <muduo/base/Mutex.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <random>
+#include <boost/shared_ptr.hpp>
+#include <sys/socket.h>
+
+#include "dns_cache.h"
+#include "dns_stream.h"
+#include "hosts_file.h"
 
 namespace muduo
 {
@@ -29,105 +36,247 @@ class dns_resolver : boost::noncopyable
 {
  public:
 
-  typedef boost::function<void(const muduo::net::InetAddress& addr)> ResolveCallback;
+  typedef std::vector<muduo::net::InetAddress> AddressList;
+  // every address in the answer, empty if the host can't be resolved
+  typedef boost::function<void(const AddressList& addrs)> ResolveCallback;
+
+  // RFC 8305: 先收到一种地址后, 最多再等待另一种地址这么久
+  constexpr static double kResolutionDelay = 0.05;
+
+  // RFC 6891 EDNS0 的udp负载大小, 按DNS Flag Day 2020的建议不会被分片
+  const static uint16_t kDefaultEdnsPayload = 1232;
+
+  // 最多使用的dns服务器数
+  const static size_t kMaxServers = 32;
+
+  // negative_ttl: seconds to remember a host that doesn't exist, has no address or whose server failed
+  // the dns servers are read from /etc/resolv.conf until set_servers is called
+  explicit dns_resolver(muduo::net::EventLoop* loop, double timeout = 2, double negative_ttl = 5);
+
+  ~dns_resolver();
+
+  // replace the dns servers, call it before the first query; servers that can't be reached are skipped
+  // returns the number of servers in use
+  size_t set_servers(const std::vector<muduo::net::InetAddress>& servers);
+
+  // nameserver lines of a resolv.conf, 127.0.0.1 if there is none like glibc
+  static std::vector<muduo::net::InetAddress> system_servers(const char* path = "/etc/resolv.conf");
+
+  // "1.2.3.4", "1.2.3.4:5353", "::1" or "[::1]:5353"; the port is 53 if not given
+  static bool parse_server(const std::string& text, muduo::net::InetAddress* addr);
+
+  void set_negative_ttl(double negative_ttl) { negative_ttl_ = negative_ttl; }
 
-  explicit dns_resolver(muduo::net::EventLoop* loop, double timeout = 2);
+  // memory of the answer cache, it is emptied
+  void set_cache_bytes(size_t bytes) { cache_.reset(new dns_cache(bytes)); }
+
+  // use a cache shared with the resolvers of other loops instead of a private one
+  void set_cache(const boost::shared_ptr<dns_cache>& cache) { cache_ = cache; }
+
+  const dns_cache& cache() const { return *cache_; }
+
+  // answers of resolve() found in the cache
+  struct cache_stats
+  {
+    uint64_t hits = 0;
+    uint64_t negative_hits = 0;
+    uint64_t misses = 0;
+    uint64_t refreshes = 0;  // hot entries asked again before they expire
+    uint64_t local = 0;      // ip addresses and names of the hosts file, answered at once
+  };
+
+  const cache_stats& lookups() const { return lookups_; }
+
+  // names answered before the cache and the network, /etc/hosts until this is called
+  void set_hosts_file(const std::string& path) { hosts_.reset(new hosts_file(loop_, path)); }
+
+  // udp payload size advertised in an EDNS0 OPT record, 0 sends queries without it
+  void set_edns_payload(uint16_t size);
+
+  // udp syscalls and the datagrams they moved
+  struct io_stats
+  {
+    uint64_t send_calls = 0;
+    uint64_t sent = 0;
+    uint64_t recv_calls = 0;
+    uint64_t received = 0;
+  };
+
+  const io_stats& io() const { return io_; }
 
   // 存在可能无法resolve, transaction ID 已经用完, 支持对ipv6地址的查找
+  // ip地址("10.1.2.3", "::1", "[::1]")和hosts文件里的名字不经过网络, 直接回答
   // may run the callback function during this function
   bool resolve(const std::string& host, const ResolveCallback&, bool ipv6 = false);
 
+  // query AAAA and A together, the callback gets the ipv6 addresses followed by the ipv4 ones
+  // once both have answered, or kResolutionDelay after the first non empty answer
+  bool resolve_all(const std::string& host, const ResolveCallback& cb);
+
  private:
-  // 最大重试次数
-  const static int MAX_TIMEOUT = 0;
+  // 最大重试次数, 每次重试换一个服务器, 所有尝试一共不超过timeout
+  const static int MAX_TIMEOUT = 2;
   // max ttl
   const static int TTL = 500;
 
-  class Entry
+  // transaction表的大小, 下标就是transaction ID
+  const static size_t kSlots = 65536;
+  // 检查查询超时的间隔
+  constexpr static double kSweepInterval = 0.05;
+  // 每个服务器的udp socket数, 每个查询随机选一个
+  const static size_t kSocketsPerServer = 4;
+  // 一个socket发出这么多查询后换成新的随机源端口
+  const static int kQueriesPerSocket = 256;
+  // 一次recvmmsg最多收的回答数
+  const static size_t kRecvBatch = 32;
+  // 一次可读事件最多调用recvmmsg的次数, 其他socket也要处理
+  const static int kMaxRecvRounds = 8;
+
+  // 一个进行中的查询, 槽位预先分配, 字符串和回调数组的存储在查询之间复用
+  struct transaction
   {
-   public:
-    Entry(const ResolveCallback& cb, const std::string& domain_name, bool ipv6, uint8_t count, muduo::net::TimerId timerId)
-        : resolveCallback_(cb), domain_(domain_name), ipv6_(ipv6), count_(count), timerId_(timerId)
-    {
-      assert(resolveCallback_);
-    }
-
-    bool ipv6() const { return  ipv6_; }
-    uint8_t count() const { return count_; }
-    muduo::net::TimerId timerId() { return timerId_; }
-    void resolveCb(const muduo::net::InetAddress& addr) { assert(resolveCallback_); resolveCallback_(addr); }
-    void set_timer_id(const muduo::net::TimerId& timerId) { timerId_ = timerId; }
-    int add_count_and_get() { return ++ count_; }
-    std::string domain() const { return domain_; }
-
-   private:
-    ResolveCallback resolveCallback_; // resolve callback function
-    std::string domain_;              // domain name
-    bool ipv6_;                      //  ipv6 ?
-    uint8_t count_;                   // retry count
-    muduo::net::TimerId timerId_;     // timeout id
+    bool used = false;
+    bool ipv6 = false;
+    bool tcp = false;               // the udp answer was truncated, asked again over tcp
+    int count = 0;                  // times sent
+    size_t server = 0;              // asked last, in servers_
+    uint32_t tried = 0;             // bit i: servers_[i] was asked, its answer is accepted
+    muduo::Timestamp sent;          // of the last send, for the rtt
+    size_t question_end = 0;        // the question ends here in packet, an OPT record may follow
+    muduo::Timestamp deadline;      // of the last send
+    std::string domain;
+    std::string packet;             // the query as sent, answers must repeat its question
+    std::vector<ResolveCallback> waiters;  // 同一个查询的所有调用者, 共享这次查询的结果
   };
 
-  struct AF_INET_Entry
+  // resolve_all的两个查询共享的状态
+  struct dual_query
   {
-    AF_INET_Entry(struct sockaddr_in addr)
-        :addr4(addr)
-    {}
+    ResolveCallback cb;
+    AddressList v6;
+    AddressList v4;
+    bool v6_done = false;
+    bool v4_done = false;
+    bool finished = false;
+  };
+  typedef std::shared_ptr<dual_query> DualQueryPtr;
 
-    struct sockaddr_in addr4;
+  struct udp_socket
+  {
+    int fd = -1;
+    boost::shared_ptr<muduo::net::Channel> channel;
+    int sent = 0;  // queries sent, replaced by a new socket after kQueriesPerSocket
   };
 
-  struct AF_INET6_Entry
+  // 一个上游dns服务器, 按平滑rtt和连续失败次数选择
+  struct upstream
   {
-    AF_INET6_Entry(struct sockaddr_in6 addr)
-        : addr6(addr)
-    { }
+    explicit upstream(const muduo::net::InetAddress& address) : addr(address) { }
 
-    struct sockaddr_in6 addr6;
+    muduo::net::InetAddress addr;
+    double srtt = 0;      // seconds, 0 until the server is asked first so every server is tried
+    bool measured = false;  // srtt comes from an answer
+    int failures = 0;     // timeouts since the last answer
+    std::vector<udp_socket> sockets;
+    std::unique_ptr<dns_stream> stream;  // tcp for truncated answers
+    std::vector<uint16_t> outgoing;      // queries sent together at the end of this loop iteration
   };
 
-  typedef std::weak_ptr<AF_INET_Entry> WkV4EntryPtr;
-  typedef std::weak_ptr<AF_INET6_Entry> WkV6EntryPtr;
+  // function to process read from a udp socket of servers_[server]
+  void handleRead(size_t server, int fd, muduo::Timestamp receiveTime);
+
+  void handleError(int fd);
+
+  // parse one answer in buf from servers_[server], over its stream if tcp
+  void MessageCallback(muduo::net::Buffer* buf, size_t server, bool tcp);
+
+  // an answer from the stream of servers_[server]
+  void onStreamAnswer(size_t server, muduo::net::Buffer* answer);
+
+  // a query the stream couldn't send
+  void onStreamFail(uint16_t transaction_id);
+
+  // a connected udp socket to addr with a random source port, fd is -1 on failure
+  udp_socket open_socket(size_t server);
+
+  void close_socket(const udp_socket& sock);
+
+  // a random socket of the server, replaced by a new source port when it has sent enough
+  udp_socket& socket_for(size_t server, size_t queries);
+
+  // send the outgoing queries of every server, one sendmmsg per server
+  void flush();
+
+  // the server with the lowest srtt weighted by failures, preferring those not in tried
+  size_t choose_server(uint32_t tried);
+
+  // some server isn't in tried
+  bool has_untried(uint32_t tried) const;
+
+  void on_answered(size_t server, muduo::Timestamp sent, muduo::Timestamp now);
 
-  typedef std::shared_ptr<AF_INET_Entry> V4EntryPtr;
-  typedef std::shared_ptr<AF_INET6_Entry> V6EntryPtr;
+  void on_timeout(size_t server);
 
-  typedef std::unordered_set<V4EntryPtr> V4Bucket;
-  typedef std::unordered_set<V6EntryPtr> V6Bucket;
+  // "1.2.3.4", "::1" or "[::1]", the port is 0
+  static bool parse_literal(const std::string& host, muduo::net::InetAddress* addr);
 
-  // function to process read from sockfd_
-  void handleRead(muduo::Timestamp receiveTime);
+  // a random free transaction ID, -1 if every slot is in use
+  int allocate_slot();
 
-  // call by handleRead function
-  void MessageCallback(muduo::Timestamp receiveTime);
+  // send a query or join the one in flight; an empty cb refreshes the cache without waiting for the answer
+  bool query(const std::string& host, const ResolveCallback& cb, bool ipv6);
 
-  void resolve(uint16_t transaction_id);
+  // (re)send the query of the slot and start its deadline, to another server if next_server
+  void send_query(uint16_t transaction_id, bool next_server);
 
-  // function to process write to sockfd_
-  void handleWrite();
+  // the header and question of the answer in data match the query of slot
+  static bool question_matches(const transaction& slot, const char* data, size_t len);
 
-  void sendInLoop(const void* data, size_t len);
+  // free the slot, then call its waiters with addrs
+  void finish(uint16_t transaction_id, const AddressList& addrs);
 
-  void send(muduo::net::Buffer* buf);
+  // retry or fail the queries whose deadline has passed
+  void sweep();
 
-  void handleTimeout(uint16_t transaction_id);
+  // key of a (name, type) query in inflight_
+  static std::string query_key(const std::string& host, bool ipv6);
 
-  void handleError();
+  // the query failed for good, answer it from the cache until negative_ttl_ passes
+  void add_negative(const std::string& domain, bool ipv6);
 
-  void onTimer();
+  void onDualAnswer(const DualQueryPtr& query, bool ipv6, const AddressList& addrs);
 
-  int sockfd_;
+  static void finish_dual(const DualQueryPtr& query);
 
   muduo::net::EventLoop* loop_;
-  muduo::net::Channel* channel_;
-  std::unordered_map<uint16_t, std::shared_ptr<Entry> > dns_datas_;
+  std::vector<upstream> servers_;
+  // 换下来的socket, 等最后的回答到达后关闭
+  std::deque<std::pair<udp_socket, muduo::Timestamp> > retired_;
+  std::vector<transaction> slots_;
+  std::vector<uint16_t> free_;  // unused transaction IDs, taken at random
+  // deadlines in the order they were set, all queries have the same timeout
+  std::deque<std::pair<uint16_t, muduo::Timestamp> > deadlines_;
+  std::mt19937 rng_;
+  muduo::net::Buffer queryBuffer_;  // scratch space to build a query
   muduo::net::Buffer inputBuffer_;
-  muduo::net::Buffer outputBuffer_;
+  // recvmmsg收包的预分配数组, 每个包packet_size_字节
+  std::vector<char> packets_;
+  size_t packet_size_;
+  std::vector<struct mmsghdr> recvMsgs_;
+  std::vector<struct iovec> recvIovecs_;
+  std::vector<struct mmsghdr> sendMsgs_;
+  std::vector<struct iovec> sendIovecs_;
+  bool flush_queued_;
+  io_stats io_;
   double timeout_;
-  muduo::MutexLock mutex_;
-  boost::circular_buffer<V4Bucket> v4_buffers_;
-  boost::circular_buffer<V6Bucket> v6_buffers_;
-  std::unordered_map<std::string,  WkV4EntryPtr> v4_datas_;
-  std::unordered_map<std::string, WkV6EntryPtr> v6_datas_;
+  double attempt_timeout_;  // of one send, timeout_ split among the tries
+  std::unique_ptr<hosts_file> hosts_;
+  boost::shared_ptr<dns_cache> cache_;  // answers and failures, may be shared with other loops
+  cache_stats lookups_;
+  // 正在进行的查询, 相同(name, type)的调用者等待同一个transaction
+  std::unordered_map<std::string, uint16_t> inflight_;
+  double negative_ttl_;
+  uint16_t edns_payload_;
+  muduo::net::TimerId sweep_timer_;
 };
 }
\ No newline at end of file
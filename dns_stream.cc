@@ -0,0 +1,239 @@
+#include "dns_stream.h"
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/SocketsOps.h>
+#include <muduo/base/Logging.h>
+#include <boost/bind.hpp>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace zy;
+
+namespace impl
+{
+
+// Channel不能在自己的事件处理中析构, 推迟到下一轮
+void release_stream_channel(const boost::shared_ptr<muduo::net::Channel>&)
+{
+}
+
+}
+
+dns_stream::dns_stream(muduo::net::EventLoop *loop, const muduo::net::InetAddress &server, double idle_timeout)
+  : loop_(loop),
+    server_(server),
+    idle_timeout_(idle_timeout),
+    state_(kDisconnected),
+    sockfd_(-1),
+    channel_(),
+    inputBuffer_(),
+    outputBuffer_(),
+    answer_(),
+    unanswered_(),
+    retried_(false),
+    last_active_(),
+    idle_timer_(loop_->runEvery(idle_timeout, boost::bind(&dns_stream::onIdle, this))),
+    answerCallback_(),
+    failCallback_()
+{
+}
+
+dns_stream::~dns_stream()
+{
+  loop_->cancel(idle_timer_);
+  if(channel_)
+  {
+    channel_->disableAll();
+    channel_->remove();
+    ::close(sockfd_);
+  }
+}
+
+void dns_stream::send(uint16_t transaction_id, const std::string &packet)
+{
+  loop_->assertInLoopThread();
+  unanswered_[transaction_id] = packet;
+  outputBuffer_.appendInt16(static_cast<int16_t>(packet.size()));
+  outputBuffer_.append(packet.data(), packet.size());
+  last_active_ = muduo::Timestamp::now();
+  if(state_ == kDisconnected)
+  {
+    retried_ = false;
+    connect();
+  }
+  else if(state_ == kConnected && !channel_->isWriting())
+  {
+    if(!flush())
+      handleClose(channel_.get());
+    else if(outputBuffer_.readableBytes() > 0)
+      channel_->enableWriting();
+  }
+}
+
+void dns_stream::connect()
+{
+  assert(state_ == kDisconnected);
+  int sockfd = ::socket(server_.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+  int ret = (sockfd < 0) ? -1 : muduo::net::sockets::connect(sockfd, server_.getSockAddr());
+  int savedErrno = (ret == 0) ? 0 : errno;
+  if(savedErrno != 0 && savedErrno != EINPROGRESS && savedErrno != EINTR)
+  {
+    LOG_ERROR << "connect to dns server " << server_.toIpPort() << " failed: " << muduo::strerror_tl(savedErrno);
+    if(sockfd >= 0)
+      ::close(sockfd);
+    outputBuffer_.retrieveAll();
+    fail_all();
+    return;
+  }
+  sockfd_ = sockfd;
+  channel_.reset(new muduo::net::Channel(loop_, sockfd));
+  const muduo::net::Channel* channel = channel_.get();
+  channel_->setReadCallback(boost::bind(&dns_stream::handleRead, this, channel, _1));
+  channel_->setWriteCallback(boost::bind(&dns_stream::handleWrite, this, channel));
+  channel_->setErrorCallback(boost::bind(&dns_stream::handleClose, this, channel));
+  channel_->setCloseCallback(boost::bind(&dns_stream::handleClose, this, channel));
+  state_ = kConnecting;
+  channel_->enableWriting();
+}
+
+void dns_stream::handleRead(const muduo::net::Channel* channel, muduo::Timestamp receiveTime)
+{
+  // several events in one poll, the connection may be replaced already
+  if(channel != channel_.get())
+    return;
+  int savedErrno = 0;
+  ssize_t n = inputBuffer_.readFd(sockfd_, &savedErrno);
+  if(n <= 0)
+  {
+    if(n < 0)
+    {
+      errno = savedErrno;
+      LOG_SYSERR << "dns_stream::handleRead";
+    }
+    handleClose(channel);
+    return;
+  }
+  while(inputBuffer_.readableBytes() >= 2)
+  {
+    size_t length = static_cast<uint16_t>(inputBuffer_.peekInt16());
+    if(inputBuffer_.readableBytes() < 2 + length)
+      break;
+    inputBuffer_.retrieveInt16();
+    answer_.retrieveAll();
+    answer_.append(inputBuffer_.peek(), length);
+    inputBuffer_.retrieve(length);
+    if(length >= 2)
+      unanswered_.erase(static_cast<uint16_t>(answer_.peekInt16()));
+    retried_ = false;
+    last_active_ = receiveTime;
+    if(answerCallback_)
+      answerCallback_(&answer_);
+    // the callback may send again and find the connection broken
+    if(channel != channel_.get())
+      return;
+  }
+}
+
+void dns_stream::handleWrite(const muduo::net::Channel* channel)
+{
+  if(channel != channel_.get())
+    return;
+  if(state_ == kConnecting)
+  {
+    int err = muduo::net::sockets::getSocketError(sockfd_);
+    if(err)
+    {
+      LOG_ERROR << "connect to dns server " << server_.toIpPort() << " failed: " << muduo::strerror_tl(err);
+      handleClose(channel);
+      return;
+    }
+    state_ = kConnected;
+    channel_->enableReading();
+  }
+  if(!flush())
+  {
+    handleClose(channel);
+    return;
+  }
+  if(outputBuffer_.readableBytes() == 0)
+    channel_->disableWriting();
+}
+
+void dns_stream::handleClose(const muduo::net::Channel* channel)
+{
+  if(channel != channel_.get())
+    return;
+  close_socket();
+  if(unanswered_.empty())
+    return;
+  // 服务器可能刚好关闭了空闲连接, 在新连接上重发一次
+  if(retried_)
+  {
+    LOG_ERROR << "dns tcp connection to " << server_.toIpPort() << " broke again, "
+              << unanswered_.size() << " queries failed";
+    fail_all();
+    return;
+  }
+  retried_ = true;
+  for(const auto& query : unanswered_)
+  {
+    outputBuffer_.appendInt16(static_cast<int16_t>(query.second.size()));
+    outputBuffer_.append(query.second.data(), query.second.size());
+  }
+  connect();
+}
+
+bool dns_stream::flush()
+{
+  if(outputBuffer_.readableBytes() == 0)
+    return true;
+  ssize_t n = muduo::net::sockets::write(sockfd_, outputBuffer_.peek(), outputBuffer_.readableBytes());
+  if(n >= 0)
+  {
+    outputBuffer_.retrieve(static_cast<size_t>(n));
+    return true;
+  }
+  if(errno == EWOULDBLOCK || errno == EINTR)
+    return true;
+  LOG_SYSERR << "dns_stream::flush";
+  return false;
+}
+
+void dns_stream::close_socket()
+{
+  if(state_ == kDisconnected)
+    return;
+  channel_->disableAll();
+  channel_->remove();
+  loop_->queueInLoop(boost::bind(&impl::release_stream_channel, channel_));
+  channel_.reset();
+  ::close(sockfd_);
+  sockfd_ = -1;
+  state_ = kDisconnected;
+  inputBuffer_.retrieveAll();
+  outputBuffer_.retrieveAll();
+}
+
+void dns_stream::fail_all()
+{
+  // the callbacks may send new queries, they must not see the failed ones
+  std::map<uint16_t, std::string> failed;
+  failed.swap(unanswered_);
+  for(const auto& query : failed)
+  {
+    if(failCallback_)
+      failCallback_(query.first);
+  }
+}
+
+void dns_stream::onIdle()
+{
+  if(state_ == kConnected && unanswered_.empty()
+     && muduo::timeDifference(muduo::Timestamp::now(), last_active_) >= idle_timeout_)
+  {
+    LOG_DEBUG << "close idle dns tcp connection to " << server_.toIpPort();
+    close_socket();
+  }
+}
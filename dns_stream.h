@@ -0,0 +1,99 @@
+#pragma once
+
+#include <muduo/net/Buffer.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TimerId.h>
+#include <muduo/base/Timestamp.h>
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <string>
+#include <map>
+
+namespace muduo
+{
+namespace net
+{
+class Channel;
+class EventLoop;
+}
+}
+
+namespace zy
+{
+// 到dns服务器的tcp连接, 用于被截断(TC)的回答; 查询按RFC 7766带两字节长度前缀流水线发送, 回答可以乱序到达
+// 连接在查询之间保持, 空闲idle_timeout秒后关闭; 只在所属loop线程中使用
+class dns_stream : boost::noncopyable
+{
+ public:
+  // one complete answer without its length prefix
+  typedef boost::function<void(muduo::net::Buffer* answer)> AnswerCallback;
+  // the query can't be sent, the connection broke twice without an answer
+  typedef boost::function<void(uint16_t transaction_id)> FailCallback;
+
+  dns_stream(muduo::net::EventLoop* loop, const muduo::net::InetAddress& server, double idle_timeout = 10);
+
+  ~dns_stream();
+
+  void setAnswerCallback(const AnswerCallback& cb) { answerCallback_ = cb; }
+
+  void setFailCallback(const FailCallback& cb) { failCallback_ = cb; }
+
+  // connect first if there is no connection, the packet is kept until its answer arrives
+  void send(uint16_t transaction_id, const std::string& packet);
+
+  // the query isn't waited for any more, its late answer is still passed on
+  void cancel(uint16_t transaction_id) { unanswered_.erase(transaction_id); }
+
+  bool connected() const { return state_ == kConnected; }
+
+  size_t pending() const { return unanswered_.size(); }
+
+ private:
+  enum state
+  {
+    kDisconnected,
+    kConnecting,
+    kConnected
+  };
+
+  void connect();
+
+  // the channel the event came from, ignored if it isn't channel_ any more
+  void handleRead(const muduo::net::Channel* channel, muduo::Timestamp receiveTime);
+
+  void handleWrite(const muduo::net::Channel* channel);
+
+  // error, hang up or a failed connect
+  void handleClose(const muduo::net::Channel* channel);
+
+  // write as much of outputBuffer_ as the socket takes
+  bool flush();
+
+  // remove the channel from the poller and close the socket
+  void close_socket();
+
+  // call the fail callback for every unanswered query
+  void fail_all();
+
+  void onIdle();
+
+  muduo::net::EventLoop* loop_;
+  muduo::net::InetAddress server_;
+  double idle_timeout_;
+  state state_;
+  int sockfd_;
+  boost::shared_ptr<muduo::net::Channel> channel_;
+  muduo::net::Buffer inputBuffer_;
+  muduo::net::Buffer outputBuffer_;
+  muduo::net::Buffer answer_;  // a single answer cut from inputBuffer_
+  // 发出但还没有回答的查询, 连接断开后在新连接上重发一次
+  std::map<uint16_t, std::string> unanswered_;
+  bool retried_;  // the connection was replaced since the last answer
+  muduo::Timestamp last_active_;
+  muduo::net::TimerId idle_timer_;
+  AnswerCallback answerCallback_;
+  FailCallback failCallback_;
+};
+}
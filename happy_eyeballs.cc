@@ -0,0 +1,219 @@
+#include "happy_eyeballs.h"
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/SocketsOps.h>
+#include <muduo/base/Logging.h>
+#include <boost/bind.hpp>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace zy;
+
+namespace impl
+{
+
+// Channel不能在自己的事件处理中析构, 和Connector一样推迟到下一轮
+void release_channel(const boost::shared_ptr<muduo::net::Channel>&)
+{
+}
+
+// ipv6, ipv4, ipv6, ... starting with ipv6 if there is any, the order inside a family is kept
+std::vector<muduo::net::InetAddress> interleave(const std::vector<muduo::net::InetAddress>& addrs)
+{
+  std::vector<muduo::net::InetAddress> v6, v4, result;
+  for(const auto& addr : addrs)
+  {
+    if(addr.family() == AF_INET6)
+      v6.push_back(addr);
+    else
+      v4.push_back(addr);
+  }
+  for(size_t i = 0; i < v6.size() || i < v4.size(); ++i)
+  {
+    if(i < v6.size())
+      result.push_back(v6[i]);
+    if(i < v4.size())
+      result.push_back(v4[i]);
+  }
+  return result;
+}
+
+}
+
+happy_eyeballs::happy_eyeballs(muduo::net::EventLoop *loop,
+                               const std::vector<muduo::net::InetAddress> &addrs,
+                               double attempt_delay)
+  : loop_(loop),
+    addrs_(impl::interleave(addrs)),
+    attempt_delay_(attempt_delay),
+    next_(0),
+    attempts_(),
+    delay_timer_(),
+    newConnectionCallback_(),
+    errorCallback_(),
+    stopped_(false)
+{
+  assert(!addrs_.empty());
+}
+
+happy_eyeballs::~happy_eyeballs()
+{
+  stop();
+}
+
+void happy_eyeballs::start()
+{
+  loop_->assertInLoopThread();
+  start_next();
+}
+
+void happy_eyeballs::stop()
+{
+  stopped_ = true;
+  cancel_delay();
+  for(size_t i = 0; i < attempts_.size(); ++i)
+  {
+    remove(i);
+    ::close(attempts_[i].sockfd);
+  }
+  attempts_.clear();
+}
+
+void happy_eyeballs::start_next()
+{
+  cancel_delay();
+  bool started = false;
+  while(!stopped_ && !started && next_ < addrs_.size())
+  {
+    size_t index = next_++;
+    const muduo::net::InetAddress& addr = addrs_[index];
+    int sockfd = ::socket(addr.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(sockfd < 0)
+    {
+      LOG_SYSERR << "happy_eyeballs socket " << addr.toIpPort();
+      continue;
+    }
+    int ret = muduo::net::sockets::connect(sockfd, addr.getSockAddr());
+    int savedErrno = (ret == 0) ? 0 : errno;
+    if(savedErrno != 0 && savedErrno != EINPROGRESS && savedErrno != EINTR && savedErrno != EISCONN)
+    {
+      // 比如没有ipv6路由时的ENETUNREACH, 立即换下一个地址
+      LOG_INFO << "connect to " << addr.toIpPort() << " failed: " << muduo::strerror_tl(savedErrno);
+      ::close(sockfd);
+      continue;
+    }
+    boost::shared_ptr<muduo::net::Channel> channel(new muduo::net::Channel(loop_, sockfd));
+    channel->setWriteCallback(boost::bind(&happy_eyeballs::onWritable, this, sockfd));
+    channel->setErrorCallback(boost::bind(&happy_eyeballs::onWritable, this, sockfd));
+    channel->setCloseCallback(boost::bind(&happy_eyeballs::onWritable, this, sockfd));
+    channel->enableWriting();
+    attempts_.push_back(attempt{index, sockfd, channel});
+    started = true;
+  }
+  if(stopped_)
+    return;
+  if(started && next_ < addrs_.size())
+  {
+    schedule_delay();
+  }
+  else if(attempts_.empty() && next_ == addrs_.size())
+  {
+    stopped_ = true;
+    if(errorCallback_)
+      errorCallback_();
+  }
+}
+
+void happy_eyeballs::onWritable(int sockfd)
+{
+  size_t i = 0;
+  while(i < attempts_.size() && attempts_[i].sockfd != sockfd)
+    ++i;
+  // several events in one poll, the attempt may be finished already
+  if(stopped_ || i == attempts_.size())
+    return;
+  int err = muduo::net::sockets::getSocketError(sockfd);
+  if(err)
+  {
+    LOG_INFO << "connect to " << addrs_[attempts_[i].index].toIpPort() << " failed: " << muduo::strerror_tl(err);
+    fail(sockfd);
+    return;
+  }
+  if(muduo::net::sockets::isSelfConnect(sockfd))
+  {
+    LOG_WARN << "happy_eyeballs self connect " << addrs_[attempts_[i].index].toIpPort();
+    fail(sockfd);
+    return;
+  }
+  // the winner keeps its socket, the others are closed
+  cancel_delay();
+  for(size_t j = 0; j < attempts_.size(); ++j)
+  {
+    remove(j);
+    if(j != i)
+      ::close(attempts_[j].sockfd);
+  }
+  attempts_.clear();
+  stopped_ = true;
+  // may destroy the owner of this object, nothing is touched after it
+  if(newConnectionCallback_)
+    newConnectionCallback_(sockfd);
+  else
+    ::close(sockfd);
+}
+
+void happy_eyeballs::fail(int sockfd)
+{
+  for(size_t i = 0; i < attempts_.size(); ++i)
+  {
+    if(attempts_[i].sockfd == sockfd)
+    {
+      remove(i);
+      ::close(sockfd);
+      attempts_.erase(attempts_.begin() + static_cast<long>(i));
+      break;
+    }
+  }
+  // don't wait for the delay, the next address starts now
+  start_next();
+}
+
+void happy_eyeballs::remove(size_t i)
+{
+  const auto& channel = attempts_[i].channel;
+  channel->disableAll();
+  channel->remove();
+  loop_->queueInLoop(boost::bind(&impl::release_channel, channel));
+}
+
+void happy_eyeballs::onDelay()
+{
+  delay_timer_.reset();
+  if(!stopped_)
+    start_next();
+}
+
+void happy_eyeballs::schedule_delay()
+{
+  auto timer = loop_->runAfter(attempt_delay_,
+                               boost::bind(&happy_eyeballs::onDelayWeak, boost::weak_ptr<happy_eyeballs>(shared_from_this())));
+  delay_timer_.reset(new muduo::net::TimerId(timer));
+}
+
+void happy_eyeballs::cancel_delay()
+{
+  if(delay_timer_)
+  {
+    loop_->cancel(*delay_timer_);
+    delay_timer_.reset();
+  }
+}
+
+void happy_eyeballs::onDelayWeak(const boost::weak_ptr<happy_eyeballs> &wkEyeballs)
+{
+  auto eyeballs = wkEyeballs.lock();
+  if(eyeballs)
+    eyeballs->onDelay();
+}
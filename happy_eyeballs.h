@@ -0,0 +1,89 @@
+#pragma once
+
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TimerId.h>
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <memory>
+#include <vector>
+
+namespace muduo
+{
+namespace net
+{
+class Channel;
+class EventLoop;
+}
+}
+
+namespace zy
+{
+// RFC 8305 风格的并行连接: 按地址族交替排列, 每隔attempt_delay发起下一个连接, 保留第一个成功的
+// 失败的连接会立即让下一个地址开始, 和muduo::net::Connector不同, 不会对同一个地址重试
+class happy_eyeballs : boost::noncopyable, public boost::enable_shared_from_this<happy_eyeballs>
+{
+ public:
+  typedef boost::function<void(int sockfd)> NewConnectionCallback;
+  typedef boost::function<void()> ErrorCallback;
+
+  // addrs must not be empty, ipv6 addresses are tried first
+  happy_eyeballs(muduo::net::EventLoop* loop, const std::vector<muduo::net::InetAddress>& addrs,
+                 double attempt_delay = 0.25);
+
+  ~happy_eyeballs();
+
+  // the connected socket, the other attempts are closed before it is called
+  void setNewConnectionCallback(const NewConnectionCallback& cb) { newConnectionCallback_ = cb; }
+
+  // every address has failed
+  void setErrorCallback(const ErrorCallback& cb) { errorCallback_ = cb; }
+
+  // in the loop thread, must be owned by a boost::shared_ptr
+  void start();
+
+  // close the attempts in flight, no callback is called after it
+  void stop();
+
+  size_t addresses() const { return addrs_.size(); }
+
+ private:
+  struct attempt
+  {
+    size_t index;  // in addrs_
+    int sockfd;
+    boost::shared_ptr<muduo::net::Channel> channel;
+  };
+
+  // start connecting to the next address, go on until one is in progress or none is left
+  void start_next();
+
+  // the socket of an attempt became writable or reported an error
+  void onWritable(int sockfd);
+
+  void onDelay();
+
+  static void onDelayWeak(const boost::weak_ptr<happy_eyeballs>& wkEyeballs);
+
+  // an attempt failed, try the next address at once
+  void fail(int sockfd);
+
+  // remove the channel of attempts_[i] from the poller, the socket is left open
+  void remove(size_t i);
+
+  void schedule_delay();
+
+  void cancel_delay();
+
+  muduo::net::EventLoop* loop_;
+  std::vector<muduo::net::InetAddress> addrs_;
+  double attempt_delay_;
+  size_t next_;
+  std::vector<attempt> attempts_;  // connecting now
+  std::unique_ptr<muduo::net::TimerId> delay_timer_;
+  NewConnectionCallback newConnectionCallback_;
+  ErrorCallback errorCallback_;
+  bool stopped_;
+};
+}
@@ -0,0 +1,186 @@
+#include "hosts_file.h"
+
+#include <muduo/base/Logging.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+#include <boost/bind.hpp>
+#include <fstream>
+#include <sstream>
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+using namespace zy;
+
+namespace impl
+{
+
+// 编辑器通常写一个新文件再rename过来, 只监视文件本身会丢掉后面的修改
+const uint32_t kWatchedEvents = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM;
+
+inline char lower(char ch)
+{
+  return (ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch | 0x20) : ch;
+}
+
+}
+
+hosts_file::hosts_file(muduo::net::EventLoop *loop, const std::string &path)
+  : loop_(loop),
+    path_(path),
+    name_(),
+    inotifyfd_(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+    channel_(),
+    hosts_()
+{
+  size_t slash = path_.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path_.substr(0, slash));
+  name_ = slash == std::string::npos ? path_ : path_.substr(slash + 1);
+  if(inotifyfd_ < 0)
+  {
+    LOG_SYSERR << "inotify_init1, changes of " << path_ << " are not seen";
+  }
+  else if(::inotify_add_watch(inotifyfd_, dir.c_str(), impl::kWatchedEvents) < 0)
+  {
+    LOG_SYSERR << "inotify_add_watch " << dir << ", changes of " << path_ << " are not seen";
+    ::close(inotifyfd_);
+    inotifyfd_ = -1;
+  }
+  else
+  {
+    channel_.reset(new muduo::net::Channel(loop_, inotifyfd_));
+    channel_->setReadCallback(boost::bind(&hosts_file::handleRead, this));
+    channel_->enableReading();
+  }
+  load();
+}
+
+hosts_file::~hosts_file()
+{
+  if(channel_)
+  {
+    channel_->disableAll();
+    channel_->remove();
+  }
+  if(inotifyfd_ >= 0)
+    ::close(inotifyfd_);
+}
+
+size_t hosts_file::name_hash::operator()(const std::string &name) const
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for(char ch : name)
+  {
+    hash ^= static_cast<uint8_t>(impl::lower(ch));
+    hash *= 1099511628211ULL;
+  }
+  return static_cast<size_t>(hash);
+}
+
+bool hosts_file::name_equal::operator()(const std::string &lhs, const std::string &rhs) const
+{
+  if(lhs.size() != rhs.size())
+    return false;
+  for(size_t i = 0; i < lhs.size(); ++i)
+  {
+    if(impl::lower(lhs[i]) != impl::lower(rhs[i]))
+      return false;
+  }
+  return true;
+}
+
+bool hosts_file::lookup(const std::string &name, bool ipv6, hosts_file::AddressList *addrs) const
+{
+  if(hosts_.empty())
+    return false;
+  auto it = hosts_.find(name);
+  if(it == hosts_.end())
+    return false;
+  const AddressList& found = ipv6 ? it->second.v6 : it->second.v4;
+  if(found.empty())
+    return false;
+  *addrs = found;
+  return true;
+}
+
+bool hosts_file::lookup_all(const std::string &name, hosts_file::AddressList *addrs) const
+{
+  if(hosts_.empty())
+    return false;
+  auto it = hosts_.find(name);
+  if(it == hosts_.end())
+    return false;
+  *addrs = it->second.v6;
+  addrs->insert(addrs->end(), it->second.v4.begin(), it->second.v4.end());
+  return true;
+}
+
+void hosts_file::load()
+{
+  hosts_.clear();
+  std::ifstream in(path_.c_str());
+  std::string line;
+  while(std::getline(in, line))
+  {
+    size_t hash = line.find('#');
+    if(hash != std::string::npos)
+      line.resize(hash);
+    // address canonical_name [aliases...]
+    std::istringstream fields(line);
+    std::string ip, name;
+    if(!(fields >> ip))
+      continue;
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    ::bzero(&addr6, sizeof addr6);
+    ::bzero(&addr4, sizeof addr4);
+    bool ipv6 = false;
+    if(::inet_pton(AF_INET, ip.c_str(), &addr4.sin_addr) == 1)
+    {
+      addr4.sin_family = AF_INET;
+    }
+    else if(::inet_pton(AF_INET6, ip.c_str(), &addr6.sin6_addr) == 1)
+    {
+      addr6.sin6_family = AF_INET6;
+      ipv6 = true;
+    }
+    else
+    {
+      LOG_WARN << "ignore " << ip << " in " << path_;
+      continue;
+    }
+    while(fields >> name)
+    {
+      entry& e = hosts_[name];
+      if(ipv6)
+        e.v6.push_back(muduo::net::InetAddress(addr6));
+      else
+        e.v4.push_back(muduo::net::InetAddress(addr4));
+    }
+  }
+  LOG_INFO << hosts_.size() << " names in " << path_;
+}
+
+void hosts_file::handleRead()
+{
+  // a read returns whole events only
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  for(;;)
+  {
+    ssize_t n = ::read(inotifyfd_, buf, sizeof buf);
+    if(n <= 0)
+      break;
+    for(char* p = buf; p < buf + n; )
+    {
+      const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+      if(event->len > 0 && name_ == event->name)
+        changed = true;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  if(changed)
+    load();
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <muduo/net/InetAddress.h>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace muduo
+{
+namespace net
+{
+class Channel;
+class EventLoop;
+}
+}
+
+namespace zy
+{
+// 内存里的/etc/hosts, 文件所在目录用inotify监视, 文件被改写或替换后重新读取; 只在所属loop线程中使用
+class hosts_file : boost::noncopyable
+{
+ public:
+  typedef std::vector<muduo::net::InetAddress> AddressList;
+
+  hosts_file(muduo::net::EventLoop* loop, const std::string& path = "/etc/hosts");
+
+  ~hosts_file();
+
+  // addresses of name of the family in file order, false if there is none; names are case insensitive
+  bool lookup(const std::string& name, bool ipv6, AddressList* addrs) const;
+
+  // ipv6 addresses then ipv4 addresses of name, false if the name isn't listed
+  bool lookup_all(const std::string& name, AddressList* addrs) const;
+
+  // names listed
+  size_t size() const { return hosts_.size(); }
+
+  // read the file again, a missing file leaves the table empty
+  void load();
+
+ private:
+  struct entry
+  {
+    AddressList v4;
+    AddressList v6;
+  };
+
+  // 查找时不复制名字, 哈希和比较都忽略大小写
+  struct name_hash
+  {
+    size_t operator()(const std::string& name) const;
+  };
+
+  struct name_equal
+  {
+    bool operator()(const std::string& lhs, const std::string& rhs) const;
+  };
+
+  // inotify events of the directory, reload if one is about the file
+  void handleRead();
+
+  muduo::net::EventLoop* loop_;
+  std::string path_;
+  std::string name_;  // of the file in its directory, as inotify reports it
+  int inotifyfd_;
+  boost::shared_ptr<muduo::net::Channel> channel_;
+  std::unordered_map<std::string, entry, name_hash, name_equal> hosts_;
+};
+}
@@ -1,7 +1,12 @@
 #include "http_header.h"
+#include "simd_scan.h"
 
 #include <muduo/base/Logging.h>
 #include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#include <sys/uio.h>
 
 using namespace zy;
 
@@ -50,6 +55,27 @@ bool init_url(const std::string& line, std::string &domain, std::string& url, ui
     url = line.substr(slash_pos);
   }
   port = 80;
+  // ipv6地址带方括号: [::1] 或 [::1]:443, 去掉括号
+  if(!domain.empty() && domain[0] == '[')
+  {
+    size_t close = domain.find(']');
+    if(close == std::string::npos || close == 1)
+      return false;
+    std::string tail(domain.substr(close + 1));
+    domain = domain.substr(1, close - 1);
+    if(tail.empty())
+      return true;
+    if(tail[0] != ':')
+      return false;
+    try {
+      port = static_cast<uint16_t>(std::stoi(tail.substr(1)));
+      return true;
+    }catch(...)
+    {
+      LOG_ERROR << "port convert error because of " << tail;
+      return false;
+    }
+  }
   auto results = split(domain, ':');
   if(results.size() == 1)
     return true;
@@ -71,86 +97,525 @@ bool init_url(const std::string& line, std::string &domain, std::string& url, ui
   }
 }
 
-std::string to_lower(const std::string& input)
+// case insensitive compare of [begin, end) and a lower case literal
+bool equals_lower(const char* begin, const char* end, const char* lower)
 {
-  std::string result;
-  for(auto ch : input)
-    result.push_back(std::tolower(ch));
-  return result;
+  for(; begin != end; ++begin, ++lower)
+  {
+    if(*lower == '\0' || (*begin | 0x20) != *lower)
+      return false;
+  }
+  return *lower == '\0';
 }
 
+// comma separated list such as "keep-alive, Upgrade" contains token
+bool has_token(const char* begin, const char* end, const char* token)
+{
+  while(begin != end)
+  {
+    const char* comma = zy::scan::find_char(begin, end, ',');
+    const char* first = begin;
+    const char* last = comma;
+    while(first != last && (*first == ' ' || *first == '\t'))
+      ++first;
+    while(last != first && (*(last - 1) == ' ' || *(last - 1) == '\t'))
+      --last;
+    if(equals_lower(first, last, token))
+      return true;
+    begin = (comma == end) ? end : comma + 1;
+  }
+  return false;
+}
+
+// the last element of a comma separated list is token
+bool last_token_is(const char* begin, const char* end, const char* token)
+{
+  const char* last = end;
+  while(last != begin && (*(last - 1) == ' ' || *(last - 1) == '\t'))
+    --last;
+  const char* comma = last;
+  while(comma != begin && *(comma - 1) != ',')
+    --comma;
+  return has_token(comma, last, token);
+}
+
+// digits only, optionally followed by whitespace; -1 on anything else or a length beyond 2^53
+int64_t parse_content_length(const char* begin, const char* end)
+{
+  int64_t length = 0;
+  const char* p = begin;
+  for(; p != end && *p >= '0' && *p <= '9'; ++p)
+  {
+    length = length * 10 + (*p - '0');
+    if(length > (static_cast<int64_t>(1) << 53))
+      return -1;
+  }
+  while(p != end && (*p == ' ' || *p == '\t'))
+    ++p;
+  return (p == begin || p != end) ? -1 : length;
+}
+
+}
+
+http_body::http_body()
+  : state_(kFinished),
+    remaining_(0),
+    line_length_(0),
+    has_digit_(false)
+{
+
+}
+
+void http_body::start_length(size_t length)
+{
+  remaining_ = length;
+  state_ = length > 0 ? kLength : kFinished;
+}
+
+void http_body::start_chunked()
+{
+  state_ = kChunkSize;
+  remaining_ = 0;
+  line_length_ = 0;
+  has_digit_ = false;
+}
+
+http_body::result http_body::consume(const char *data, size_t len, size_t *consumed)
+{
+  size_t pos = 0;
+  while(state_ != kFinished && pos < len)
+  {
+    // 数据部分整段跳过, 其余部分逐字节处理
+    if(state_ == kLength || state_ == kChunkData)
+    {
+      uint64_t n = std::min<uint64_t>(remaining_, len - pos);
+      pos += static_cast<size_t>(n);
+      remaining_ -= n;
+      if(remaining_ == 0)
+        state_ = (state_ == kLength) ? kFinished : kChunkDataCR;
+      continue;
+    }
+    char ch = data[pos++];
+    if(++line_length_ > kMaxLineLength)
+    {
+      LOG_ERROR << "chunk line is longer than " << kMaxLineLength;
+      return kError;
+    }
+    switch(state_)
+    {
+      case kChunkSize:
+      {
+        int digit = -1;
+        if(ch >= '0' && ch <= '9')
+          digit = ch - '0';
+        else if((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+          digit = (ch | 0x20) - 'a' + 10;
+        if(digit >= 0)
+        {
+          if(remaining_ >> 60)
+          {
+            LOG_ERROR << "chunk size overflow";
+            return kError;
+          }
+          remaining_ = remaining_ * 16 + digit;
+          has_digit_ = true;
+          break;
+        }
+        if(!has_digit_)
+          return kError;
+        if(ch == ';' || ch == ' ' || ch == '\t')
+          state_ = kChunkExt;
+        else if(ch == '\r')
+          state_ = kChunkSizeLF;
+        else if(ch == '\n')
+          state_ = remaining_ > 0 ? kChunkData : kTrailerStart;
+        else
+          return kError;
+        break;
+      }
+      case kChunkExt:
+        if(ch == '\n')
+          state_ = remaining_ > 0 ? kChunkData : kTrailerStart;
+        break;
+      case kChunkSizeLF:
+        if(ch != '\n')
+          return kError;
+        state_ = remaining_ > 0 ? kChunkData : kTrailerStart;
+        break;
+      case kChunkDataCR:
+        if(ch == '\r')
+          state_ = kChunkDataLF;
+        else if(ch == '\n')
+          start_chunked();
+        else
+          return kError;
+        break;
+      case kChunkDataLF:
+        if(ch != '\n')
+          return kError;
+        start_chunked();
+        break;
+      case kTrailerStart:
+        if(ch == '\r')
+          state_ = kTrailerLF;
+        else if(ch == '\n')
+          state_ = kFinished;
+        else
+          state_ = kTrailerLine;
+        break;
+      case kTrailerLine:
+        if(ch == '\n')
+        {
+          state_ = kTrailerStart;
+          line_length_ = 0;
+        }
+        break;
+      case kTrailerLF:
+        if(ch != '\n')
+          return kError;
+        state_ = kFinished;
+        break;
+      default:
+        assert(false);
+        return kError;
+    }
+    if(state_ == kChunkData || state_ == kTrailerStart)
+      line_length_ = 0;
+  }
+  *consumed = pos;
+  return state_ == kFinished ? kDone : kNeedMore;
 }
 
 http_request::http_request()
-  : method_(),
+  : state_(kRequestLine),
+    parsed_(0),
+    line_begin_(0),
+    header_length_(0),
+    method_(),
     domain_name_(),
     port_(80),
     url_(),
     version_(),
-    headers_(),
-    proxy_request_(),
-    content_()
+    content_length_(-1),
+    has_transfer_encoding_(false),
+    chunked_(false),
+    request_line_(),
+    slices_()
 {
 
 }
 
-std::string http_request::get_header(const std::string& key) const
+http_request::parse_result http_request::parse(const char *data, size_t len)
+{
+  while(state_ != kDone)
+  {
+    if(parsed_ > kMaxHeaderSize)
+    {
+      LOG_ERROR << "http header is longer than " << kMaxHeaderSize;
+      return kError;
+    }
+    if(parsed_ >= len)
+      return kIncomplete;
+    const char* lf = scan::find_char(data + parsed_, data + len, '\n');
+    if(lf == data + len)
+    {
+      parsed_ = len;
+      continue;
+    }
+    size_t raw_begin = line_begin_;
+    const char* begin = data + line_begin_;
+    const char* end = lf;
+    if(end > begin && *(end - 1) == '\r')
+      --end;
+    parsed_ = line_begin_ = static_cast<size_t>(lf - data) + 1;
+    if(begin == end)
+    {
+      // 请求行之前的空行直接忽略
+      if(state_ == kHeaders)
+      {
+        state_ = kDone;
+        header_length_ = parsed_;
+        add_slice(raw_begin, parsed_ - raw_begin);
+      }
+      continue;
+    }
+    bool ret = (state_ == kRequestLine) ? init_request(begin, end) : add_header(begin, end, raw_begin, parsed_);
+    if(!ret)
+      return kError;
+    state_ = kHeaders;
+  }
+  return kComplete;
+}
+
+void http_request::reset()
 {
-  auto lower_key = impl::to_lower(key);
-  auto it = headers_.find(lower_key);
-  if(it != headers_.end())
-    return it->second;
-  return "";
+  state_ = kRequestLine;
+  parsed_ = 0;
+  line_begin_ = 0;
+  header_length_ = 0;
+  method_.clear();
+  domain_name_.clear();
+  port_ = 80;
+  url_.clear();
+  version_.clear();
+  content_length_ = -1;
+  has_transfer_encoding_ = false;
+  chunked_ = false;
+  request_line_.clear();
+  slices_.clear();
 }
 
-bool http_request::init_request(const std::string &line)
+bool http_request::init_request(const char* begin, const char* end)
 {
-  auto contents = impl::split(line, ' ');
-  if(contents.size() != 3)
+  // method SP request-target SP version
+  const char* sp1 = scan::find_char(begin, end, ' ');
+  if(sp1 == end || sp1 == begin)
+    return false;
+  const char* sp2 = scan::find_char(sp1 + 1, end, ' ');
+  if(sp2 == end || sp2 == sp1 + 1 || sp2 + 1 == end)
     return false;
-  method_ = contents[0];
-  version_ = contents[2];
-  auto proxy_url = contents[1];
+  if(scan::find_char(sp2 + 1, end, ' ') != end)
+    return false;
+  method_.assign(begin, sp1);
+  version_.assign(sp2 + 1, end);
+  std::string proxy_url(sp1 + 1, sp2);
   bool ret = impl::init_url(proxy_url, domain_name_, url_, port_);
   if(ret)
   {
-    proxy_request_ += method_ + " " + url_ + " " + version_ + "\r\n";
+    request_line_ = method_ + " " + url_ + " " + version_ + "\r\n";
+    add_fragment(request_line_.data(), request_line_.size());
   }
   return ret;
 }
 
-bool http_request::add_header(const std::string &line)
+bool http_request::add_header(const char* begin, const char* end, size_t raw_begin, size_t raw_end)
 {
-  size_t colon = line.find(':');
-  if(colon == line.npos || colon == line.size() - 1)
+  const char* colon = scan::find_char(begin, end, ':');
+  if(colon == end || colon + 1 == end)
   {
     return false;
   }
-  auto key = line.substr(0, colon);
-  auto value = line.substr(colon + 1);
-  while(!value.empty() && value.front() == ' ')
+  const char* value = colon + 1;
+  while(value != end && *value == ' ')
   {
-    value.erase(value.begin());
+    ++value;
   }
-  if(value.empty())
+  if(value == end)
     return false;
-  std::string lower_key = impl::to_lower(key);
-  headers_[lower_key] = value;
+  // 上游连接被多个客户端复用, 有歧义的请求体边界会被用来做request smuggling, 一律拒绝
+  if(impl::equals_lower(begin, colon, "content-length"))
+  {
+    int64_t length = impl::parse_content_length(value, end);
+    // repeated Content-Length is only allowed with the same value
+    if(length < 0 || (content_length_ >= 0 && content_length_ != length))
+    {
+      LOG_ERROR << "invalid or repeated Content-Length";
+      return false;
+    }
+    content_length_ = length;
+  }
+  else if(impl::equals_lower(begin, colon, "transfer-encoding"))
+  {
+    if(has_transfer_encoding_)
+    {
+      LOG_ERROR << "repeated Transfer-Encoding";
+      return false;
+    }
+    has_transfer_encoding_ = true;
+    chunked_ = impl::last_token_is(value, end, "chunked");
+  }
   // 对proxy-connection进行特殊处理
-  if(lower_key == "proxy-connection")
+  if(impl::equals_lower(begin, colon, "proxy-connection"))
   {
-    proxy_request_ += "Connection: Keep-Alive\r\n";
+    static const char connection[] = "Connection: Keep-Alive\r\n";
+    add_fragment(connection, sizeof(connection) - 1);
   }
   else
   {
-    proxy_request_ += line + "\r\n";
+    add_slice(raw_begin, raw_end - raw_begin);
   }
   return true;
 }
 
-std::string http_request::proxy_request() const {
-  std::string result = proxy_request_ + "\r\n";
-  if(!result.empty())
-    result += content_;
-  return result;
-}
\ No newline at end of file
+void http_request::add_slice(size_t offset, size_t length)
+{
+  if(!slices_.empty())
+  {
+    slice& last = slices_.back();
+    if(last.fragment == nullptr && last.offset + last.length == offset)
+    {
+      last.length += length;
+      return;
+    }
+  }
+  slices_.push_back(slice{nullptr, offset, length});
+}
+
+void http_request::add_fragment(const char *fragment, size_t length)
+{
+  slices_.push_back(slice{fragment, 0, length});
+}
+
+void http_request::proxy_request(const char *data, size_t content_length, std::vector<struct iovec> *iov) const
+{
+  iov->clear();
+  for(const auto& s : slices_)
+  {
+    struct iovec vec;
+    vec.iov_base = const_cast<char*>(s.fragment ? s.fragment : data + s.offset);
+    vec.iov_len = s.length;
+    iov->push_back(vec);
+  }
+  if(content_length > 0)
+  {
+    // the empty line is always an input range, the body follows it directly
+    if(!slices_.empty() && slices_.back().fragment == nullptr)
+    {
+      iov->back().iov_len += content_length;
+      return;
+    }
+    struct iovec vec;
+    vec.iov_base = const_cast<char*>(data + header_length_);
+    vec.iov_len = content_length;
+    iov->push_back(vec);
+  }
+}
+
+size_t http_request::proxy_request_size() const
+{
+  size_t size = 0;
+  for(const auto& s : slices_)
+    size += s.length;
+  return size;
+}
+
+http_response::http_response()
+  : state_(kStatusLine),
+    parsed_(0),
+    line_begin_(0),
+    header_length_(0),
+    status_(0),
+    http10_(false),
+    close_(false),
+    keep_alive_(false),
+    chunked_(false),
+    has_transfer_encoding_(false),
+    content_length_(-1)
+{
+
+}
+
+void http_response::reset()
+{
+  state_ = kStatusLine;
+  parsed_ = 0;
+  line_begin_ = 0;
+  header_length_ = 0;
+  status_ = 0;
+  http10_ = false;
+  close_ = false;
+  keep_alive_ = false;
+  chunked_ = false;
+  has_transfer_encoding_ = false;
+  content_length_ = -1;
+}
+
+bool http_response::keep_alive() const
+{
+  if(close_)
+    return false;
+  return !http10_ || keep_alive_;
+}
+
+http_response::parse_result http_response::parse(const char *data, size_t len)
+{
+  while(state_ != kDone)
+  {
+    if(parsed_ > http_request::kMaxHeaderSize)
+    {
+      LOG_ERROR << "http response header is longer than " << http_request::kMaxHeaderSize;
+      return http_request::kError;
+    }
+    if(parsed_ >= len)
+      return http_request::kIncomplete;
+    const char* lf = scan::find_char(data + parsed_, data + len, '\n');
+    if(lf == data + len)
+    {
+      parsed_ = len;
+      continue;
+    }
+    const char* begin = data + line_begin_;
+    const char* end = lf;
+    if(end > begin && *(end - 1) == '\r')
+      --end;
+    parsed_ = line_begin_ = static_cast<size_t>(lf - data) + 1;
+    if(state_ == kStatusLine)
+    {
+      if(!init_status(begin, end))
+        return http_request::kError;
+      state_ = kHeaders;
+    }
+    else if(begin == end)
+    {
+      state_ = kDone;
+      header_length_ = parsed_;
+    }
+    else if(!add_header(begin, end))
+    {
+      return http_request::kError;
+    }
+  }
+  // Transfer-Encoding overrides Content-Length, without chunked the body ends with the connection
+  if(has_transfer_encoding_)
+    content_length_ = -1;
+  return http_request::kComplete;
+}
+
+bool http_response::init_status(const char *begin, const char *end)
+{
+  // HTTP/1.x SP 3DIGIT SP reason
+  static const char prefix[] = "HTTP/1.";
+  const size_t prefix_length = sizeof(prefix) - 1;
+  if(end - begin < static_cast<ptrdiff_t>(prefix_length + 5) || memcmp(begin, prefix, prefix_length) != 0)
+    return false;
+  const char* p = begin + prefix_length;
+  if(*p != '0' && *p != '1')
+    return false;
+  http10_ = (*p == '0');
+  if(p[1] != ' ')
+    return false;
+  status_ = 0;
+  for(p += 2; p != end && *p >= '0' && *p <= '9'; ++p)
+    status_ = status_ * 10 + (*p - '0');
+  return status_ >= 100 && status_ <= 999 && (p == end || *p == ' ');
+}
+
+bool http_response::add_header(const char *begin, const char *end)
+{
+  const char* colon = scan::find_char(begin, end, ':');
+  if(colon == end || colon == begin)
+    return false;
+  const char* value = colon + 1;
+  while(value != end && (*value == ' ' || *value == '\t'))
+    ++value;
+  if(impl::equals_lower(begin, colon, "content-length"))
+  {
+    int64_t length = impl::parse_content_length(value, end);
+    // different Content-Length values make the framing ambiguous
+    if(length < 0 || (content_length_ >= 0 && content_length_ != length))
+      return false;
+    content_length_ = length;
+  }
+  else if(impl::equals_lower(begin, colon, "transfer-encoding"))
+  {
+    has_transfer_encoding_ = true;
+    // chunked must be the last coding, so only the last Transfer-Encoding header counts
+    chunked_ = impl::last_token_is(value, end, "chunked");
+  }
+  else if(impl::equals_lower(begin, colon, "connection"))
+  {
+    close_ = close_ || impl::has_token(value, end, "close");
+    keep_alive_ = keep_alive_ || impl::has_token(value, end, "keep-alive");
+  }
+  return true;
+}
@@ -2,29 +2,103 @@
 
 #include <boost/noncopyable.hpp>
 #include <string>
-#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+struct iovec;
 
 namespace zy
 {
+// 只负责找到请求体的边界(Content-Length 或 chunked), 数据原样转发, 不做解码和拷贝
+class http_body
+{
+ public:
+  enum result
+  {
+    kNeedMore, // all bytes given belong to the body, and it is not finished yet
+    kDone,     // body finished, see consumed
+    kError     // bad chunked encoding
+  };
+
+  http_body();
+
+  void start_length(size_t length);
+
+  void start_chunked();
+
+  // consumed is the number of bytes at the beginning of data which belong to the body
+  result consume(const char* data, size_t len, size_t* consumed);
+
+  bool done() const { return state_ == kFinished; }
+
+ private:
+  enum state
+  {
+    kLength,       // plain body, remaining_ bytes left
+    kChunkSize,    // hex size of a chunk
+    kChunkExt,     // chunk extension, ignored until LF
+    kChunkSizeLF,  // CR seen after the size
+    kChunkData,    // remaining_ bytes of chunk data left
+    kChunkDataCR,  // CRLF after chunk data
+    kChunkDataLF,
+    kTrailerStart, // beginning of a trailer line or the final empty line
+    kTrailerLine,
+    kTrailerLF,    // CR of the final empty line seen
+    kFinished
+  };
+
+  // max length of a chunk size line or a trailer line
+  const static size_t kMaxLineLength = 4096;
+
+  state state_;
+  uint64_t remaining_;
+  size_t line_length_;
+  bool has_digit_;
+};
+
 // only for http_request, I ignore compatible with http response
 class http_request : boost::noncopyable
 {
 public:
 
+  enum parse_result
+  {
+    kIncomplete, // need more data
+    kComplete,   // got the whole header, see header_length()
+    kError       // bad request line or header
+  };
+
+  // max length of request line and headers
+  const static size_t kMaxHeaderSize = 64 * 1024;
+
   http_request();
 
-  // if not exist, return empty string
-  std::string get_header(const std::string& key) const;
+  // 增量解析http头, data必须从同一位置开始(例如Buffer::peek()), 且在kComplete前不能被retrieve
+  // 已经检查过的字节不会被再次扫描
+  parse_result parse(const char* data, size_t len);
+
+  // bytes of request line and headers including the empty line, valid after kComplete
+  size_t header_length() const { return header_length_; }
 
-  bool init_request(const std::string& line);
+  // prepare for the next request on the same connection
+  void reset();
 
-  bool add_header(const std::string& line);
+  // -1 if there is no Content-Length
+  int64_t content_length() const { return content_length_; }
+
+  bool has_transfer_encoding() const { return has_transfer_encoding_; }
+
+  // Transfer-Encoding with chunked as the last coding
+  bool chunked() const { return chunked_; }
 
   bool initialized() { return !method_.empty(); }
 
-  void set_content(const std::string& content) { content_ = content; }
+  // 改写后的请求: 只有请求行和Proxy-Connection被替换, 其余部分直接指向parse()的输入数据
+  // data must be the data passed to parse(), followed by content_length bytes of body
+  void proxy_request(const char* data, size_t content_length, std::vector<struct iovec>* iov) const;
 
-  std::string proxy_request() const;
+  // bytes of the rewritten request line and headers
+  size_t proxy_request_size() const;
 
   std::string method() const { return method_; }
 
@@ -35,14 +109,97 @@ public:
   bool valid() const { return !domain_name_.empty() && !method().empty(); }
 
 private:
+  struct slice
+  {
+    const char* fragment; // owned by http_request, nullptr for a range of the input data
+    size_t offset;        // offset in the input data
+    size_t length;
+  };
+
+  // line without the trailing CRLF
+  bool init_request(const char* begin, const char* end);
+
+  // [raw_begin, raw_end) is the whole line including its line ending, offsets in the input data
+  bool add_header(const char* begin, const char* end, size_t raw_begin, size_t raw_end);
+
+  // adjacent input ranges are merged into one slice
+  void add_slice(size_t offset, size_t length);
+
+  void add_fragment(const char* fragment, size_t length);
+
+  enum parse_state
+  {
+    kRequestLine,
+    kHeaders,
+    kDone
+  };
+
+  parse_state state_;
+  size_t parsed_;        // bytes already scanned
+  size_t line_begin_;    // offset of the current line
+  size_t header_length_;
   std::string method_;
   std::string domain_name_;
   uint16_t port_;
   std::string url_;
   std::string version_;
-  std::unordered_map<std::string, std::string> headers_;
-  std::string proxy_request_;
-  std::string content_;
+  // 只记录确定请求体边界的header, 其余header原样留在输入数据里转发
+  int64_t content_length_;
+  bool has_transfer_encoding_;
+  bool chunked_;
+  std::string request_line_;   // rewritten request line
+  std::vector<slice> slices_;  // keeps its capacity across reset()
+};
+
+// 远程服务器的响应头, 只解析确定响应边界和连接能否复用所需的字段, 不保存任何header
+class http_response : boost::noncopyable
+{
+ public:
+  typedef http_request::parse_result parse_result;
+
+  http_response();
+
+  // same contract as http_request::parse
+  parse_result parse(const char* data, size_t len);
+
+  size_t header_length() const { return header_length_; }
+
+  void reset();
+
+  int status() const { return status_; }
+
+  // HTTP/1.1 without "Connection: close", or HTTP/1.0 with "Connection: keep-alive"
+  bool keep_alive() const;
+
+  // Transfer-Encoding with chunked as the last coding
+  bool chunked() const { return chunked_; }
+
+  // -1 if there is no Content-Length
+  int64_t content_length() const { return content_length_; }
+
+ private:
+  bool init_status(const char* begin, const char* end);
+
+  bool add_header(const char* begin, const char* end);
+
+  enum parse_state
+  {
+    kStatusLine,
+    kHeaders,
+    kDone
+  };
+
+  parse_state state_;
+  size_t parsed_;
+  size_t line_begin_;
+  size_t header_length_;
+  int status_;
+  bool http10_;
+  bool close_;        // Connection: close
+  bool keep_alive_;   // Connection: keep-alive
+  bool chunked_;
+  bool has_transfer_encoding_;
+  int64_t content_length_;
 };
 
 }
\ No newline at end of file
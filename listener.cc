@@ -0,0 +1,131 @@
+#include "listener.h"
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/SocketsOps.h>
+#include <muduo/base/Logging.h>
+#include <boost/bind.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+using namespace zy;
+
+namespace impl
+{
+
+// accept at most this many connections per readable event, the other loops get their share
+const int kMaxAcceptPerEvent = 64;
+
+int create_listen_socket(const muduo::net::InetAddress& addr, bool reuseport)
+{
+  int fd = muduo::net::sockets::createNonblockingOrDie(addr.family());
+  int on = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, static_cast<socklen_t>(sizeof on));
+  if(reuseport && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, static_cast<socklen_t>(sizeof on)) < 0)
+    LOG_SYSFATAL << "SO_REUSEPORT failed";
+  muduo::net::sockets::bindOrDie(fd, addr.getSockAddr());
+  return fd;
+}
+
+}
+
+listener::listener(muduo::net::EventLoop *loop, const muduo::net::InetAddress &addr, bool reuseport)
+  : loop_(loop),
+    fd_(impl::create_listen_socket(addr, reuseport)),
+    channel_(new muduo::net::Channel(loop, fd_)),
+    newConnectionCallback_(),
+    idle_fd_(::open("/dev/null", O_RDONLY | O_CLOEXEC))
+{
+  channel_->setReadCallback(boost::bind(&listener::handleRead, this));
+}
+
+listener::~listener()
+{
+  channel_->disableAll();
+  channel_->remove();
+  ::close(fd_);
+  if(idle_fd_ >= 0)
+    ::close(idle_fd_);
+}
+
+bool listener::set_incoming_cpu(int cpu)
+{
+  if(::setsockopt(fd_, SOL_SOCKET, SO_INCOMING_CPU, &cpu, static_cast<socklen_t>(sizeof cpu)) < 0)
+  {
+    LOG_SYSERR << "SO_INCOMING_CPU " << cpu;
+    return false;
+  }
+  return true;
+}
+
+bool listener::attach_cpu_steering(int group_size)
+{
+  // A = cpu; A = A % group_size; return A
+  struct sock_filter code[] = {
+    {BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)},
+    {BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(group_size)},
+    {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog;
+  prog.len = static_cast<unsigned short>(sizeof(code) / sizeof(code[0]));
+  prog.filter = code;
+  if(::setsockopt(fd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, static_cast<socklen_t>(sizeof prog)) < 0)
+  {
+    LOG_SYSERR << "SO_ATTACH_REUSEPORT_CBPF";
+    return false;
+  }
+  return true;
+}
+
+void listener::listen()
+{
+  loop_->assertInLoopThread();
+  muduo::net::sockets::listenOrDie(fd_);
+  channel_->enableReading();
+}
+
+void listener::handleRead()
+{
+  loop_->assertInLoopThread();
+  for(int i = 0; i < impl::kMaxAcceptPerEvent; ++i)
+  {
+    struct sockaddr_in6 addr;
+    socklen_t len = static_cast<socklen_t>(sizeof addr);
+    int connfd = ::accept4(fd_, reinterpret_cast<struct sockaddr*>(&addr), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(connfd >= 0)
+    {
+      muduo::net::InetAddress peerAddr(addr);
+      if(newConnectionCallback_)
+        newConnectionCallback_(connfd, peerAddr);
+      else
+        muduo::net::sockets::close(connfd);
+      continue;
+    }
+    int savedErrno = errno;
+    if(savedErrno == EAGAIN || savedErrno == EWOULDBLOCK)
+      break;
+    if(savedErrno == EINTR || savedErrno == ECONNABORTED || savedErrno == EPROTO)
+      continue;
+    LOG_SYSERR << "in listener::handleRead";
+    if((savedErrno == EMFILE || savedErrno == ENFILE) && idle_fd_ >= 0)
+    {
+      // 和Acceptor一样, 腾出一个fd接受并立即关闭连接, 否则电平触发会一直返回可读
+      ::close(idle_fd_);
+      idle_fd_ = ::accept(fd_, nullptr, nullptr);
+      ::close(idle_fd_);
+      idle_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    break;
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <muduo/net/InetAddress.h>
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <memory>
+
+namespace muduo
+{
+namespace net
+{
+class Channel;
+class EventLoop;
+}
+}
+
+namespace zy
+{
+// 和muduo::net::Acceptor相同, 但可以拿到监听socket, 用于SO_REUSEPORT分组和连接的CPU亲和
+class listener : boost::noncopyable
+{
+ public:
+  typedef boost::function<void(int sockfd, const muduo::net::InetAddress&)> NewConnectionCallback;
+
+  // the socket is bound here, it joins the SO_REUSEPORT group only after listen()
+  listener(muduo::net::EventLoop* loop, const muduo::net::InetAddress& addr, bool reuseport);
+
+  ~listener();
+
+  void setNewConnectionCallback(const NewConnectionCallback& cb) { newConnectionCallback_ = cb; }
+
+  int fd() const { return fd_; }
+
+  // only steers new connections of a SO_REUSEPORT group to the listener with the same cpu
+  bool set_incoming_cpu(int cpu);
+
+  // 给整个SO_REUSEPORT分组挂一个classic BPF程序: 按处理数据包的cpu选择第 cpu % group_size 个socket
+  // sockets are numbered in the order they called listen()
+  bool attach_cpu_steering(int group_size);
+
+  // in the loop thread
+  void listen();
+
+ private:
+  void handleRead();
+
+  muduo::net::EventLoop* loop_;
+  int fd_;
+  std::unique_ptr<muduo::net::Channel> channel_;
+  NewConnectionCallback newConnectionCallback_;
+  int idle_fd_;  // given up to accept and close connections when fds run out, like Acceptor
+};
+}
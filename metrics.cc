@@ -0,0 +1,172 @@
+#include "metrics.h"
+
+#include <muduo/base/Mutex.h>
+#include <stdio.h>
+#include <vector>
+
+using namespace zy;
+
+namespace impl
+{
+
+struct description
+{
+  const char* name;
+  const char* labels;  // without braces, empty if none
+  const char* help;    // once per name, the first entry of the name has it
+};
+
+// one entry per metrics::counter, in its order; entries of one name are next to each other
+const description kCounterNames[] = {
+  {"zy_connections_accepted_total", "", "client connections accepted"},
+  {"zy_bytes_total", "direction=\"client_to_upstream\"", "bytes forwarded"},
+  {"zy_bytes_total", "direction=\"upstream_to_client\"", nullptr},
+  {"zy_high_water_stalls_total", "side=\"client\"", "reading stopped because the other side didn't take the data"},
+  {"zy_high_water_stalls_total", "side=\"upstream\"", nullptr},
+  {"zy_http_responses_total", "", "http responses forwarded to clients"},
+  {"zy_error_responses_total", "code=\"400\"", "error responses made by the proxy"},
+  {"zy_error_responses_total", "code=\"502\"", nullptr},
+  {"zy_error_responses_total", "code=\"504\"", nullptr},
+  {"zy_upstream_pool_total", "result=\"hit\"", "http tunnels by whether an idle upstream connection was reused"},
+  {"zy_upstream_pool_total", "result=\"miss\"", nullptr},
+  {"zy_dns_lookups_total", "result=\"hit\"", "zy_dns lookups by how they were answered"},
+  {"zy_dns_lookups_total", "result=\"negative_hit\"", nullptr},
+  {"zy_dns_lookups_total", "result=\"miss\"", nullptr},
+  {"zy_dns_lookups_total", "result=\"local\"", nullptr},
+  {"zy_dns_refreshes_total", "", "hot dns cache entries asked again before they expire"},
+  {"zy_dns_cache_evictions_total", "", "live dns cache entries evicted by CLOCK when the cache is full"},
+  {"zy_dns_cache_expirations_total", "", "expired dns cache entries dropped to make room"},
+  {"zy_dns_timeouts_total", "", "dns queries no server answered in time"},
+  {"zy_dns_failures_total", "", "lookups of clients that gave no usable address"},
+};
+
+const description kGaugeNames[] = {
+  {"zy_connections", "state=\"start\"", "client connections by state"},
+  {"zy_connections", "state=\"got_request\"", nullptr},
+  {"zy_connections", "state=\"resolved\"", nullptr},
+  {"zy_connections", "state=\"http\"", nullptr},
+  {"zy_connections", "state=\"https\"", nullptr},
+  {"zy_tunnels", "", "tunnels to servers, idle pooled connections are not counted"},
+};
+
+const description kHistogramNames[] = {
+  {"zy_response_seconds", "", "request written to the server until its response was delivered to the client"},
+  {"zy_phase_seconds", "phase=\"header\"", "time spent in each phase before the server answers: header read, dns, connect, first byte"},
+  {"zy_phase_seconds", "phase=\"resolve\"", nullptr},
+  {"zy_phase_seconds", "phase=\"connect\"", nullptr},
+  {"zy_phase_seconds", "phase=\"first_byte\"", nullptr},
+};
+
+static_assert(sizeof kCounterNames / sizeof kCounterNames[0] == metrics::kCounters, "a name for every counter");
+static_assert(sizeof kGaugeNames / sizeof kGaugeNames[0] == metrics::kGauges, "a name for every gauge");
+static_assert(sizeof kHistogramNames / sizeof kHistogramNames[0] == metrics::kHistograms, "a name for every histogram");
+
+// 导出的直方图桶是2的幂微秒, 正好是HDR桶的边界: 64us到约67s
+const int kFirstExportedExponent = 6;
+const int kLastExportedExponent = 26;
+
+muduo::MutexLock g_mutex;
+std::vector<metrics::thread_values*> g_threads;
+
+// family header before the first sample of a name
+void header(const description& d, const char* type, std::string* out)
+{
+  if(!d.help)
+    return;
+  out->append("# HELP ").append(d.name).append(" ").append(d.help).append("\n");
+  out->append("# TYPE ").append(d.name).append(" ").append(type).append("\n");
+}
+
+void sample(const char* name, const char* suffix, const char* labels, const char* extra, const char* value, std::string* out)
+{
+  out->append(name).append(suffix);
+  if(*labels || *extra)
+  {
+    out->append("{").append(labels);
+    if(*labels && *extra)
+      out->append(",");
+    out->append(extra).append("}");
+  }
+  out->append(" ").append(value).append("\n");
+}
+
+}
+
+__thread metrics::thread_values* metrics::t_values = nullptr;
+
+metrics::thread_values* metrics::register_thread()
+{
+  // value initialized, every atomic starts at 0
+  thread_values* values = new thread_values();
+  muduo::MutexLockGuard lock(impl::g_mutex);
+  impl::g_threads.push_back(values);
+  t_values = values;
+  return values;
+}
+
+std::string metrics::render()
+{
+  int64_t counters[kCounters] = {0};
+  int64_t gauges[kGauges] = {0};
+  std::vector<uint64_t> buckets(kHistograms * kBuckets);
+  uint64_t sums[kHistograms] = {0};
+  {
+    muduo::MutexLockGuard lock(impl::g_mutex);
+    for(const thread_values* values : impl::g_threads)
+    {
+      for(int i = 0; i < kCounters; ++i)
+        counters[i] += values->counters[i].load(std::memory_order_relaxed);
+      for(int i = 0; i < kGauges; ++i)
+        gauges[i] += values->gauges[i].load(std::memory_order_relaxed);
+      for(int h = 0; h < kHistograms; ++h)
+      {
+        for(int b = 0; b < kBuckets; ++b)
+          buckets[h * kBuckets + b] += values->buckets[h][b].load(std::memory_order_relaxed);
+        sums[h] += values->sums[h].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  std::string out;
+  char value[64];
+  for(int i = 0; i < kCounters; ++i)
+  {
+    const impl::description& d = impl::kCounterNames[i];
+    impl::header(d, "counter", &out);
+    snprintf(value, sizeof value, "%lld", static_cast<long long>(counters[i]));
+    impl::sample(d.name, "", d.labels, "", value, &out);
+  }
+  for(int i = 0; i < kGauges; ++i)
+  {
+    const impl::description& d = impl::kGaugeNames[i];
+    impl::header(d, "gauge", &out);
+    snprintf(value, sizeof value, "%lld", static_cast<long long>(gauges[i]));
+    impl::sample(d.name, "", d.labels, "", value, &out);
+  }
+  for(int h = 0; h < kHistograms; ++h)
+  {
+    const impl::description& d = impl::kHistogramNames[h];
+    impl::header(d, "histogram", &out);
+    // 桶按下标递增, 2^e微秒是第 kLinearBuckets + (e - 4) * kSubBuckets 个桶的下界
+    uint64_t cumulative = 0;
+    int b = 0;
+    char le[64];
+    for(int e = impl::kFirstExportedExponent; e <= impl::kLastExportedExponent; ++e)
+    {
+      for(int end = kLinearBuckets + (e - 4) * kSubBuckets; b < end; ++b)
+        cumulative += buckets[h * kBuckets + b];
+      snprintf(le, sizeof le, "le=\"%.6f\"", static_cast<double>(1ULL << e) / 1e6);
+      snprintf(value, sizeof value, "%llu", static_cast<unsigned long long>(cumulative));
+      impl::sample(d.name, "_bucket", d.labels, le, value, &out);
+    }
+    for(; b < kBuckets; ++b)
+      cumulative += buckets[h * kBuckets + b];
+    snprintf(value, sizeof value, "%llu", static_cast<unsigned long long>(cumulative));
+    impl::sample(d.name, "_bucket", d.labels, "le=\"+Inf\"", value, &out);
+    snprintf(value, sizeof value, "%.6f", static_cast<double>(sums[h]) / 1e6);
+    impl::sample(d.name, "_sum", d.labels, "", value, &out);
+    snprintf(value, sizeof value, "%llu", static_cast<unsigned long long>(cumulative));
+    impl::sample(d.name, "_count", d.labels, "", value, &out);
+  }
+  return out;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+
+namespace zy
+{
+// 进程内的计数器, 仪表和直方图. 每个线程只写自己的一份, 热路径上是一次普通的加法, 不加锁也没有原子的读改写;
+// 抓取时把所有线程的值加起来, 按Prometheus的文本格式输出
+namespace metrics
+{
+
+enum counter
+{
+  kConnectionsAccepted,
+  kBytesClientToUpstream,
+  kBytesUpstreamToClient,
+  kStallsClient,          // the client doesn't take the response fast enough, reading the server stopped
+  kStallsUpstream,        // the server doesn't take the request fast enough, reading the client stopped
+  kHttpResponses,
+  kResponses400,
+  kResponses502,
+  kResponses504,
+  kUpstreamPoolHits,      // new http tunnels that reused an idle pooled connection, one per lookup
+  kUpstreamPoolMisses,    // new http tunnels that had to connect
+  kDnsCacheHits,
+  kDnsCacheNegativeHits,
+  kDnsCacheMisses,
+  kDnsLocal,              // ip addresses and names of the hosts file
+  kDnsRefreshes,
+  kDnsCacheEvictions,     // live entries pushed out by CLOCK to make room
+  kDnsCacheExpirations,   // entries dropped because their ttl passed
+  kDnsTimeouts,
+  kDnsFailures,           // lookups that gave no usable address
+  kCounters
+};
+
+// summed over threads, so an increment and its decrement may run in different threads
+enum gauge
+{
+  kConnectionsStart,      // one per proxy_server::conState, in its order
+  kConnectionsGotRequest,
+  kConnectionsResolved,
+  kConnectionsHttp,
+  kConnectionsHttps,
+  kTunnelsActive,
+  kGauges
+};
+
+enum histogram
+{
+  kResponseSeconds,       // request written to the server until the last byte of its response went to the client
+  kHeaderSeconds,         // accepted until the first request header is complete
+  kResolveSeconds,        // header complete until the addresses of the host are known
+  kConnectSeconds,        // resolved until connected to the server, idle pooled connections are not counted
+  kFirstByteSeconds,      // http request written to the server until the first byte of its response
+  kHistograms
+};
+
+// HDR风格的桶: 16微秒以下每微秒一个桶, 之后每个2的幂区间分成8个桶, 相对误差不超过1/8
+const int kSubBuckets = 8;
+const int kLinearBuckets = 16;
+const int kMaxExponent = 36;  // about 19 hours, longer values share the last bucket
+const int kBuckets = kLinearBuckets + (kMaxExponent - 4 + 1) * kSubBuckets;
+
+// 一个线程的所有值, 只有这个线程写
+struct thread_values
+{
+  char front_padding[64];
+  std::atomic<int64_t> counters[kCounters];
+  std::atomic<int64_t> gauges[kGauges];
+  std::atomic<uint64_t> buckets[kHistograms][kBuckets];
+  std::atomic<uint64_t> sums[kHistograms];  // microseconds
+  char back_padding[64];
+};
+
+extern __thread thread_values* t_values;
+
+// allocate and register the values of the calling thread, they live as long as the process
+thread_values* register_thread();
+
+inline thread_values& local()
+{
+  thread_values* values = t_values;
+  return values ? *values : *register_thread();
+}
+
+// the only writer, a relaxed load and store is enough
+template<typename T>
+inline void bump(std::atomic<T>& value, T n)
+{
+  value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void add(counter which, int64_t n = 1)
+{
+  bump(local().counters[which], n);
+}
+
+inline void add(gauge which, int64_t n)
+{
+  bump(local().gauges[which], n);
+}
+
+inline int bucket_of(uint64_t microseconds)
+{
+  if(microseconds < static_cast<uint64_t>(kLinearBuckets))
+    return static_cast<int>(microseconds);
+  int exponent = 63 - __builtin_clzll(microseconds);
+  if(exponent > kMaxExponent)
+    return kBuckets - 1;
+  int sub = static_cast<int>(microseconds >> (exponent - 3)) & (kSubBuckets - 1);
+  return kLinearBuckets + (exponent - 4) * kSubBuckets + sub;
+}
+
+inline void observe(histogram which, int64_t microseconds)
+{
+  uint64_t value = microseconds > 0 ? static_cast<uint64_t>(microseconds) : 0;
+  thread_values& values = local();
+  bump(values.buckets[which][bucket_of(value)], static_cast<uint64_t>(1));
+  bump(values.sums[which], value);
+}
+
+// monotonic clock in microseconds, the phases of a request are measured with it
+inline int64_t now()
+{
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// every metric in the Prometheus text format 0.0.4
+std::string render();
+
+}
+}
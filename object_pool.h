@@ -0,0 +1,82 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <assert.h>
+
+namespace zy
+{
+// slab allocator with free list, not thread safe, every io loop owns its own pool
+template <typename T>
+class object_pool : boost::noncopyable
+{
+ public:
+  explicit object_pool(size_t slab_size = 64)
+    : slab_size_(slab_size),
+      slabs_(),
+      free_list_(nullptr),
+      in_use_(0)
+  {
+    assert(slab_size_ > 0);
+  }
+
+  ~object_pool()
+  {
+    // all objects should be released before the pool
+    assert(in_use_ == 0);
+  }
+
+  template <typename... Args>
+  T* get(Args&&... args)
+  {
+    if(free_list_ == nullptr)
+      grow();
+    node* n = free_list_;
+    free_list_ = n->next;
+    T* obj = new (n->storage) T(std::forward<Args>(args)...);
+    ++ in_use_;
+    return obj;
+  }
+
+  void release(T* obj)
+  {
+    assert(obj != nullptr);
+    assert(in_use_ > 0);
+    obj->~T();
+    node* n = reinterpret_cast<node*>(obj);
+    n->next = free_list_;
+    free_list_ = n;
+    -- in_use_;
+  }
+
+  size_t in_use() const { return in_use_; }
+
+  size_t capacity() const { return slabs_.size() * slab_size_; }
+
+ private:
+  union node
+  {
+    node* next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  void grow()
+  {
+    std::unique_ptr<node[]> slab(new node[slab_size_]);
+    for(size_t i = 0; i < slab_size_; ++i)
+    {
+      slab[i].next = free_list_;
+      free_list_ = &slab[i];
+    }
+    slabs_.push_back(std::move(slab));
+  }
+
+  size_t slab_size_;
+  std::vector<std::unique_ptr<node[]> > slabs_;
+  node* free_list_;
+  size_t in_use_;
+};
+}
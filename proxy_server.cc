@@ -1,259 +1,530 @@
 #include "proxy_server.h"
-#include "http_header.h"
+#include "metrics.h"
 
 #include <muduo/base/Logging.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/SocketsOps.h>
+#include <muduo/base/CountDownLatch.h>
 #include <boost/bind.hpp>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 using namespace zy;
 
 namespace impl
 {
 
-// find end of header
-const char* findEOH(const muduo::net::Buffer* buf)
+// the resolvers know nothing about ports
+muduo::net::InetAddress with_port(const muduo::net::InetAddress& addr, uint16_t port)
 {
-  static std::string eoh("\r\n\r\n");
-  const char* crlf = std::search(buf->peek(), buf->beginWrite(), eoh.begin(), eoh.end());
-  return crlf == buf->beginWrite() ? nullptr : crlf;
+  if(addr.family() == AF_INET6)
+  {
+    struct sockaddr_in6 addr6 = *reinterpret_cast<const struct sockaddr_in6*>(addr.getSockAddr());
+    addr6.sin6_port = muduo::net::sockets::hostToNetwork16(port);
+    return muduo::net::InetAddress(addr6);
+  }
+  struct sockaddr_in addr4 = *reinterpret_cast<const struct sockaddr_in*>(addr.getSockAddr());
+  addr4.sin_port = muduo::net::sockets::hostToNetwork16(port);
+  return muduo::net::InetAddress(addr4);
+}
+
+#ifndef ZY_DNS
+// cdns::Resolver only returns the first ipv4 address
+void single_address(const boost::function<void(const std::vector<muduo::net::InetAddress>&)>& cb,
+                    const muduo::net::InetAddress& addr)
+{
+  cb(std::vector<muduo::net::InetAddress>(1, addr));
+}
+#endif
+
+// runs in the loop of l, the next listener joins the group after this one
+void listen_in_order(zy::listener* l, muduo::CountDownLatch* latch)
+{
+  l->listen();
+  latch->countDown();
+}
+
+void pin_to_cpu(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+  if(ret != 0)
+    LOG_ERROR << "pin io thread to cpu " << cpu << " failed: " << ret;
+}
+
+// "12.345ms", the phase from begin to end
+std::string phase(int64_t end, int64_t begin)
+{
+  char buf[32];
+  snprintf(buf, sizeof buf, "%.3fms", static_cast<double>(end - begin) / 1000);
+  return buf;
+}
+
+// the connection gauges are in conState order
+static_assert(metrics::kConnectionsHttps - metrics::kConnectionsStart == proxy_server::kTransport_https,
+              "a gauge for every connection state");
+
+metrics::gauge state_gauge(proxy_server::conState state)
+{
+  return static_cast<metrics::gauge>(metrics::kConnectionsStart + state);
+}
+}
+
+__thread proxy_server::loop_context* proxy_server::t_context_ = nullptr;
+
+proxy_server::loop_context::loop_context(muduo::net::EventLoop *loop, size_t max_idle, double idle_timeout)
+  : loop(loop),
+#ifdef ZY_DNS
+    resolver(loop),
+#else
+    resolver(loop, cdns::Resolver::kDNSonly),
+#endif
+    con_pool(),
+    upstream(loop, max_idle, idle_timeout),
+    iov(),
+    responses(0),
+    response_bytes(0),
+    trace_second(0),
+    traces(0)
+{
+
+}
+
+proxy_server::proxy_server(muduo::net::EventLoop *loop, const muduo::net::InetAddress &addr, int thread_num)
+  : loop_(loop),
+    addr_(addr),
+    name_("proxy_server-" + addr.toIpPort()),
+    listeners_(),
+    thread_pool_(new muduo::net::EventLoopThreadPool(loop_, "proxy_server")),
+    next_con_id_(1),
+    splice_(false),
+    trace_slow_(0),
+    reuseport_(false),
+    steering_(kSteerNone),
+    first_cpu_(0),
+    pool_max_idle_(8),
+    pool_idle_timeout_(15),
+    dns_negative_ttl_(5),
+    dns_cache_bytes_(8 * 1024 * 1024),
+    dns_edns_payload_(1232),
+    dns_servers_(),
+    dns_cache_file_(),
+    dns_cache_save_interval_(0),
+#ifdef ZY_DNS
+    dns_cache_(),
+    dns_cache_saver_(),
+#endif
+    mutex_(),
+    contexts_()
+{
+  thread_pool_->setThreadNum(thread_num);
 }
 
-// on convert error, return -1
-int get_content_length(const std::string& value)
+void proxy_server::start()
 {
-  try {
-    return std::stoi(value);
-  }catch(...)
+  loop_->assertInLoopThread();
+#ifdef ZY_DNS
+  dns_cache_.reset(new dns_cache(dns_cache_bytes_));
+  // 上次保存的快照里还没过期的条目, 重启后不用全部重新查询
+  if(!dns_cache_file_.empty())
+  {
+    dns_cache_->load(dns_cache_file_, muduo::Timestamp::now());
+    if(dns_cache_save_interval_ > 0)
+    {
+      dns_cache_saver_.reset(new muduo::net::EventLoopThread(muduo::net::EventLoopThread::ThreadInitCallback(),
+                                                             "dns_cache_saver"));
+      dns_cache_saver_->startLoop()->runEvery(dns_cache_save_interval_, boost::bind(&proxy_server::save_dns_cache, this));
+    }
+  }
+#endif
+  thread_pool_->start(boost::bind(&proxy_server::onThreadInit, this, _1));
+  if(reuseport_)
   {
-    return -1;
+    start_reuseport();
+    return;
   }
+  std::unique_ptr<listener> l(new listener(loop_, addr_, false));
+  l->setNewConnectionCallback(boost::bind(&proxy_server::newConnection, this, _1, _2,
+                                          static_cast<muduo::net::EventLoop*>(nullptr)));
+  l->listen();
+  listeners_.push_back(std::move(l));
 }
+
+#ifdef ZY_DNS
+void proxy_server::save_dns_cache()
+{
+  dns_cache_->save(dns_cache_file_, muduo::Timestamp::now());
 }
+#endif
 
-proxy_server::proxy_server(muduo::net::EventLoop *loop, const muduo::net::InetAddress &addr)
-  : loop_(loop),
-    server_(loop_, addr, "proxy_server"),
+void proxy_server::start_reuseport()
+{
+  // with no io threads the base loop is the only one
+  std::vector<muduo::net::EventLoop*> loops = thread_pool_->getAllLoops();
+  for(size_t i = 0; i < loops.size(); ++i)
+  {
+    std::unique_ptr<listener> l(new listener(loops[i], addr_, true));
+    l->setNewConnectionCallback(boost::bind(&proxy_server::newConnection, this, _1, _2, loops[i]));
+    if(steering_ != kSteerNone)
+      l->set_incoming_cpu(cpu_of(i));
+    listeners_.push_back(std::move(l));
+  }
+  // 按loop的顺序加入SO_REUSEPORT分组, BPF程序返回的下标才能对应到第i个loop
+  for(size_t i = 0; i < loops.size(); ++i)
+  {
+    if(loops[i] == loop_)
+    {
+      listeners_[i]->listen();
+      continue;
+    }
+    muduo::CountDownLatch latch(1);
+    loops[i]->runInLoop(boost::bind(&impl::listen_in_order, listeners_[i].get(), &latch));
+    latch.wait();
+  }
+  if(steering_ == kSteerBpf)
+    listeners_.front()->attach_cpu_steering(static_cast<int>(listeners_.size()));
+  LOG_INFO << name_ << " " << listeners_.size() << " SO_REUSEPORT listeners";
+}
+
+int proxy_server::cpu_of(size_t index) const
+{
+  long cpus = ::sysconf(_SC_NPROCESSORS_ONLN);
+  if(cpus <= 0)
+    cpus = 1;
+  return static_cast<int>((static_cast<long>(first_cpu_) + static_cast<long>(index)) % cpus);
+}
+
+// the same as TcpServer::newConnection, in loop_ or, with SO_REUSEPORT, in the loop that accepted it
+void proxy_server::newConnection(int sockfd, const muduo::net::InetAddress &peerAddr, muduo::net::EventLoop* ioLoop)
+{
+  if(ioLoop == nullptr)
+  {
+    loop_->assertInLoopThread();
+    ioLoop = thread_pool_->getNextLoop();
+  }
+  char buf[32];
+  snprintf(buf, sizeof buf, "#%d", next_con_id_++);
+  muduo::net::InetAddress localAddr(muduo::net::sockets::getLocalAddr(sockfd));
+  muduo::net::TcpConnectionPtr con(new muduo::net::TcpConnection(ioLoop, name_ + buf, sockfd, localAddr, peerAddr));
+  con->setConnectionCallback(boost::bind(&proxy_server::onConnection, this, _1));
+  con->setMessageCallback(boost::bind(&proxy_server::onMessage, this, _1, _2, _3));
+  con->setCloseCallback(boost::bind(&proxy_server::removeConnection, _1));
+  ioLoop->runInLoop(boost::bind(&proxy_server::connectEstablished, this, con, sockfd));
+}
+
+void proxy_server::connectEstablished(const muduo::net::TcpConnectionPtr &con, int sockfd)
+{
+  con_context* ctx = context().con_pool.get(sockfd, con);
+  ctx->times.start = metrics::now();
+  con->setContext(ctx);
+  metrics::add(metrics::kConnectionsAccepted);
+  metrics::add(metrics::kConnectionsStart, 1);
+  con->connectEstablished();
+}
+
+void proxy_server::removeConnection(const muduo::net::TcpConnectionPtr &con)
+{
+  con->getLoop()->queueInLoop(boost::bind(&muduo::net::TcpConnection::connectDestroyed, con));
+}
+
+// if thread_num is 0, only called once with the base loop
+void proxy_server::onThreadInit(muduo::net::EventLoop *loop)
+{
+  assert(t_context_ == nullptr);
+  std::unique_ptr<loop_context> context(new loop_context(loop, pool_max_idle_, pool_idle_timeout_));
+  t_context_ = context.get();
 #ifdef ZY_DNS
-    resolver_(loop_),
-#else
-    resolver_(loop_, cdns::Resolver::kDNSonly),
+  context->resolver.set_negative_ttl(dns_negative_ttl_);
+  context->resolver.set_cache(dns_cache_);
+  context->resolver.set_edns_payload(dns_edns_payload_);
+  if(!dns_servers_.empty())
+    context->resolver.set_servers(dns_servers_);
 #endif
-    con_states_(),
-    tunnels_()
+  muduo::MutexLockGuard lock(mutex_);
+  // io threads are started one by one, so the index matches getAllLoops()
+  if(reuseport_ && steering_ != kSteerNone)
+    impl::pin_to_cpu(cpu_of(contexts_.size()));
+  contexts_.push_back(std::move(context));
+}
+
+proxy_server::loop_context& proxy_server::context()
 {
-  server_.setConnectionCallback(boost::bind(&proxy_server::onConnection, this, _1));
-  server_.setMessageCallback(boost::bind(&proxy_server::onMessage, this, _1, _2, _3));
+  assert(t_context_ != nullptr);
+  return *t_context_;
 }
 
 bool proxy_server::is_valid_addr(const muduo::net::InetAddress &addr) {
+  // dns sinkholes answer 0.0.0.0 or ::
+  if(addr.family() == AF_INET6)
+    return !IN6_IS_ADDR_UNSPECIFIED(&reinterpret_cast<const struct sockaddr_in6*>(addr.getSockAddr())->sin6_addr);
   return addr.ipNetEndian() != INADDR_ANY;
 }
 
 void proxy_server::onConnection(const muduo::net::TcpConnectionPtr &con)
 {
   LOG_DEBUG << "connection from " << con->peerAddress().toIpPort() << " is " << (con->connected() ? "up" : "down");
-  auto name = con->name();
   if(con->connected())
   {
-    con_states_[name] = kStart;
     con->setTcpNoDelay(true);
   }
   else
   {
-    clean_from_container(name);
+    clean_from_container(con);
   }
 }
 
-void proxy_server::clean_from_container(const muduo::string &con_name)
+void proxy_server::set_state(con_context *ctx, conState state)
 {
-  auto it = con_states_.find(con_name);
-  if(it != con_states_.end())
-    con_states_.erase(it);
-  auto iter = tunnels_.find(con_name);
-  if(iter != tunnels_.end())
-    tunnels_.erase(iter);
+  if(ctx->state == state)
+    return;
+  metrics::add(impl::state_gauge(ctx->state), -1);
+  metrics::add(impl::state_gauge(state), 1);
+  ctx->state = state;
 }
 
-void proxy_server::onMessage(const muduo::net::TcpConnectionPtr &con, muduo::net::Buffer *buf, muduo::Timestamp)
+proxy_server::con_context* proxy_server::get_context(const muduo::net::TcpConnectionPtr &con)
+{
+  con_context* const* ctx = boost::any_cast<con_context*>(&con->getContext());
+  return ctx ? *ctx : nullptr;
+}
+
+void proxy_server::release_route(con_context *ctx, const route &r)
 {
-  auto name = con->name();
-  if(!con_states_.count(name))
+  if(r.tunnel->reusable())
   {
-    LOG_FATAL << "can't find state of specified con_name " << name;
+    int sockfd = -1;
+    auto upstream = r.tunnel->detach(&sockfd);
+    context().upstream.release(upstream, sockfd);
   }
-  auto& state = con_states_[name];
-  // 此处需要解析http头或者connect 头
-  int retrieve_len = 0;
-  if(state == kStart)
+}
+
+TunnelPtr proxy_server::find_route(con_context *ctx, const std::string &host, uint16_t port)
+{
+  for(const auto& r : ctx->routes)
+  {
+    if(r.port == port && r.host == host && r.tunnel->available())
+      return r.tunnel;
+  }
+  return TunnelPtr();
+}
+
+void proxy_server::trim_routes(con_context *ctx)
+{
+  auto& routes = ctx->routes;
+  for(auto it = routes.begin(); it != routes.end() && routes.size() >= kMaxRoutes; )
   {
-    if(impl::findEOH(buf) != nullptr)
+    // tunnels owing responses or streaming a body must stay
+    if(it->tunnel->pending() == 0 && it->tunnel != ctx->tunnel)
     {
-      muduo::net::Buffer buffer(*buf);
-      const char * begin = buffer.peek();
-      const char * end = nullptr;
-      http_request request;
-      while((end = buffer.findCRLF()) != nullptr)
-      {
-        std::string line(begin, end);
-        if(!line.empty())
-        {
-          retrieve_len += static_cast<int>(line.size());
-          bool ret;
-          if(request.initialized())
-            ret = request.add_header(line);
-          else
-            ret = request.init_request(line);
-          if(!ret)
-          {
-            LOG_ERROR << "error http header " << name;
-            buf->retrieveAll();
-            onHeaderError(con);
-            return;
-          }
-        }
-        retrieve_len += 2;
-        buffer.retrieveUntil(end + 2);
-        begin = buffer.peek();
-      }
-      if(!request.valid())
-      {
-        LOG_ERROR << "invalid http request " << name;
-        buf->retrieveAll();
-        onHeaderError(con);
-        return;
-      }
-      std::string content_length = request.get_header("Content-Length");
-      int length = 0;
-      if(content_length.empty())
-        content_length = "0";
-      length = impl::get_content_length(content_length);
-      if(length == -1)
-      {
-        LOG_ERROR << "invalid Content-Length " << name;
-        buf->retrieveAll();
-        onHeaderError(con);
-        return;
-      }
-      if(static_cast<int>(buffer.readableBytes()) >= length)
-      {
-        // got all http request, stop read, forbid execute onMessage function again
-        con->stopRead();
-        request.set_content(std::string(buffer.peek(), buffer.peek() + length));
-        buf->retrieve(retrieve_len); 
-        buf->retrieve(length);
-        state = kGotRequest;
-        uint16_t port = request.port();
-        std::string domain_name = request.domain_name();
-        if(request.method() != "CONNECT")
-        {
-          std::string request_str = request.proxy_request();
-          resolver_.resolve(domain_name.c_str(),
-                            boost::bind(&proxy_server::onResolve, this, boost::weak_ptr<muduo::net::TcpConnection>(con), port, request_str, _1));
-        }
-        else
-        {
-          resolver_.resolve(domain_name.c_str(),
-                            boost::bind(&proxy_server::onResolve, this, boost::weak_ptr<muduo::net::TcpConnection>(con), port, _1));
-        }
-      }
-      else
-      {
-        LOG_INFO << "content data is not complete yet";
-        return;
-      }
+      release_route(ctx, *it);
+      it = routes.erase(it);
     }
     else
     {
-      LOG_INFO << name << " header not complete yet";
-      return;
+      ++it;
     }
   }
-    // 此处需要解析出http头
-  else if(state == kTransport_http)
+}
+
+void proxy_server::update_active(con_context *ctx)
+{
+  Tunnel* head = ctx->waiting.empty() ? nullptr : ctx->waiting.front().get();
+  for(const auto& r : ctx->routes)
+    r.tunnel->set_active(head == nullptr || head == r.tunnel.get());
+}
+
+// give con_context back to the pool, the tunnels are destroyed with it
+// 到远程服务器的连接如果还能复用, 先放回upstream_pool
+void proxy_server::clean_from_container(const muduo::net::TcpConnectionPtr &con)
+{
+  con_context* ctx = get_context(con);
+  if(ctx)
   {
-    while(impl::findEOH(buf) != nullptr)
+    for(const auto& r : ctx->routes)
     {
-      muduo::net::Buffer buffer(*buf);
-      const char* begin = buffer.peek();
-      const char* end = nullptr;
-      http_request request;
-      while((end = buffer.findCRLF()) != nullptr)
-      {
-        std::string line(begin, end);
-        if(!line.empty())
-        {
-          bool ret;
-          if(request.initialized())
-            ret = request.add_header(line);
-          else
-            ret = request.init_request(line);
-          if(!ret)
-          {
-            LOG_ERROR << "error http header " << name;
-            buf->retrieveAll();
-            onHeaderError(con);
-            return;
-          }
-        }
-        buffer.retrieveUntil(end + 2);
-        begin = buffer.peek();
-      }
-      if(!request.valid())
-      {
-        LOG_ERROR << "invalid http request " << name;
-        buf->retrieveAll();
-        onHeaderError(con);
-        return;
-      }
-      std::string content_length = request.get_header("Content-Length");
-      int length = 0;
-      if(content_length.empty())
-      {
-        content_length = "0";
-      }
-      length = impl::get_content_length(content_length);
-      if(length == -1)
-      {
-        LOG_ERROR << "invalid Content-Length " << name;
-        buf->retrieveAll();
-        onHeaderError(con);
+      // a half sent request body would leave the server waiting for the rest
+      if(!(ctx->in_body && r.tunnel == ctx->tunnel))
+        release_route(ctx, r);
+    }
+    con->setContext(boost::any());
+    metrics::add(impl::state_gauge(ctx->state), -1);
+    context().con_pool.release(ctx);
+  }
+}
+
+bool proxy_server::parse_request(const muduo::net::TcpConnectionPtr &con, con_context *ctx, muduo::net::Buffer *buf)
+{
+  auto& request = ctx->request;
+  auto result = request.parse(buf->peek(), buf->readableBytes());
+  if(result == http_request::kIncomplete)
+  {
+    LOG_INFO << con->name() << " header not complete yet";
+    return false;
+  }
+  if(result == http_request::kError)
+  {
+    LOG_ERROR << "error http header " << con->name();
+    buf->retrieveAll();
+    onHeaderError(con);
+    return false;
+  }
+  if(!request.valid())
+  {
+    LOG_ERROR << "invalid http request " << con->name();
+    buf->retrieveAll();
+    onHeaderError(con);
+    return false;
+  }
+  // 重复或非数字的Content-Length和重复的Transfer-Encoding在解析时已经返回kError
+  if(request.has_transfer_encoding())
+  {
+    // 同时带Content-Length的请求可能被用来做request smuggling, 直接拒绝
+    if(request.content_length() >= 0 || !request.chunked())
+    {
+      LOG_ERROR << "unsupported Transfer-Encoding " << con->name();
+      buf->retrieveAll();
+      onHeaderError(con);
+      return false;
+    }
+    ctx->body.start_chunked();
+    return true;
+  }
+  int64_t length = request.content_length();
+  ctx->body.start_length(length > 0 ? static_cast<size_t>(length) : 0);
+  return true;
+}
+
+bool proxy_server::forward_request(const muduo::net::TcpConnectionPtr &con, con_context *ctx, muduo::net::Buffer *buf)
+{
+  auto& request = ctx->request;
+  size_t header_length = request.header_length();
+  size_t body_length = 0;
+  // the part of the body already received goes out with the header in one writev
+  auto result = ctx->body.consume(buf->peek() + header_length, buf->readableBytes() - header_length, &body_length);
+  if(result == http_body::kError)
+  {
+    LOG_ERROR << "invalid chunked body " << con->name();
+    buf->retrieveAll();
+    onHeaderError(con);
+    return false;
+  }
+  auto& iov = context().iov;
+  request.proxy_request(buf->peek(), body_length, &iov);
+  ctx->waiting.push_back(ctx->tunnel);
+  if(ctx->waiting.size() == 1)
+    update_active(ctx);
+  ctx->tunnel->request_sent(request.method() == "HEAD");
+  ctx->tunnel->send(iov);
+  buf->retrieve(header_length + body_length);
+  request.reset();
+  ++ ctx->requests;
+  ctx->in_body = (result == http_body::kNeedMore);
+  return true;
+}
+
+bool proxy_server::forward_body(const muduo::net::TcpConnectionPtr &con, con_context *ctx, muduo::net::Buffer *buf)
+{
+  size_t length = 0;
+  auto result = ctx->body.consume(buf->peek(), buf->readableBytes(), &length);
+  if(result == http_body::kError)
+  {
+    // the header has gone to the server, nothing sensible can be sent to the client
+    LOG_ERROR << "invalid chunked body " << con->name();
+    buf->retrieveAll();
+    con->shutdown();
+    return false;
+  }
+  if(length > 0)
+  {
+    // the tunnel is gone if its server closed in the middle of the body
+    muduo::net::TcpConnectionPtr clientCon = ctx->tunnel ? ctx->tunnel->clientCon() : muduo::net::TcpConnectionPtr();
+    if(clientCon)
+    {
+      metrics::add(metrics::kBytesClientToUpstream, static_cast<int64_t>(length));
+      clientCon->send(buf->peek(), static_cast<int>(length));
+    }
+    buf->retrieve(length);
+  }
+  if(result == http_body::kNeedMore)
+    return false;
+  ctx->in_body = false;
+  return true;
+}
+
+void proxy_server::forward_requests(const muduo::net::TcpConnectionPtr &con, con_context *ctx, muduo::net::Buffer *buf)
+{
+  for(;;)
+  {
+    if(ctx->in_body)
+    {
+      if(!forward_body(con, ctx, buf))
         return;
-      }
-      if(static_cast<int>(buffer.readableBytes()) >= length)
-      {
-        request.set_content(std::string(buffer.peek(), buffer.peek() + length));
-        buffer.retrieve(length);
-        begin = buf->peek();
-        end = nullptr;
-        while((end = buf->findCRLF()) != nullptr)
-        {
-          buf->retrieveUntil(end + 2);
-          begin = buf->peek();
-        }
-        buf->retrieve(length);
-        std::string request_str = request.proxy_request();
-        auto clientCon = boost::any_cast<const muduo::net::TcpConnectionPtr&>(con->getContext());
-        clientCon->send(request_str.data(), request_str.size());
-      }
-      else
+      continue;
+    }
+    if(!parse_request(con, ctx, buf))
+      return;
+    // 每个请求按自己的Host选择tunnel
+    auto& request = ctx->request;
+    TunnelPtr tunnel;
+    if(request.method() != "CONNECT")
+      tunnel = find_route(ctx, request.domain_name(), request.port());
+    if(!tunnel)
+    {
+      // 新建的tunnel可能直接回复504或200, 要等前面的响应都发完才能建立, 以保证响应顺序
+      if(!ctx->waiting.empty())
       {
-        LOG_INFO << "content not complete!";
+        ctx->blocked = true;
+        con->stopRead();
         return;
       }
+      open_upstream(con, ctx, buf);
+      return;
     }
+    ctx->tunnel = tunnel;
+    if(!forward_request(con, ctx, buf))
+      return;
+  }
+}
+
+void proxy_server::onMessage(const muduo::net::TcpConnectionPtr &con, muduo::net::Buffer *buf, muduo::Timestamp)
+{
+  con_context* ctx = get_context(con);
+  if(!ctx)
+  {
+    LOG_FATAL << "can't find context of connection " << con->name();
+  }
+  ctx->bytes_in += buf->readableBytes();
+  auto& state = ctx->state;
+  // 此处需要解析http头或者connect 头
+  if(state == kStart)
+  {
+    if(!parse_request(con, ctx, buf))
+      return;
+    open_upstream(con, ctx, buf);
+  }
+    // 此处需要解析出http头
+  else if(state == kTransport_http)
+  {
+    forward_requests(con, ctx, buf);
   }// forward all data to proxy server directly
   else if(state == kTransport_https)
   {
-    auto clientCon = boost::any_cast<const muduo::net::TcpConnectionPtr&>(con->getContext());
-    clientCon->send(buf);
+    const auto& clientCon = ctx->tunnel->clientCon();
+    if(clientCon)
+    {
+      metrics::add(metrics::kBytesClientToUpstream, static_cast<int64_t>(buf->readableBytes()));
+      clientCon->send(buf);
+    }
     buf->retrieveAll();
   }
-  else if(state == kResolved)
+  else if(state == kGotRequest || state == kResolved)
   {
-    if(!con->getContext().empty())
-    {
-      LOG_INFO << " not empty";
-    }
-    LOG_INFO << "resolved state! ";
+    // 等待tunnel建立, 数据留在输入缓冲里由onTransport转发
+    LOG_INFO << "waiting for the tunnel, state " << state;
     return;
   }
   else
@@ -264,29 +535,105 @@ void proxy_server::onMessage(const muduo::net::TcpConnectionPtr &con, muduo::net
   }
 }
 
+void proxy_server::open_upstream(const muduo::net::TcpConnectionPtr &con, con_context *ctx, muduo::net::Buffer *buf)
+{
+  // got the http header, stop read until the tunnel is connected so the body can't pile up here
+  // the request stays in buf and is forwarded by onTransport
+  con->stopRead();
+  auto& times = ctx->times;
+  times.header = metrics::now();
+  // 连接上的第一个请求从accept开始计时, 之后的请求只能从请求头完整时算起
+  if(ctx->state == kStart)
+    metrics::observe(metrics::kHeaderSeconds, times.header - times.start);
+  else
+    times.start = times.header;
+  times.resolved = times.connected = 0;
+  times.pooled = times.traced = false;
+  set_state(ctx, kGotRequest);
+  auto& request = ctx->request;
+  uint16_t port = request.port();
+  std::string domain_name = request.domain_name();
+  if(trace_slow_ > 0)
+    times.host = domain_name;
+  bool https = request.method() == "CONNECT";
+  if(https)
+  {
+    buf->retrieve(request.header_length());
+    request.reset();
+    // the connection becomes a plain tunnel, http routes are of no use any more
+    for(const auto& r : ctx->routes)
+      release_route(ctx, r);
+    ctx->routes.clear();
+  }
+  boost::function<void(const std::vector<muduo::net::InetAddress>&)> cb(
+      boost::bind(&proxy_server::onResolve, this, boost::weak_ptr<muduo::net::TcpConnection>(con),
+                  domain_name, port, https, _1));
+#ifdef ZY_DNS
+  bool ok = context().resolver.resolve_all(domain_name, cb);
+#else
+  bool ok = context().resolver.resolve(domain_name.c_str(), boost::bind(&impl::single_address, cb, _1));
+#endif
+  if(!ok)
+  {
+    LOG_ERROR << "can't resolve " << domain_name << " for " << con->name();
+    onResolveError(con);
+  }
+}
+
 void proxy_server::onHeaderError(const muduo::net::TcpConnectionPtr &con)
 {
   const static muduo::string response("HTTP/1.1 400 Bad Request\r\nProxy-Agent: zy_https/0.1\r\n\r\n");
+  metrics::add(metrics::kResponses400);
   con->send(response.c_str());
   con->shutdown();
 }
 
-void proxy_server::set_con_state(const muduo::string &con_name, proxy_server::conState state) {
-  if(con_states_.count(con_name))
-    con_states_[con_name] = state;
+void proxy_server::onTransport(const boost::weak_ptr<muduo::net::TcpConnection>& wkCon, proxy_server::conState state) {
+  auto con = wkCon.lock();
+  if(!con)
+    return;
+  con_context* ctx = get_context(con);
+  if(!ctx)
+    return;
+  set_state(ctx, state);
+  auto& times = ctx->times;
+  times.connected = metrics::now();
+  if(!times.pooled)
+    metrics::observe(metrics::kConnectSeconds, times.connected - times.resolved);
+  auto buf = con->inputBuffer();
+  if(state == kTransport_http)
+  {
+    // the request parsed in kStart, its body and the pipelined ones behind it
+    forward_requests(con, ctx, buf);
+  }
+  else
+  {
+    if(buf->readableBytes() > 0)
+    {
+      // data the client sent right after CONNECT
+      metrics::add(metrics::kBytesClientToUpstream, static_cast<int64_t>(buf->readableBytes()));
+      ctx->tunnel->clientCon()->send(buf);
+      buf->retrieveAll();
+    }
+    // 隧道里先说话的通常是客户端(TLS), 服务器的第一个字节不算它的阶段, 只看到连上为止
+    trace(con, ctx, 0, times.connected);
+    if(splice_ && !ctx->tunnel->start_splice(ctx->sockfd))
+      LOG_DEBUG << con->name() << " data is still buffered, no splice";
+  }
 }
 
 // 超时统一使用此header进行回复
 void proxy_server::onResolveError(const muduo::net::TcpConnectionPtr &con)
 {
   const static muduo::string response("HTTP/1.1 504 Gateway Timeout\r\nProxy-Agent: zy_https/0.1\r\n\r\n");
+  metrics::add(metrics::kResponses504);
   con->send(response.c_str());
   if(con->connected())
     con->shutdown();
 }
 
-void proxy_server::onResolve(const boost::weak_ptr<muduo::net::TcpConnection> wkCon,
-                             uint16_t port, const muduo::net::InetAddress &addr)
+void proxy_server::onResolve(const boost::weak_ptr<muduo::net::TcpConnection> wkCon, const std::string& domain,
+                             uint16_t port, bool https, const std::vector<muduo::net::InetAddress> &addrs)
 {
   auto con = wkCon.lock();
   if(!con)
@@ -294,47 +641,166 @@ void proxy_server::onResolve(const boost::weak_ptr<muduo::net::TcpConnection> wk
     LOG_DEBUG << "connection is no more exit!";
     return;
   }
-  if(!is_valid_addr(addr))
+  con_context* ctx = get_context(con);
+  if(ctx)
+  {
+    ctx->times.resolved = metrics::now();
+    metrics::observe(metrics::kResolveSeconds, ctx->times.resolved - ctx->times.header);
+  }
+  std::vector<muduo::net::InetAddress> addresses;
+  for(const auto& addr : addrs)
+  {
+    if(is_valid_addr(addr))
+      addresses.push_back(impl::with_port(addr, port));
+  }
+  if(addresses.empty())
   {
     LOG_INFO << "fail to resolve the address of " << con->name();
+    metrics::add(metrics::kDnsFailures);
     onResolveError(con);
+    return;
   }
-  else
+  if(!ctx)
+    return;
+  set_state(ctx, kResolved);
+  TunnelPtr tunnel(new Tunnel(con->getLoop(), addresses, con,
+                              boost::bind(&proxy_server::onTransport, this, wkCon, https ? kTransport_https : kTransport_http),
+                              https));
+  ctx->tunnel = tunnel;
+  tunnel->setResumeReadCallback(boost::bind(&proxy_server::onResumeRead, wkCon));
+  if(!https)
   {
-    auto con_name = con->name();
-    set_con_state(con_name, kResolved);
-    muduo::net::InetAddress address (addr.toIp(), port);
-    TunnelPtr tunnel(new Tunnel(loop_, address, con, boost::bind(&proxy_server::set_con_state, this, con_name, proxy_server::kTransport_https), true));
-    tunnel->setup();
-    tunnel->connect();
-    tunnels_[con_name] = tunnel;
+    tunnel->setResponseCallback(boost::bind(&proxy_server::onResponse, this, wkCon, _1));
+    tunnel->setCloseCallback(boost::bind(&proxy_server::onUpstreamClose, this, wkCon, tunnel.get()));
+    trim_routes(ctx);
+    ctx->routes.push_back(route{domain, port, tunnel});
   }
+  tunnel->setup();
+  muduo::net::TcpConnectionPtr upstream;
+  int sockfd = -1;
+  if(!https)
+  {
+    // an idle connection to any address of the server will do
+    for(const auto& address : addresses)
+    {
+      if(context().upstream.acquire(address, &upstream, &sockfd))
+      {
+        metrics::add(metrics::kUpstreamPoolHits);
+        ctx->times.pooled = true;
+        tunnel->attach(upstream, sockfd);
+        return;
+      }
+    }
+    // 所有地址都没有空闲连接才算一次miss
+    metrics::add(metrics::kUpstreamPoolMisses);
+  }
+  tunnel->connect();
 }
 
-void proxy_server::onResolve(const boost::weak_ptr<muduo::net::TcpConnection> wkCon,
-                             uint16_t port, const std::string &request,
-                             const muduo::net::InetAddress &addr)
+void proxy_server::onResponse(const boost::weak_ptr<muduo::net::TcpConnection> &wkCon, const Tunnel::response_event& event)
 {
   auto con = wkCon.lock();
   if(!con)
-  {
-    LOG_DEBUG << "connection is no more exit!";
     return;
+  con_context* ctx = get_context(con);
+  if(!ctx || ctx->waiting.empty())
+    return;
+  uint64_t bytes = event.header_bytes + event.body_bytes;
+  ++ ctx->responses;
+  ctx->bytes_out += bytes;
+  ++ context().responses;
+  context().response_bytes += bytes;
+  metrics::add(metrics::kHttpResponses);
+  metrics::observe(metrics::kResponseSeconds, event.done - event.sent);
+  if(event.first_byte > 0)
+  {
+    metrics::observe(metrics::kFirstByteSeconds, event.first_byte - event.sent);
+    // responses come in request order, the first one after the tunnel opened answers the request that opened it
+    trace(con, ctx, event.first_byte, event.first_byte);
   }
-  if(!is_valid_addr(addr))
+  LOG_DEBUG << con->name() << " response " << event.status << " bytes " << bytes
+            << " ttfb " << impl::phase(event.first_byte, event.sent)
+            << " total " << impl::phase(event.done, event.sent)
+            << (event.keep_alive ? "" : " close");
+  TunnelPtr done = ctx->waiting.front();
+  ctx->waiting.pop_front();
+  // pipelined requests to the same server keep it active
+  if(ctx->waiting.empty() || ctx->waiting.front() != done)
+    update_active(ctx);
+  if(ctx->waiting.empty() && ctx->blocked)
   {
-    LOG_INFO << "fail to resolve the address of " << con->name();
-    onResolveError(con);
+    // the request waiting for a new tunnel can go now
+    ctx->blocked = false;
+    con->startRead();
+    forward_requests(con, ctx, con->inputBuffer());
+  }
+}
+
+void proxy_server::trace(const muduo::net::TcpConnectionPtr &con, con_context *ctx, int64_t first_byte, int64_t end)
+{
+  auto& times = ctx->times;
+  if(times.traced)
+    return;
+  times.traced = true;
+  if(trace_slow_ == 0 || end - times.start < trace_slow_)
+    return;
+  auto& loop = context();
+  int64_t second = end / 1000000;
+  if(second != loop.trace_second)
+  {
+    loop.trace_second = second;
+    loop.traces = 0;
+  }
+  if(loop.traces >= kMaxTracesPerSecond)
+    return;
+  ++ loop.traces;
+  LOG_WARN << "slow request " << con->name() << " " << times.host
+           << " total " << impl::phase(end, times.start)
+           << " header " << impl::phase(times.header, times.start)
+           << " resolve " << impl::phase(times.resolved, times.header)
+           << " connect " << (times.pooled ? "pooled" : impl::phase(times.connected, times.resolved))
+           << " first_byte " << (first_byte > 0 ? impl::phase(first_byte, times.connected) : std::string("-"));
+}
+
+void proxy_server::onResumeRead(const boost::weak_ptr<muduo::net::TcpConnection> &wkCon)
+{
+  auto con = wkCon.lock();
+  if(!con)
+    return;
+  con_context* ctx = get_context(con);
+  // proxy_server自己暂停的读取由它自己恢复: blocked在onResponse, 等待tunnel在onTransport之后
+  if(!ctx || ctx->blocked || ctx->state == kGotRequest || ctx->state == kResolved)
+    return;
+  con->startRead();
+}
+
+void proxy_server::onUpstreamClose(const boost::weak_ptr<muduo::net::TcpConnection> &wkCon, Tunnel *tunnel)
+{
+  auto con = wkCon.lock();
+  if(!con)
     return;
+  con_context* ctx = get_context(con);
+  if(!ctx)
+    return;
+  // if responses were still owed the tunnel has already closed the client
+  auto& waiting = ctx->waiting;
+  for(auto it = waiting.begin(); it != waiting.end(); )
+  {
+    if(it->get() == tunnel)
+      it = waiting.erase(it);
+    else
+      ++it;
   }
-  else {
-    auto con_name = con->name();
-    set_con_state(con_name, kResolved);
-    muduo::net::InetAddress address(addr.toIp(), port);
-    TunnelPtr tunnel(new Tunnel(loop_, address, con, boost::bind(&proxy_server::set_con_state, this, con_name, proxy_server::kTransport_http), false));
-    tunnel->set_request(request);
-    tunnel->setup();
-    tunnel->connect();
-    tunnels_[con_name] = tunnel;
+  auto& routes = ctx->routes;
+  for(auto it = routes.begin(); it != routes.end(); ++it)
+  {
+    if(it->tunnel.get() == tunnel)
+    {
+      routes.erase(it);
+      break;
+    }
   }
+  if(ctx->tunnel.get() == tunnel)
+    ctx->tunnel.reset();
+  update_active(ctx);
 }
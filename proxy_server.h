@@ -1,8 +1,15 @@
 #pragma once
 
 #include <boost/noncopyable.hpp>
-#include <muduo/net/TcpServer.h>
-#include <unordered_map>
+#include <muduo/net/TcpConnection.h>
+#include <muduo/net/EventLoopThreadPool.h>
+#include <muduo/net/EventLoopThread.h>
+#include <muduo/base/Mutex.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <sys/uio.h>
 
 #ifdef ZY_DNS
 #include "dns_resolver.h"
@@ -11,6 +18,10 @@
 #endif
 
 #include "tunnel.h"
+#include "http_header.h"
+#include "object_pool.h"
+#include "upstream_pool.h"
+#include "listener.h"
 
 namespace zy
 {
@@ -27,25 +38,168 @@ class proxy_server : boost::noncopyable
     kTransport_https, // 和远程服务器建立https连接，正在执行转发过程(这是一个简单的隧道转发)
   };
 
-  proxy_server(muduo::net::EventLoop* loop, const muduo::net::InetAddress& addr);
+  // 使用SO_REUSEPORT时, 如何让连接留在收到它的cpu上
+  enum steering
+  {
+    kSteerNone,  // the kernel hashes connections over the listeners
+    kSteerCpu,   // io loops are pinned to cpus and set SO_INCOMING_CPU on their listeners
+    kSteerBpf    // pinned as above, a classic BPF program picks listener cpu % listeners
+  };
+
+  // thread_num == 0 means all connections are served by loop
+  proxy_server(muduo::net::EventLoop* loop, const muduo::net::InetAddress& addr, int thread_num = 0);
 
   void onConnection(const muduo::net::TcpConnectionPtr& con);
 
   void onMessage(const muduo::net::TcpConnectionPtr& con, muduo::net::Buffer* buf, muduo::Timestamp);
 
-  void onResolve(const boost::weak_ptr<muduo::net::TcpConnection> wkCon,
-                 uint16_t port, const std::string& request,
-                 const muduo::net::InetAddress &addr);
+  // addrs: every address of domain, empty or 0.0.0.0 on failure
+  void onResolve(const boost::weak_ptr<muduo::net::TcpConnection> wkCon, const std::string& domain,
+                 uint16_t port, bool https, const std::vector<muduo::net::InetAddress>& addrs);
+
+  // idle keep-alive connections kept per (ip, port) in every io thread, 0 disables reuse; call before start()
+  void set_upstream_pool(size_t max_idle, double idle_timeout)
+  {
+    pool_max_idle_ = max_idle;
+    pool_idle_timeout_ = idle_timeout;
+  }
+
+  // seconds a failed lookup is answered from the negative cache, zy_dns only; call before start()
+  void set_dns_negative_ttl(double ttl) { dns_negative_ttl_ = ttl; }
+
+  // memory of the dns cache shared by all io threads, zy_dns only; call before start()
+  void set_dns_cache_bytes(size_t bytes) { dns_cache_bytes_ = bytes; }
+
+  // EDNS0 udp payload size of dns queries, 0 disables EDNS0, zy_dns only; call before start()
+  void set_dns_edns_payload(uint16_t size) { dns_edns_payload_ = size; }
+
+  // dns servers instead of those in /etc/resolv.conf, zy_dns only; call before start()
+  void set_dns_servers(const std::vector<muduo::net::InetAddress>& servers) { dns_servers_ = servers; }
+
+  // the dns cache is loaded from path on start() and saved to it every save_interval seconds, 0 only loads it;
+  // zy_dns only; call before start()
+  void set_dns_cache_file(const std::string& path, double save_interval)
+  {
+    dns_cache_file_ = path;
+    dns_cache_save_interval_ = save_interval;
+  }
+
+  // CONNECT tunnels forward with splice(2) once established, call before start()
+  void set_splice(bool on) { splice_ = on; }
+
+  // log the phases of requests that took longer than seconds until the server answered, 0 disables it;
+  // at most kMaxTracesPerSecond per io loop; call before start()
+  void set_trace_slow(double seconds) { trace_slow_ = static_cast<int64_t>(seconds * 1000000); }
+
+  // every io loop listens on addr with its own SO_REUSEPORT socket and serves what it accepts
+  // first_cpu: cpu of the first io loop when steering, for forked workers; call before start()
+  void set_reuseport(bool on, steering steer = kSteerNone, int first_cpu = 0)
+  {
+    reuseport_ = on;
+    steering_ = steer;
+    first_cpu_ = first_cpu;
+  }
+
+  void start();
+
 
-  void onResolve(const boost::weak_ptr<muduo::net::TcpConnection> wkCon,
-                 uint16_t port, const muduo::net::InetAddress &addr);
+  // called by Tunnel once connected to the remote server, forward what the client has sent so far
+  void onTransport(const boost::weak_ptr<muduo::net::TcpConnection>& wkCon, conState state);
 
-  void start() { server_.start(); }
+  // a tunnel of this client has finished a response, the next one in order may write
+  void onResponse(const boost::weak_ptr<muduo::net::TcpConnection>& wkCon, const Tunnel::response_event& event);
 
+  // the remote server of tunnel has closed
+  void onUpstreamClose(const boost::weak_ptr<muduo::net::TcpConnection>& wkCon, Tunnel* tunnel);
 
-  void set_con_state(const muduo::string& con_name, conState state);
+  // a tunnel no longer holds back reading the client, it goes on unless the connection is blocked or waits for a tunnel
+  static void onResumeRead(const boost::weak_ptr<muduo::net::TcpConnection>& wkCon);
 
  private:
+  // 一个客户端连接上的请求可以发往不同的服务器, 每个(host, port)一个tunnel
+  struct route
+  {
+    std::string host;
+    uint16_t port;
+    TunnelPtr tunnel;
+  };
+
+  // routes kept by one client connection, idle ones beyond this go back to the upstream pool
+  const static size_t kMaxRoutes = 8;
+
+  // slow requests logged by one io loop in a second, the rest are only in the histograms
+  const static int kMaxTracesPerSecond = 10;
+
+  // 打开当前tunnel的请求经过各阶段的时刻, metrics::now()的微秒, 0表示还没到或者没有这个阶段
+  struct phase_times
+  {
+    int64_t start;       // accepted for the first request of the connection, else its header complete
+    int64_t header;      // header complete
+    int64_t resolved;
+    int64_t connected;   // 0 if an idle pooled connection was taken
+    bool pooled;
+    bool traced;         // its answer has been checked against trace_slow_
+    std::string host;    // only kept when tracing
+  };
+
+  // 每个连接的数据, 从loop_context的对象池分配, 指针直接保存在TcpConnection的context中
+  struct con_context : boost::noncopyable
+  {
+    con_context(int fd, const muduo::net::TcpConnectionPtr& con)
+      : sockfd(fd), connection(con), state(kStart), tunnel(), routes(), waiting(), blocked(false),
+        request(), body(), in_body(false), bytes_in(0), bytes_out(0), requests(0), responses(0), times()
+    { }
+
+    int sockfd;            // socket of the client connection, for splice
+    // owns the client connection until it is closed, like TcpServer::connections_
+    muduo::net::TcpConnectionPtr connection;
+    conState state;
+    TunnelPtr tunnel;      // where the current request goes, the https tunnel after CONNECT
+    std::vector<route> routes;
+    // 响应必须按请求的顺序返回, 每个已转发的请求对应一项, 只有队首的tunnel可以写客户端
+    std::deque<TunnelPtr> waiting;
+    bool blocked;          // a request needs a new tunnel, reading stopped until waiting is empty
+    http_request request;  // request being parsed, keeps its scan offset between reads
+    http_body body;        // framing of the current request body
+    bool in_body;          // header forwarded, body is being streamed
+    uint64_t bytes_in;  // bytes read from client
+    uint64_t bytes_out; // bytes of finished http responses sent to client
+    uint32_t requests;  // http requests parsed on this connection
+    uint32_t responses; // http responses finished on this connection
+    phase_times times;
+  };
+
+  // return nullptr if con has no con_context
+  static con_context* get_context(const muduo::net::TcpConnectionPtr& con);
+
+  // change the state and move the connection between the per state gauges
+  static void set_state(con_context* ctx, conState state);
+
+  // 每个io线程独有的数据, 只在所属的loop线程中访问, 转发过程无需加锁
+  struct loop_context : boost::noncopyable
+  {
+    loop_context(muduo::net::EventLoop* loop, size_t max_idle, double idle_timeout);
+
+    muduo::net::EventLoop* loop;
+#ifdef ZY_DNS
+    dns_resolver resolver;
+#else
+    cdns::Resolver resolver;
+#endif
+    object_pool<con_context> con_pool;
+    upstream_pool upstream;  // idle connections to remote http servers
+    std::vector<struct iovec> iov;  // scratch for forward_request
+    uint64_t responses;       // http responses finished in this loop
+    uint64_t response_bytes;
+    int64_t trace_second;     // metrics::now() / 1000000 of the last slow request logged
+    int traces;               // slow requests logged in trace_second
+  };
+
+  // run in every io thread before its loop starts
+  void onThreadInit(muduo::net::EventLoop* loop);
+
+  // loop_context of the current io thread
+  static loop_context& context();
 
   // is valid address ?
   static bool is_valid_addr(const muduo::net::InetAddress& addr);
@@ -54,16 +208,89 @@ class proxy_server : boost::noncopyable
 
   void onHeaderError(const muduo::net::TcpConnectionPtr& con);
 
-  void clean_from_container(const muduo::string& con_name);
+  // 解析http请求头并确定请求体的边界, 结果保存在ctx中, 请求仍然留在buf里
+  // return false if more data is needed or the request is bad (con is closed then)
+  bool parse_request(const muduo::net::TcpConnectionPtr& con, con_context* ctx, muduo::net::Buffer* buf);
+
+  // send the parsed header and the body received so far to the tunnel without copying, retrieve them from buf
+  bool forward_request(const muduo::net::TcpConnectionPtr& con, con_context* ctx, muduo::net::Buffer* buf);
+
+  // stream the rest of the body, return true when it is finished
+  bool forward_body(const muduo::net::TcpConnectionPtr& con, con_context* ctx, muduo::net::Buffer* buf);
+
+  // forward everything complete in buf: headers, bodies and pipelined requests
+  void forward_requests(const muduo::net::TcpConnectionPtr& con, con_context* ctx, muduo::net::Buffer* buf);
+
+  // resolve the host of the parsed request and build a new tunnel to it, the request stays in buf
+  void open_upstream(const muduo::net::TcpConnectionPtr& con, con_context* ctx, muduo::net::Buffer* buf);
+
+  // available tunnel to host:port, empty if there is none
+  static TunnelPtr find_route(con_context* ctx, const std::string& host, uint16_t port);
+
+  // make room in ctx->routes, idle tunnels go back to the upstream pool
+  static void trim_routes(con_context* ctx);
+
+  // only the tunnel owing the next response may write to the client
+  static void update_active(con_context* ctx);
+
+  // the request that opened the tunnel got its first answer at end, log its phases if it was slow
+  void trace(const muduo::net::TcpConnectionPtr& con, con_context* ctx, int64_t first_byte, int64_t end);
+
+  // reusable connections of tunnels go to the upstream pool
+  static void release_route(con_context* ctx, const route& r);
+
+  void clean_from_container(const muduo::net::TcpConnectionPtr& con);
+
+  // 和TcpServer一样接受连接, 但保留了socket fd, splice需要用到它
+  // ioLoop is nullptr for the single listener in loop_, connections are spread over the io loops then
+  void newConnection(int sockfd, const muduo::net::InetAddress& peerAddr, muduo::net::EventLoop* ioLoop);
+
+  // one SO_REUSEPORT listener per io loop, joining the group in the order of the loops
+  void start_reuseport();
+
+#ifdef ZY_DNS
+  // runs in the loop of dns_cache_saver_
+  void save_dns_cache();
+#endif
+
+  // cpu for the index-th io loop when steering
+  int cpu_of(size_t index) const;
+
+  // in the io loop of con
+  void connectEstablished(const muduo::net::TcpConnectionPtr& con, int sockfd);
+
+  static void removeConnection(const muduo::net::TcpConnectionPtr& con);
+
+  static __thread loop_context* t_context_;
 
   muduo::net::EventLoop* loop_;
-  muduo::net::TcpServer server_;
+  const muduo::net::InetAddress addr_;
+  const muduo::string name_;
+  // 一个监听socket在loop_中, 或者每个io loop一个SO_REUSEPORT socket
+  std::vector<std::unique_ptr<listener> > listeners_;
+  std::unique_ptr<muduo::net::EventLoopThreadPool> thread_pool_;
+  std::atomic<int> next_con_id_;
+  bool splice_;
+  int64_t trace_slow_;  // microseconds, 0 if off
+  bool reuseport_;
+  steering steering_;
+  int first_cpu_;
+  size_t pool_max_idle_;
+  double pool_idle_timeout_;
+  double dns_negative_ttl_;
+  size_t dns_cache_bytes_;
+  uint16_t dns_edns_payload_;
+  std::vector<muduo::net::InetAddress> dns_servers_;
+  std::string dns_cache_file_;
+  double dns_cache_save_interval_;
 #ifdef ZY_DNS
-  dns_resolver resolver_;
-#else
-  cdns::Resolver resolver_;
+  // 所有io线程共用的dns缓存, 查找不加锁; 没命中的由各自loop的resolver查询
+  boost::shared_ptr<dns_cache> dns_cache_;
+  // 快照的复制和写文件(msync)都在这个线程里, 不阻塞接受连接的loop_; 先于dns_cache_析构
+  std::unique_ptr<muduo::net::EventLoopThread> dns_cache_saver_;
 #endif
-  std::unordered_map<muduo::string, conState> con_states_;
-  std::unordered_map<muduo::string, TunnelPtr> tunnels_;
+  muduo::MutexLock mutex_;
+  // owns all loop_context, only modified during thread init
+  std::vector<std::unique_ptr<loop_context> > contexts_;
 };
 }
\ No newline at end of file
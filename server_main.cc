@@ -3,7 +3,10 @@
 #include <muduo/base/LogFile.h>
 #include <boost/program_options.hpp>
 #include <iostream>
+#include <sys/types.h>
+#include <unistd.h>
 #include "proxy_server.h"
+#include "admin_server.h"
 
 using namespace zy;
 
@@ -35,7 +38,23 @@ int main(int argc, const char* argv[])
   desc.add_options()
       ("help,h", "produce help message")
       ("ip,i", po::value<muduo::string>(), "bind ip address")
-      ("port,p", po::value<uint16_t>(), "listen port");
+      ("port,p", po::value<uint16_t>(), "listen port")
+      ("threads,t", po::value<int>(), "number of io threads, 0 means serve in the main loop")
+      ("pool-max-idle", po::value<int>(), "idle connections kept for every http server in each io thread, 0 disables reuse")
+      ("pool-idle-timeout", po::value<double>(), "seconds before an idle http server connection is closed")
+      ("dns-negative-ttl", po::value<double>(), "seconds to cache failed dns lookups with zy_dns, 0 disables it")
+      ("dns-cache-bytes", po::value<size_t>(), "memory of the dns cache shared by the io threads with zy_dns")
+      ("dns-cache-file", po::value<std::string>(), "snapshot of the zy_dns cache, loaded on start and saved periodically")
+      ("dns-cache-save-interval", po::value<double>(), "seconds between dns cache snapshots, default 60")
+      ("dns-edns-payload", po::value<int>(), "EDNS0 udp payload size of zy_dns queries, 512-65535, 0 disables EDNS0")
+      ("dns-server", po::value<std::vector<std::string> >(), "dns server of zy_dns as ip, ip:port or [ipv6]:port, may repeat; default from /etc/resolv.conf")
+      ("splice", "forward https (CONNECT) tunnels with splice(2) instead of user space buffers")
+      ("reuseport", "every io thread accepts on its own SO_REUSEPORT socket")
+      ("steer", po::value<muduo::string>(), "with --reuseport keep connections on the cpu that received them: none, cpu or bpf")
+      ("processes", po::value<int>(), "fork this many worker processes sharing the port, requires --reuseport")
+      ("trace-slow-ms", po::value<double>(), "log the phases (header, dns, connect, first byte) of requests slower than this, 0 disables it")
+      ("admin-ip", po::value<muduo::string>(), "bind ip address of the admin listener, default 127.0.0.1")
+      ("admin-port", po::value<uint16_t>(), "serve GET /metrics in Prometheus text format on this port, worker n of --processes uses port + n");
   po::variables_map value_map;
   po::store(po::parse_command_line(argc, argv, desc), value_map);
 
@@ -43,6 +62,30 @@ int main(int argc, const char* argv[])
   muduo::string host = "0.0.0.0";
   // default listen port is 8768
   uint16_t port = 8768;
+  // default serve all connections in the main loop
+  int threads = 0;
+  // default keep 8 idle connections per http server for 15 seconds
+  int pool_max_idle = 8;
+  double pool_idle_timeout = 15;
+  // default remember NXDOMAIN, SERVFAIL and NODATA for 5 seconds
+  double dns_negative_ttl = 5;
+  // default 8MiB of dns cache shared by the io threads
+  size_t dns_cache_bytes = 8 * 1024 * 1024;
+  // default no snapshot of the dns cache
+  std::string dns_cache_file;
+  double dns_cache_save_interval = 60;
+  int dns_edns_payload = 1232;
+  // default the nameservers of /etc/resolv.conf
+  std::vector<muduo::net::InetAddress> dns_servers;
+  // default one process, one listening socket
+  bool reuseport = value_map.count("reuseport") > 0;
+  proxy_server::steering steer = proxy_server::kSteerNone;
+  int processes = 1;
+  // default no slow request log
+  double trace_slow_ms = 0;
+  // default no admin listener
+  muduo::string admin_host = "127.0.0.1";
+  uint16_t admin_port = 0;
 
   if(value_map.count("help"))
   {
@@ -57,6 +100,144 @@ int main(int argc, const char* argv[])
   {
     port = value_map["port"].as<uint16_t>();
   }
+  if(value_map.count("threads"))
+  {
+    threads = value_map["threads"].as<int>();
+    if(threads < 0)
+    {
+      std::cerr << "threads can't be negative" << std::endl;
+      exit(-1);
+    }
+  }
+  if(value_map.count("pool-max-idle"))
+  {
+    pool_max_idle = value_map["pool-max-idle"].as<int>();
+    if(pool_max_idle < 0)
+    {
+      std::cerr << "pool-max-idle can't be negative" << std::endl;
+      exit(-1);
+    }
+  }
+  if(value_map.count("pool-idle-timeout"))
+  {
+    pool_idle_timeout = value_map["pool-idle-timeout"].as<double>();
+    if(pool_idle_timeout <= 0)
+    {
+      std::cerr << "pool-idle-timeout must be positive" << std::endl;
+      exit(-1);
+    }
+  }
+  if(value_map.count("dns-negative-ttl"))
+  {
+    dns_negative_ttl = value_map["dns-negative-ttl"].as<double>();
+    if(dns_negative_ttl < 0)
+    {
+      std::cerr << "dns-negative-ttl can't be negative" << std::endl;
+      exit(-1);
+    }
+  }
+  if(value_map.count("dns-cache-bytes"))
+  {
+    dns_cache_bytes = value_map["dns-cache-bytes"].as<size_t>();
+  }
+  if(value_map.count("dns-cache-file"))
+  {
+    dns_cache_file = value_map["dns-cache-file"].as<std::string>();
+  }
+  if(value_map.count("dns-cache-save-interval"))
+  {
+    dns_cache_save_interval = value_map["dns-cache-save-interval"].as<double>();
+    if(dns_cache_save_interval <= 0)
+    {
+      std::cerr << "dns-cache-save-interval must be positive" << std::endl;
+      exit(-1);
+    }
+  }
+  if(value_map.count("dns-edns-payload"))
+  {
+    dns_edns_payload = value_map["dns-edns-payload"].as<int>();
+    if(dns_edns_payload != 0 && (dns_edns_payload < 512 || dns_edns_payload > 65535))
+    {
+      std::cerr << "dns-edns-payload must be 0 or between 512 and 65535" << std::endl;
+      exit(-1);
+    }
+  }
+#ifdef ZY_DNS
+  if(value_map.count("dns-server"))
+  {
+    for(const auto& text : value_map["dns-server"].as<std::vector<std::string> >())
+    {
+      muduo::net::InetAddress addr;
+      if(!dns_resolver::parse_server(text, &addr))
+      {
+        std::cerr << "invalid dns-server " << text << std::endl;
+        exit(-1);
+      }
+      dns_servers.push_back(addr);
+    }
+  }
+#endif
+  if(value_map.count("steer"))
+  {
+    muduo::string name = value_map["steer"].as<muduo::string>();
+    if(name == "cpu")
+      steer = proxy_server::kSteerCpu;
+    else if(name == "bpf")
+      steer = proxy_server::kSteerBpf;
+    else if(name != "none")
+    {
+      std::cerr << "steer must be none, cpu or bpf" << std::endl;
+      exit(-1);
+    }
+    if(steer != proxy_server::kSteerNone && !reuseport)
+    {
+      std::cerr << "steer requires reuseport" << std::endl;
+      exit(-1);
+    }
+  }
+  if(value_map.count("processes"))
+  {
+    processes = value_map["processes"].as<int>();
+    if(processes < 1)
+    {
+      std::cerr << "processes must be positive" << std::endl;
+      exit(-1);
+    }
+    if(processes > 1 && !reuseport)
+    {
+      std::cerr << "processes requires reuseport" << std::endl;
+      exit(-1);
+    }
+    // 每个进程的BPF程序会替换整个分组的程序, 下标也跨越了进程, 只支持单进程
+    if(processes > 1 && steer == proxy_server::kSteerBpf)
+    {
+      std::cerr << "steer bpf works in a single process, use steer cpu" << std::endl;
+      exit(-1);
+    }
+  }
+
+  if(value_map.count("trace-slow-ms"))
+  {
+    trace_slow_ms = value_map["trace-slow-ms"].as<double>();
+    if(trace_slow_ms < 0)
+    {
+      std::cerr << "trace-slow-ms can't be negative" << std::endl;
+      exit(-1);
+    }
+  }
+  if(value_map.count("admin-ip"))
+  {
+    admin_host = value_map["admin-ip"].as<muduo::string>();
+  }
+  if(value_map.count("admin-port"))
+  {
+    admin_port = value_map["admin-port"].as<uint16_t>();
+    if(admin_port != 0 && admin_port + processes - 1 > 65535)
+    {
+      std::cerr << "admin-port + processes is beyond 65535" << std::endl;
+      exit(-1);
+    }
+  }
 
   if(daemon(0, 0) == -1)
   {
@@ -64,13 +245,49 @@ int main(int argc, const char* argv[])
     exit(-1);
   }
 
+  // worker 0 is this process, the others are forked before any thread or socket exists
+  int worker = 0;
+  for(int i = 1; i < processes; ++i)
+  {
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+      fprintf(stderr, "fork worker process error!\n");
+      exit(-1);
+    }
+    if(pid == 0)
+    {
+      worker = i;
+      break;
+    }
+  }
+
   init_log();
 
   LOG_INFO << "zy_https_proxy init complete! pid = " << ::getpid();
 
   muduo::net::EventLoop loop;
-  proxy_server server(&loop, muduo::net::InetAddress(host, port));
+  proxy_server server(&loop, muduo::net::InetAddress(host, port), threads);
+  server.set_upstream_pool(static_cast<size_t>(pool_max_idle), pool_idle_timeout);
+  server.set_dns_negative_ttl(dns_negative_ttl);
+  server.set_dns_cache_bytes(dns_cache_bytes);
+  server.set_dns_edns_payload(static_cast<uint16_t>(dns_edns_payload));
+  server.set_dns_servers(dns_servers);
+  // every worker loads the snapshot, only the first one writes it
+  server.set_dns_cache_file(dns_cache_file, worker == 0 ? dns_cache_save_interval : 0);
+  server.set_splice(value_map.count("splice") > 0);
+  server.set_trace_slow(trace_slow_ms / 1000);
+  // workers take consecutive cpus, one per io loop
+  server.set_reuseport(reuseport, steer, worker * (threads > 0 ? threads : 1));
   server.start();
 
+  // 指标由各个io线程自己累加, 管理端口在主loop中汇总, 每个worker进程有自己的端口
+  std::unique_ptr<admin_server> admin;
+  if(admin_port != 0)
+  {
+    admin.reset(new admin_server(&loop, muduo::net::InetAddress(admin_host, static_cast<uint16_t>(admin_port + worker))));
+    admin->start();
+  }
+
   loop.loop();
 }
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "simd_scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZY_SCAN_X86 1
+#endif
+
+using namespace zy;
+
+namespace impl
+{
+
+inline bool is_label_char(char ch)
+{
+  char lower = static_cast<char>(ch | 0x20);
+  return (lower >= 'a' && lower <= 'z') || (ch >= '0' && ch <= '9') || ch == '-' || ch == '_';
+}
+
+const char* find_char_scalar(const char* begin, const char* end, char ch)
+{
+  for(; begin != end; ++begin)
+  {
+    if(*begin == ch)
+      return begin;
+  }
+  return end;
+}
+
+const char* find_non_label_char_scalar(const char* begin, const char* end)
+{
+  for(; begin != end; ++begin)
+  {
+    if(!is_label_char(*begin))
+      return begin;
+  }
+  return end;
+}
+
+#ifdef ZY_SCAN_X86
+
+// 以下均为无对齐要求的load, 不足一个向量的尾部交给标量版本处理
+
+__attribute__((target("sse2")))
+const char* find_char_sse2(const char* begin, const char* end, char ch)
+{
+  const __m128i needle = _mm_set1_epi8(ch);
+  for(; end - begin >= 16; begin += 16)
+  {
+    __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(data, needle));
+    if(mask != 0)
+      return begin + __builtin_ctz(mask);
+  }
+  return find_char_scalar(begin, end, ch);
+}
+
+__attribute__((target("sse2")))
+const char* find_non_label_char_sse2(const char* begin, const char* end)
+{
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1);
+  const __m128i d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+  const __m128i dash = _mm_set1_epi8('-'), underline = _mm_set1_epi8('_');
+  for(; end - begin >= 16; begin += 16)
+  {
+    __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    // bytes >= 0x80 are negative, so they never fall into the ranges below
+    __m128i lower = _mm_or_si128(data, case_bit);
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, a), _mm_cmplt_epi8(lower, z));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(data, d0), _mm_cmplt_epi8(data, d9));
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(data, dash), _mm_cmpeq_epi8(data, underline));
+    int mask = ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), other)) & 0xffff;
+    if(mask != 0)
+      return begin + __builtin_ctz(mask);
+  }
+  return find_non_label_char_scalar(begin, end);
+}
+
+__attribute__((target("avx2")))
+const char* find_char_avx2(const char* begin, const char* end, char ch)
+{
+  const __m256i needle = _mm256_set1_epi8(ch);
+  for(; end - begin >= 32; begin += 32)
+  {
+    __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(data, needle)));
+    if(mask != 0)
+      return begin + __builtin_ctz(mask);
+  }
+  // gcc may tail call the sse2 version without vzeroupper, avoid the avx -> sse transition penalty
+  _mm256_zeroupper();
+  return find_char_sse2(begin, end, ch);
+}
+
+__attribute__((target("avx2")))
+const char* find_non_label_char_avx2(const char* begin, const char* end)
+{
+  const __m256i case_bit = _mm256_set1_epi8(0x20);
+  const __m256i a = _mm256_set1_epi8('a' - 1), z = _mm256_set1_epi8('z' + 1);
+  const __m256i d0 = _mm256_set1_epi8('0' - 1), d9 = _mm256_set1_epi8('9' + 1);
+  const __m256i dash = _mm256_set1_epi8('-'), underline = _mm256_set1_epi8('_');
+  for(; end - begin >= 32; begin += 32)
+  {
+    __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    __m256i lower = _mm256_or_si256(data, case_bit);
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, a), _mm256_cmpgt_epi8(z, lower));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(data, d0), _mm256_cmpgt_epi8(d9, data));
+    __m256i other = _mm256_or_si256(_mm256_cmpeq_epi8(data, dash), _mm256_cmpeq_epi8(data, underline));
+    __m256i valid = _mm256_or_si256(_mm256_or_si256(alpha, digit), other);
+    uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(valid));
+    if(mask != 0)
+      return begin + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return find_non_label_char_sse2(begin, end);
+}
+
+#endif
+
+struct kernels
+{
+  scan::isa which;
+  const char* (*find_char)(const char*, const char*, char);
+  const char* (*find_non_label_char)(const char*, const char*);
+};
+
+kernels make_kernels(scan::isa which)
+{
+#ifdef ZY_SCAN_X86
+  if(which == scan::kAVX2)
+    return kernels{scan::kAVX2, find_char_avx2, find_non_label_char_avx2};
+  if(which == scan::kSSE2)
+    return kernels{scan::kSSE2, find_char_sse2, find_non_label_char_sse2};
+#endif
+  return kernels{scan::kScalar, find_char_scalar, find_non_label_char_scalar};
+}
+
+// selected once before main, only changed by use_isa()
+kernels g_kernels = make_kernels(scan::detect_isa());
+
+}
+
+scan::isa scan::detect_isa()
+{
+#ifdef ZY_SCAN_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return kAVX2;
+  if(__builtin_cpu_supports("sse2"))
+    return kSSE2;
+#endif
+  return kScalar;
+}
+
+scan::isa scan::current_isa()
+{
+  return impl::g_kernels.which;
+}
+
+void scan::use_isa(isa which)
+{
+  isa best = detect_isa();
+  impl::g_kernels = impl::make_kernels(which <= best ? which : best);
+}
+
+const char* scan::isa_name(isa which)
+{
+  switch(which)
+  {
+    case kAVX2:
+      return "avx2";
+    case kSSE2:
+      return "sse2";
+    default:
+      return "scalar";
+  }
+}
+
+const char* scan::find_char(const char* begin, const char* end, char ch)
+{
+  return impl::g_kernels.find_char(begin, end, ch);
+}
+
+const char* scan::find_non_label_char(const char* begin, const char* end)
+{
+  return impl::g_kernels.find_non_label_char(begin, end);
+}
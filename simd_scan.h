@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace zy
+{
+// 用于http头解析和dns域名编码的字符扫描函数, 运行时根据cpu选择 AVX2 / SSE2 / 标量实现
+namespace scan
+{
+enum isa
+{
+  kScalar,
+  kSSE2,
+  kAVX2
+};
+
+// best isa supported by this cpu
+isa detect_isa();
+
+// isa used by the functions below, default is detect_isa()
+isa current_isa();
+
+// force an implementation, for benchmark; falls back to detect_isa() if not supported
+void use_isa(isa which);
+
+const char* isa_name(isa which);
+
+// first ch in [begin, end), end if not found
+const char* find_char(const char* begin, const char* end, char ch);
+
+// first byte that is not [A-Za-z0-9_-] in [begin, end), end if not found
+const char* find_non_label_char(const char* begin, const char* end);
+}
+}
@@ -0,0 +1,263 @@
+#include "splicer.h"
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/Channel.h>
+#include <muduo/base/Logging.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace zy;
+
+namespace impl
+{
+
+// a busy connection must not starve the others in the same loop
+const int kMaxRoundsPerEvent = 16;
+
+void close_fd(int* fd)
+{
+  if(*fd >= 0)
+  {
+    ::close(*fd);
+    *fd = -1;
+  }
+}
+
+}
+
+splicer::splicer(muduo::net::EventLoop *loop, int fd_a, int fd_b, size_t pipe_size)
+  : loop_(loop),
+    fd_a_(::dup(fd_a)),
+    fd_b_(::dup(fd_b)),
+    pipe_size_(pipe_size),
+    ab_(),
+    ba_(),
+    channel_a_(),
+    channel_b_(),
+    closeCallback_(),
+    closed_(false)
+{
+  init_direction(&ab_, fd_a_, fd_b_);
+  init_direction(&ba_, fd_b_, fd_a_);
+}
+
+splicer::~splicer()
+{
+  // channels must leave the poller before their fds are closed
+  if(channel_a_)
+  {
+    channel_a_->disableAll();
+    channel_a_->remove();
+  }
+  if(channel_b_)
+  {
+    channel_b_->disableAll();
+    channel_b_->remove();
+  }
+  impl::close_fd(&ab_.pipe[0]);
+  impl::close_fd(&ab_.pipe[1]);
+  impl::close_fd(&ba_.pipe[0]);
+  impl::close_fd(&ba_.pipe[1]);
+  impl::close_fd(&fd_a_);
+  impl::close_fd(&fd_b_);
+}
+
+void splicer::init_direction(direction *dir, int from, int to)
+{
+  dir->from = from;
+  dir->to = to;
+  dir->pipe[0] = dir->pipe[1] = -1;
+  dir->in_pipe = 0;
+  dir->bytes = 0;
+  dir->counter = metrics::kCounters;
+  dir->eof = false;
+  dir->blocked = false;
+  dir->done = false;
+}
+
+bool splicer::start()
+{
+  loop_->assertInLoopThread();
+  if(fd_a_ < 0 || fd_b_ < 0)
+  {
+    LOG_SYSERR << "splicer dup";
+    return false;
+  }
+  direction* dirs[] = {&ab_, &ba_};
+  for(direction* dir : dirs)
+  {
+    if(::pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+      LOG_SYSERR << "splicer pipe2";
+      return false;
+    }
+    // 管道容量相当于Buffer的高水位, 设置失败时用系统默认大小
+    ::fcntl(dir->pipe[1], F_SETPIPE_SZ, static_cast<int>(pipe_size_));
+    int capacity = ::fcntl(dir->pipe[1], F_GETPIPE_SZ);
+    if(capacity > 0)
+      pipe_size_ = std::min(pipe_size_, static_cast<size_t>(capacity));
+  }
+  channel_a_.reset(new muduo::net::Channel(loop_, fd_a_));
+  channel_b_.reset(new muduo::net::Channel(loop_, fd_b_));
+  channel_a_->setReadCallback(boost::bind(&splicer::onReadable, this, &ab_));
+  channel_a_->setWriteCallback(boost::bind(&splicer::onWritable, this, &ba_));
+  channel_a_->setCloseCallback(boost::bind(&splicer::onHangup, this, &ab_, &ba_));
+  channel_a_->setErrorCallback(boost::bind(&splicer::close, this));
+  channel_b_->setReadCallback(boost::bind(&splicer::onReadable, this, &ba_));
+  channel_b_->setWriteCallback(boost::bind(&splicer::onWritable, this, &ab_));
+  channel_b_->setCloseCallback(boost::bind(&splicer::onHangup, this, &ba_, &ab_));
+  channel_b_->setErrorCallback(boost::bind(&splicer::close, this));
+  channel_a_->enableReading();
+  channel_b_->enableReading();
+  return true;
+}
+
+bool splicer::pump(direction *dir)
+{
+  for(int round = 0; round < impl::kMaxRoundsPerEvent; ++round)
+  {
+    bool progress = false;
+    if(!dir->eof && !dir->blocked && dir->in_pipe < pipe_size_)
+    {
+      ssize_t n = ::splice(dir->from, nullptr, dir->pipe[1], nullptr, pipe_size_ - dir->in_pipe,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(n > 0)
+      {
+        dir->in_pipe += static_cast<size_t>(n);
+        progress = true;
+      }
+      else if(n == 0)
+      {
+        dir->eof = true;
+      }
+      else if(errno == EAGAIN && dir->in_pipe > 0)
+      {
+        // pipe slots hold partial pages, it can be full before in_pipe reaches pipe_size_
+        dir->blocked = true;
+      }
+      else if(errno != EAGAIN && errno != EINTR)
+      {
+        LOG_SYSERR << "splice from socket " << dir->from;
+        return false;
+      }
+    }
+    if(dir->in_pipe > 0)
+    {
+      ssize_t n = ::splice(dir->pipe[0], nullptr, dir->to, nullptr, dir->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(n > 0)
+      {
+        dir->in_pipe -= static_cast<size_t>(n);
+        dir->bytes += static_cast<uint64_t>(n);
+        if(dir->counter != metrics::kCounters)
+          metrics::add(dir->counter, n);
+        dir->blocked = false;
+        progress = true;
+      }
+      else if(n < 0 && errno != EAGAIN && errno != EINTR)
+      {
+        LOG_SYSERR << "splice to socket " << dir->to;
+        return false;
+      }
+    }
+    if(!progress)
+      break;
+  }
+  if(dir->eof && dir->in_pipe == 0 && !dir->done)
+  {
+    // half close travels through, the other direction goes on
+    ::shutdown(dir->to, SHUT_WR);
+    dir->done = true;
+  }
+  return true;
+}
+
+void splicer::update(muduo::net::Channel *channel, const direction &read_dir, const direction &write_dir)
+{
+  // 管道满了就不再读, 相当于muduo中高水位时stopRead, 排空后再恢复
+  bool want_read = !read_dir.eof && !read_dir.blocked && read_dir.in_pipe < pipe_size_;
+  bool want_write = write_dir.in_pipe > 0;
+  if(want_read != channel->isReading())
+  {
+    if(want_read)
+      channel->enableReading();
+    else
+      channel->disableReading();
+  }
+  if(want_write != channel->isWriting())
+  {
+    if(want_write)
+      channel->enableWriting();
+    else
+      channel->disableWriting();
+  }
+}
+
+void splicer::after_event()
+{
+  if(ab_.done && ba_.done)
+  {
+    close();
+    return;
+  }
+  update(channel_a_.get(), ab_, ba_);
+  update(channel_b_.get(), ba_, ab_);
+}
+
+void splicer::onReadable(direction *dir)
+{
+  if(closed_)
+    return;
+  if(!pump(dir))
+  {
+    close();
+    return;
+  }
+  after_event();
+}
+
+void splicer::onWritable(direction *dir)
+{
+  if(closed_)
+    return;
+  if(!pump(dir))
+  {
+    close();
+    return;
+  }
+  after_event();
+}
+
+void splicer::onHangup(direction *read_dir, direction *write_dir)
+{
+  if(closed_)
+    return;
+  // the peer is gone, what it sent is already read; data still owed to it can't be delivered
+  if(!write_dir->done)
+  {
+    close();
+    return;
+  }
+  read_dir->eof = true;
+  if(!pump(read_dir))
+  {
+    close();
+    return;
+  }
+  after_event();
+}
+
+void splicer::close()
+{
+  if(closed_)
+    return;
+  closed_ = true;
+  // 可能在channel的事件处理中, 这里只停止关注事件, 从poller中移除放在析构函数里
+  channel_a_->disableAll();
+  channel_b_->disableAll();
+  if(closeCallback_)
+    closeCallback_();
+}
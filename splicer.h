@@ -0,0 +1,96 @@
+#pragma once
+
+#include "metrics.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <memory>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace muduo
+{
+namespace net
+{
+class Channel;
+class EventLoop;
+}
+}
+
+namespace zy
+{
+// 用splice(2)经过一对pipe在两个socket之间双向转发, 数据不进入用户态
+// socket先被dup, 原来的TcpConnection必须已经停止读写, 结束后由调用者关闭它们
+class splicer : boost::noncopyable
+{
+ public:
+  typedef boost::function<void()> CloseCallback;
+
+  // pipe_size is the most bytes held for one direction, like the high water mark of a Buffer
+  splicer(muduo::net::EventLoop* loop, int fd_a, int fd_b, size_t pipe_size);
+
+  ~splicer();
+
+  // false if pipes or channels can't be set up, nothing has been read then
+  bool start();
+
+  // both directions finished or an error happened, called once, don't destroy the splicer in it
+  void setCloseCallback(const CloseCallback& cb) { closeCallback_ = cb; }
+
+  // metrics counters the bytes of each direction are added to as they move, none by default
+  void set_counters(metrics::counter a_to_b, metrics::counter b_to_a)
+  {
+    ab_.counter = a_to_b;
+    ba_.counter = b_to_a;
+  }
+
+  uint64_t bytes_a_to_b() const { return ab_.bytes; }
+
+  uint64_t bytes_b_to_a() const { return ba_.bytes; }
+
+ private:
+  struct direction
+  {
+    int from;
+    int to;
+    int pipe[2];
+    size_t in_pipe;   // bytes in the pipe waiting for to
+    uint64_t bytes;   // bytes written to to
+    metrics::counter counter;  // kCounters if not counted
+    bool eof;         // from has been shut down
+    bool blocked;     // the pipe refused more data, wait until some of it is drained
+    bool done;        // eof and the pipe has been drained, to is shut down for writing
+  };
+
+  static void init_direction(direction* dir, int from, int to);
+
+  // move as much as possible from socket to pipe to socket, return false on error
+  bool pump(direction* dir);
+
+  // keep the channel interest in line with the state of both directions
+  void update(muduo::net::Channel* channel, const direction& read_dir, const direction& write_dir);
+
+  // update channels after an event, close when both directions are done
+  void after_event();
+
+  void onReadable(direction* dir);
+
+  void onWritable(direction* dir);
+
+  // POLLHUP without POLLIN on the socket which is the source of read_dir and destination of write_dir
+  void onHangup(direction* read_dir, direction* write_dir);
+
+  void close();
+
+  muduo::net::EventLoop* loop_;
+  int fd_a_;   // dup of the sockets, owned
+  int fd_b_;
+  size_t pipe_size_;
+  direction ab_;
+  direction ba_;
+  std::unique_ptr<muduo::net::Channel> channel_a_;
+  std::unique_ptr<muduo::net::Channel> channel_b_;
+  CloseCallback closeCallback_;
+  bool closed_;
+};
+}
@@ -0,0 +1,294 @@
+// split and malformed input for http_request, http_response and http_body
+// usage: http_header_test, exits with 1 if any check fails
+
+#include "../http_header.h"
+
+#include <muduo/base/Logging.h>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+using namespace zy;
+
+namespace
+{
+
+int g_failures = 0;
+
+#define CHECK(cond) \
+  do { if(!(cond)) { ++ g_failures; fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } } while(0)
+
+const char kRequest[] =
+    "GET http://www.example.com:8080/index.html?a=1 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Content-Length: 5\r\n"
+    "Accept: */*\r\n"
+    "\r\n"
+    "hello";
+
+const char kProxied[] =
+    "GET /index.html?a=1 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "Connection: Keep-Alive\r\n"
+    "Content-Length: 5\r\n"
+    "Accept: */*\r\n"
+    "\r\n"
+    "hello";
+
+std::string gather(const std::vector<struct iovec>& iov)
+{
+  std::string result;
+  for(const auto& vec : iov)
+    result.append(static_cast<const char*>(vec.iov_base), vec.iov_len);
+  return result;
+}
+
+http_request::parse_result parse_request(const std::string& data)
+{
+  http_request request;
+  return request.parse(data.data(), data.size());
+}
+
+void test_request()
+{
+  std::string data(kRequest);
+  size_t header_length = data.size() - 5;
+  http_request request;
+  CHECK(request.parse(data.data(), data.size()) == http_request::kComplete);
+  CHECK(request.header_length() == header_length);
+  CHECK(request.method() == "GET");
+  CHECK(request.domain_name() == "www.example.com");
+  CHECK(request.port() == 8080);
+  CHECK(request.content_length() == 5);
+  CHECK(!request.has_transfer_encoding());
+  std::vector<struct iovec> iov;
+  request.proxy_request(data.data(), 5, &iov);
+  CHECK(gather(iov) == kProxied);
+  CHECK(request.proxy_request_size() == strlen(kProxied) - 5);
+
+  // a keep-alive connection parses the next request with the same object
+  request.reset();
+  CHECK(request.parse("CONNECT a.com:443 HTTP/1.1\r\n\r\n", 30) == http_request::kComplete);
+  CHECK(request.domain_name() == "a.com");
+  CHECK(request.port() == 443);
+  CHECK(request.content_length() == -1);
+}
+
+// the data grows one byte at a time, every offset is a place where a read can end
+void test_request_resumed()
+{
+  std::string data(kRequest);
+  size_t header_length = data.size() - 5;
+  http_request request;
+  for(size_t len = 1; len < header_length; ++len)
+    CHECK(request.parse(data.data(), len) == http_request::kIncomplete);
+  CHECK(request.parse(data.data(), header_length) == http_request::kComplete);
+  CHECK(request.header_length() == header_length);
+  CHECK(request.content_length() == 5);
+  std::vector<struct iovec> iov;
+  request.proxy_request(data.data(), 5, &iov);
+  CHECK(gather(iov) == kProxied);
+}
+
+// a header name and its CRLF split across two reads
+void test_request_split_header()
+{
+  std::string data(kRequest);
+  size_t split = data.find("Length") + 3;
+  http_request request;
+  CHECK(request.parse(data.data(), split) == http_request::kIncomplete);
+  CHECK(request.parse(data.data(), data.find("\r\nAccept") + 1) == http_request::kIncomplete);
+  CHECK(request.parse(data.data(), data.size()) == http_request::kComplete);
+  CHECK(request.content_length() == 5);
+}
+
+void test_request_framing()
+{
+  http_request request;
+  const char chunked[] = "POST http://a.com/ HTTP/1.1\r\nTransfer-Encoding: gzip, Chunked \r\n\r\n";
+  CHECK(request.parse(chunked, sizeof chunked - 1) == http_request::kComplete);
+  CHECK(request.has_transfer_encoding());
+  CHECK(request.chunked());
+  CHECK(request.content_length() == -1);
+
+  request.reset();
+  const char not_chunked[] = "POST http://a.com/ HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n";
+  CHECK(request.parse(not_chunked, sizeof not_chunked - 1) == http_request::kComplete);
+  CHECK(!request.chunked());
+
+  request.reset();
+  const char same_length[] = "POST http://a.com/ HTTP/1.1\r\nContent-Length: 3\r\ncontent-length: 3\r\n\r\n";
+  CHECK(request.parse(same_length, sizeof same_length - 1) == http_request::kComplete);
+  CHECK(request.content_length() == 3);
+}
+
+void test_request_malformed()
+{
+  const std::string line("GET http://a.com/ HTTP/1.1\r\n");
+  CHECK(parse_request("GET\r\n\r\n") == http_request::kError);
+  CHECK(parse_request("GET http://a.com/\r\n\r\n") == http_request::kError);
+  CHECK(parse_request("GET http://[::1/ HTTP/1.1\r\n\r\n") == http_request::kError);
+  CHECK(parse_request(line + "no colon\r\n\r\n") == http_request::kError);
+  CHECK(parse_request(line + "Empty:\r\n\r\n") == http_request::kError);
+  // 请求体边界有歧义的请求
+  CHECK(parse_request(line + "Content-Length: 10abc\r\n\r\n") == http_request::kError);
+  CHECK(parse_request(line + "Content-Length: -1\r\n\r\n") == http_request::kError);
+  CHECK(parse_request(line + "Content-Length: 99999999999999999999\r\n\r\n") == http_request::kError);
+  CHECK(parse_request(line + "Content-Length: 3\r\nContent-Length: 4\r\n\r\n") == http_request::kError);
+  CHECK(parse_request(line + "Transfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n") == http_request::kError);
+  // too long, even without a line ending
+  std::string big(line + "X-Big: ");
+  big.append(http_request::kMaxHeaderSize, 'x');
+  CHECK(parse_request(big) == http_request::kError);
+}
+
+const char kResponse[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/plain\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+void test_response()
+{
+  std::string data(kResponse);
+  http_response response;
+  for(size_t len = 1; len < data.size(); ++len)
+    CHECK(response.parse(data.data(), len) == http_request::kIncomplete);
+  CHECK(response.parse(data.data(), data.size()) == http_request::kComplete);
+  CHECK(response.header_length() == data.size());
+  CHECK(response.status() == 200);
+  CHECK(response.chunked());
+  CHECK(response.keep_alive());
+  CHECK(response.content_length() == -1);
+
+  response.reset();
+  const char http10[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 12\r\n\r\n";
+  CHECK(response.parse(http10, sizeof http10 - 1) == http_request::kComplete);
+  CHECK(response.status() == 404);
+  CHECK(!response.keep_alive());
+  CHECK(response.content_length() == 12);
+
+  const char* malformed[] = {
+    "HTTP/2.0 200 OK\r\n\r\n",
+    "HTTP/1.1 20 OK\r\n\r\n",
+    "HTTP/1.1 200OK\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nno colon\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: 1x\r\n\r\n",
+    "HTTP/1.1 200 OK\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+  };
+  for(const char* m : malformed)
+  {
+    response.reset();
+    CHECK(response.parse(m, strlen(m)) == http_request::kError);
+  }
+}
+
+// chunked body with extensions and trailers, followed by the next request
+const char kChunked[] =
+    "5;name=value\r\n"
+    "hello\r\n"
+    "1A \r\n"
+    "abcdefghijklmnopqrstuvwxyz\r\n"
+    "0\r\n"
+    "Expires: never\r\n"
+    "X-Trailer: 1\r\n"
+    "\r\n";
+
+void test_body_chunked()
+{
+  std::string data(kChunked);
+  data.append("GET ");
+  http_body body;
+  body.start_chunked();
+  size_t consumed = 0;
+  CHECK(body.consume(data.data(), data.size(), &consumed) == http_body::kDone);
+  CHECK(consumed == sizeof kChunked - 1);
+  CHECK(body.done());
+
+  // one byte per read
+  body.start_chunked();
+  size_t total = 0;
+  http_body::result result = http_body::kNeedMore;
+  for(size_t i = 0; i < data.size() && result == http_body::kNeedMore; ++i)
+  {
+    result = body.consume(data.data() + i, 1, &consumed);
+    total += consumed;
+  }
+  CHECK(result == http_body::kDone);
+  CHECK(total == sizeof kChunked - 1);
+
+  // every split into two reads
+  for(size_t split = 0; split <= sizeof kChunked - 1; ++split)
+  {
+    body.start_chunked();
+    size_t first = 0;
+    size_t second = 0;
+    result = body.consume(data.data(), split, &first);
+    if(result == http_body::kNeedMore)
+      result = body.consume(data.data() + split, data.size() - split, &second);
+    CHECK(result == http_body::kDone);
+    CHECK(first + second == sizeof kChunked - 1);
+  }
+}
+
+http_body::result consume_chunked(const std::string& data)
+{
+  http_body body;
+  body.start_chunked();
+  size_t consumed = 0;
+  return body.consume(data.data(), data.size(), &consumed);
+}
+
+void test_body_malformed()
+{
+  CHECK(consume_chunked("10000000000000000\r\n") == http_body::kError);  // 2^64 overflows
+  CHECK(consume_chunked("fffffffffffffff\r\n") == http_body::kNeedMore);
+  CHECK(consume_chunked("\r\n") == http_body::kError);
+  CHECK(consume_chunked("5x\r\n") == http_body::kError);
+  CHECK(consume_chunked("5\r\nhelloX\r\n") == http_body::kError);
+  CHECK(consume_chunked("5\rhello\r\n") == http_body::kError);
+  CHECK(consume_chunked("0\r\n\rX") == http_body::kError);
+  std::string long_ext("1;");
+  long_ext.append(8192, 'x');
+  CHECK(consume_chunked(long_ext) == http_body::kError);
+}
+
+void test_body_length()
+{
+  http_body body;
+  size_t consumed = 0;
+  body.start_length(0);
+  CHECK(body.done());
+  body.start_length(10);
+  CHECK(body.consume("12345", 5, &consumed) == http_body::kNeedMore);
+  CHECK(consumed == 5);
+  CHECK(body.consume("67890GET", 8, &consumed) == http_body::kDone);
+  CHECK(consumed == 5);
+}
+
+}
+
+int main()
+{
+  muduo::Logger::setLogLevel(muduo::Logger::FATAL);
+  test_request();
+  test_request_resumed();
+  test_request_split_header();
+  test_request_framing();
+  test_request_malformed();
+  test_response();
+  test_body_chunked();
+  test_body_malformed();
+  test_body_length();
+  if(g_failures > 0)
+  {
+    printf("%d checks failed\n", g_failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -1,27 +1,230 @@
 #include "tunnel.h"
+#include "metrics.h"
 
 #include <muduo/net/EventLoop.h>
+#include <muduo/net/SocketsOps.h>
 #include <muduo/base/Logging.h>
 #include <boost/bind.hpp>
+#include <sys/uio.h>
 
 using namespace zy;
 
+namespace impl
+{
+
+void removeConnection(muduo::net::EventLoop* loop, const muduo::net::TcpConnectionPtr& con)
+{
+  loop->queueInLoop(boost::bind(&muduo::net::TcpConnection::connectDestroyed, con));
+}
+
+void removeEyeballs(const boost::shared_ptr<zy::happy_eyeballs>&)
+{
+}
+
+}
+
 Tunnel::Tunnel(muduo::net::EventLoop *loop,
-               const muduo::net::InetAddress &addr,
+               const std::vector<muduo::net::InetAddress> &addrs,
                const Tunnel::TcpConnectionPtr &serverCon,
                const onTransportCallback& cb,
                bool https)
   : loop_(loop),
-    client_(loop_, addr, "proxy_client"),
+    eyeballs_(new happy_eyeballs(loop_, addrs)),
     serverCon_(serverCon),
+    connection_(),
+    clientCon_(),
+    sockfd_(-1),
     onTransportCallback_(cb),
+    onResponseCallback_(),
+    onCloseCallback_(),
+    onResumeReadCallback_(),
     timerId_(),
-    host_addr_(addr.toIpPort()),
+    host_addr_(addrs.front().toIpPort()),
     timeout_(3), // default timeout is 3 seconds
     https_(https),
-    request_()
+    response_(),
+    response_body_(),
+    response_state_(https ? kResponseUntilClose : kResponseHeader),
+    pending_(),
+    current_(),
+    last_receive_(0),
+    undelivered_(0),
+    keep_alive_(!https),
+    active_(true),
+    closed_(false),
+    splicer_()
+{
+  metrics::add(metrics::kTunnelsActive, 1);
+}
+
+Tunnel::~Tunnel()
+{
+  metrics::add(metrics::kTunnelsActive, -1);
+  eyeballs_->stop();
+  // 可能正处于eyeballs_的回调中, 和TcpClient释放Connector一样延迟释放
+  loop_->runAfter(1, boost::bind(&impl::removeEyeballs, eyeballs_));
+  // callbacks of connection_ are bound to weak_ptr, it is destroyed after closed
+  if(connection_)
+    connection_->forceClose();
+}
+
+void Tunnel::connect()
+{
+  eyeballs_->start();
+}
+
+void Tunnel::attach(const TcpConnectionPtr &con, int sockfd)
+{
+  loop_->assertInLoopThread();
+  boost::weak_ptr<Tunnel> wkTunnel(shared_from_this());
+  con->setConnectionCallback(boost::bind(&Tunnel::onConnectionWeak, wkTunnel, _1));
+  con->setMessageCallback(boost::bind(&Tunnel::onMessageWeak, wkTunnel, _1, _2, _3));
+  connection_ = con;
+  sockfd_ = sockfd;
+  // already connected, go on as if the connector had just succeeded
+  onConnection(con);
+}
+
+Tunnel::TcpConnectionPtr Tunnel::detach(int *sockfd)
+{
+  TcpConnectionPtr con;
+  con.swap(connection_);
+  *sockfd = sockfd_;
+  sockfd_ = -1;
+  clientCon_.reset();
+  return con;
+}
+
+void Tunnel::request_sent(bool head)
+{
+  pending_.push_back(pending_request{head, metrics::now()});
+}
+
+bool Tunnel::reusable() const
+{
+  return available() && pending_.empty() && response_state_ == kResponseHeader
+      && connection_->inputBuffer()->readableBytes() == 0
+      && connection_->outputBuffer()->readableBytes() == 0;
+}
+
+bool Tunnel::available() const
+{
+  return keep_alive_ && !closed_ && clientCon_ && clientCon_->connected();
+}
+
+void Tunnel::set_active(bool active)
+{
+  if(active_ == active)
+    return;
+  active_ = active;
+  if(active)
+  {
+    // the client connection is shared by several tunnels, backpressure follows the one writing to it
+    serverCon_->setHighWaterMarkCallback(
+        boost::bind(&Tunnel::onHighWaterMarkWeak, boost::weak_ptr<Tunnel>(shared_from_this()), kServer, _1, _2), kHighWaterMark);
+    // 不在当前回调中直接写, 避免打乱正在进行的转发
+    if(connection_)
+      loop_->queueInLoop(boost::bind(&Tunnel::resumeWeak, boost::weak_ptr<Tunnel>(shared_from_this())));
+  }
+}
+
+void Tunnel::resume()
+{
+  if(!active_ || !connection_)
+    return;
+  deliver(connection_->inputBuffer());
+  if(closed_)
+    on_closed();
+  else if(active_ && serverCon_->outputBuffer()->readableBytes() < kHighWaterMark)
+    connection_->startRead();
+}
+
+void Tunnel::newConnection(int sockfd)
+{
+  loop_->assertInLoopThread();
+  muduo::net::InetAddress peerAddr(muduo::net::sockets::getPeerAddr(sockfd));
+  muduo::net::InetAddress localAddr(muduo::net::sockets::getLocalAddr(sockfd));
+  // the address that won the race
+  host_addr_ = peerAddr.toIpPort();
+  muduo::string name = "proxy_client-" + host_addr_;
+  TcpConnectionPtr con(new muduo::net::TcpConnection(loop_, name, sockfd, localAddr, peerAddr));
+  boost::weak_ptr<Tunnel> wkTunnel(shared_from_this());
+  con->setConnectionCallback(boost::bind(&Tunnel::onConnectionWeak, wkTunnel, _1));
+  con->setMessageCallback(boost::bind(&Tunnel::onMessageWeak, wkTunnel, _1, _2, _3));
+  con->setCloseCallback(boost::bind(&impl::removeConnection, loop_, _1));
+  connection_ = con;
+  sockfd_ = sockfd;
+  con->connectEstablished();
+}
+
+bool Tunnel::start_splice(int server_fd)
 {
+  if(!https_ || !connection_ || sockfd_ < 0 || server_fd < 0 || splicer_)
+    return false;
+  // 用户态缓冲中的数据必须先发完, 否则会乱序
+  if(serverCon_->inputBuffer()->readableBytes() > 0 || serverCon_->outputBuffer()->readableBytes() > 0
+     || connection_->inputBuffer()->readableBytes() > 0 || connection_->outputBuffer()->readableBytes() > 0)
+    return false;
+  serverCon_->stopRead();
+  connection_->stopRead();
+  std::unique_ptr<splicer> s(new splicer(loop_, server_fd, sockfd_, kHighWaterMark));
+  s->set_counters(metrics::kBytesClientToUpstream, metrics::kBytesUpstreamToClient);
+  if(!s->start())
+  {
+    serverCon_->startRead();
+    connection_->startRead();
+    return false;
+  }
+  s->setCloseCallback(boost::bind(&Tunnel::onSpliceCloseWeak, boost::weak_ptr<Tunnel>(shared_from_this())));
+  splicer_ = std::move(s);
+  // backpressure is done by the pipes now, Buffer callbacks must not start reading again
+  serverCon_->setHighWaterMarkCallback(muduo::net::HighWaterMarkCallback(), kHighWaterMark);
+  serverCon_->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
+  connection_->setHighWaterMarkCallback(muduo::net::HighWaterMarkCallback(), kHighWaterMark);
+  connection_->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
+  LOG_DEBUG << "splice " << serverCon_->name() << " <-> " << host_addr_;
+  return true;
+}
 
+void Tunnel::onSpliceClose()
+{
+  LOG_DEBUG << "splice finished " << host_addr_ << " up " << splicer_->bytes_a_to_b()
+            << " down " << splicer_->bytes_b_to_a();
+  // muduo never saw the sockets close, close both TcpConnections, splicer_ is destroyed with the tunnel
+  serverCon_->forceClose();
+  if(connection_)
+    connection_->forceClose();
+}
+
+void Tunnel::send(const std::vector<struct iovec> &iov)
+{
+  if(!clientCon_ || !clientCon_->connected())
+    return;
+  ssize_t n = 0;
+  // 输出缓冲为空说明没有等待写出的数据, 可以直接写socket而不打乱顺序
+  if(clientCon_->outputBuffer()->readableBytes() == 0)
+  {
+    n = ::writev(sockfd_, iov.data(), static_cast<int>(iov.size()));
+    if(n < 0)
+    {
+      if(errno != EWOULDBLOCK)
+        LOG_SYSERR << "Tunnel::send to " << host_addr_;
+      // TcpConnection::send will report the error again
+      n = 0;
+    }
+  }
+  size_t written = static_cast<size_t>(n);
+  for(const auto& vec : iov)
+  {
+    metrics::add(metrics::kBytesClientToUpstream, static_cast<int64_t>(vec.iov_len));
+    if(written >= vec.iov_len)
+    {
+      written -= vec.iov_len;
+      continue;
+    }
+    clientCon_->send(static_cast<const char*>(vec.iov_base) + written, static_cast<int>(vec.iov_len - written));
+    written = 0;
+  }
 }
 
 void Tunnel::onConnection(const Tunnel::TcpConnectionPtr &con) {
@@ -35,63 +238,208 @@ void Tunnel::onConnection(const Tunnel::TcpConnectionPtr &con) {
       timerId_.reset();
     }
     con->setTcpNoDelay(true);
-    con->setHighWaterMarkCallback(boost::bind(&Tunnel::onHighWaterMarkWeak, boost::weak_ptr<Tunnel>(shared_from_this()), kClient, _1, _2), 1024 * 1024);
-    serverCon_->setContext(con);
+    con->setHighWaterMarkCallback(boost::bind(&Tunnel::onHighWaterMarkWeak, boost::weak_ptr<Tunnel>(shared_from_this()), kClient, _1, _2), kHighWaterMark);
     clientCon_ = con;
     // 是否是https代理
     if(https_)
     {
       onHttpsConnection();
     }
-    else
-    {
-      if(!request_.empty())
-        con->send(request_.c_str());
-    }
+    // the pending request is forwarded by the callback
     onTransportCallback_();
-    serverCon_->startRead();
+    // the sockets belong to splicer_ if the callback has switched to splice
+    if(!splicer_)
+      resume_client_read();
   }
   else
   {
-    teardown();
+    sockfd_ = -1;
+    closed_ = true;
+    // an inactive tunnel still has responses to deliver from connection_'s input buffer
+    if(active_)
+      on_closed();
   }
 }
 
+void Tunnel::on_closed()
+{
+  // responses still owed can't be finished any more, the client has to see a close
+  bool broken = !pending_.empty() || response_state_ != kResponseHeader
+      || (connection_ && connection_->inputBuffer()->readableBytes() > 0);
+  // a response without framing is complete now, the client still needs the close to see its end
+  if(response_state_ == kResponseUntilClose && current_.close_delimited && !pending_.empty() && connection_)
+    finish_response(connection_->inputBuffer());
+  connection_.reset();
+  clientCon_.reset();
+  if(broken)
+    teardown();
+  if(onCloseCallback_)
+    onCloseCallback_();
+}
+
 void Tunnel::setup()
 {
-  client_.setConnectionCallback(boost::bind(&Tunnel::onConnection, this, _1));
-  client_.setMessageCallback(boost::bind(&Tunnel::onMessage, this, _1, _2, _3));
+  eyeballs_->setNewConnectionCallback(boost::bind(&Tunnel::newConnection, this, _1));
+  eyeballs_->setErrorCallback(boost::bind(&Tunnel::onConnectError, this));
   serverCon_->setHighWaterMarkCallback(
-      boost::bind(&Tunnel::onHighWaterMarkWeak, boost::weak_ptr<Tunnel>(shared_from_this()), kServer, _1, _2), 1024 * 1024);
+      boost::bind(&Tunnel::onHighWaterMarkWeak, boost::weak_ptr<Tunnel>(shared_from_this()), kServer, _1, _2), kHighWaterMark);
   auto timer = loop_->runAfter(timeout_, boost::bind(&Tunnel::onTimeoutWeak, boost::weak_ptr<Tunnel>(shared_from_this())));
   timerId_.reset(new muduo::net::TimerId(timer));
 }
 
 void Tunnel::teardown()
 {
-  client_.setConnectionCallback(muduo::net::defaultConnectionCallback);
-  client_.setMessageCallback(muduo::net::defaultMessageCallback);
   if(serverCon_)
   {
-    serverCon_->setContext(boost::any());
     if(serverCon_->connected())
         serverCon_->shutdown();
   }
   clientCon_.reset();
 }
 
-// forward to proxy client directly
+// forward to proxy client directly, http responses are framed on the way so the connection can be reused
 void Tunnel::onMessage(const Tunnel::TcpConnectionPtr &con, muduo::net::Buffer *buf, muduo::Timestamp)
 {
   LOG_DEBUG << "message from " << host_addr_ << " " << buf->readableBytes();
-  if(serverCon_){
-    serverCon_->send(buf);
-    buf->retrieveAll();
+  last_receive_ = metrics::now();
+  if(current_.first_byte == 0)
+    current_.first_byte = last_receive_;
+  if(!serverCon_)
+  {
+    teardown();
+    return;
+  }
+  if(!active_)
+  {
+    // 前面还有别的服务器的响应没有发完
+    if(buf->readableBytes() >= kHighWaterMark)
+      con->stopRead();
+    return;
+  }
+  deliver(buf);
+}
+
+void Tunnel::deliver(muduo::net::Buffer *buf)
+{
+  while(active_ && undelivered_ < buf->readableBytes())
+  {
+    const char* data = buf->peek() + undelivered_;
+    size_t len = buf->readableBytes() - undelivered_;
+    if(response_state_ == kResponseUntilClose)
+    {
+      undelivered_ += len;
+      current_.body_bytes += len;
+    }
+    else if(response_state_ == kResponseHeader)
+    {
+      // 不完整的响应头留在buf里, 等下次数据到达时继续解析
+      auto result = response_.parse(data, len);
+      if(result == http_request::kIncomplete)
+        break;
+      if(result == http_request::kError)
+      {
+        LOG_ERROR << "bad response header from " << host_addr_;
+        keep_alive_ = false;
+        response_state_ = kResponseUntilClose;
+        continue;
+      }
+      undelivered_ += response_.header_length();
+      current_.header_bytes += response_.header_length();
+      start_response_body(buf);
+    }
+    else
+    {
+      size_t consumed = 0;
+      auto result = response_body_.consume(data, len, &consumed);
+      undelivered_ += consumed;
+      current_.body_bytes += consumed;
+      if(result == http_body::kError)
+      {
+        LOG_ERROR << "bad chunked response from " << host_addr_;
+        keep_alive_ = false;
+        response_state_ = kResponseUntilClose;
+      }
+      else if(result == http_body::kDone)
+      {
+        finish_response(buf);
+      }
+    }
+  }
+  flush(buf);
+}
+
+void Tunnel::flush(muduo::net::Buffer *buf)
+{
+  if(undelivered_ == 0)
+    return;
+  metrics::add(metrics::kBytesUpstreamToClient, static_cast<int64_t>(undelivered_));
+  serverCon_->send(buf->peek(), static_cast<int>(undelivered_));
+  buf->retrieve(undelivered_);
+  undelivered_ = 0;
+}
+
+void Tunnel::start_response_body(muduo::net::Buffer *buf)
+{
+  int status = response_.status();
+  bool head = !pending_.empty() && pending_.front().head;
+  if(!response_.keep_alive())
+    keep_alive_ = false;
+  if(status == 101)
+  {
+    // upgraded (e.g. websocket), no more http on this connection
+    keep_alive_ = false;
+    current_.close_delimited = true;
+    response_state_ = kResponseUntilClose;
+    return;
+  }
+  if(status < 200)
+  {
+    // interim response, the final one follows for the same request
+    response_.reset();
+    return;
   }
+  if(head || status == 204 || status == 304)
+    response_body_.start_length(0);
+  else if(response_.chunked())
+    response_body_.start_chunked();
+  else if(response_.content_length() >= 0)
+    response_body_.start_length(static_cast<size_t>(response_.content_length()));
   else
   {
-    teardown();
+    // body ends when the server closes the connection
+    keep_alive_ = false;
+    current_.close_delimited = true;
+    response_state_ = kResponseUntilClose;
+    return;
   }
+  response_state_ = kResponseBody;
+  if(response_body_.done())
+    finish_response(buf);
+}
+
+void Tunnel::finish_response(muduo::net::Buffer *buf)
+{
+  // the response must reach the client before the owner lets another tunnel write
+  flush(buf);
+  response_event event = current_;
+  event.status = response_.status();
+  event.keep_alive = keep_alive_;
+  event.done = metrics::now();
+  // a response nobody asked for (e.g. 408 before closing) is not counted
+  bool requested = !pending_.empty();
+  if(requested)
+  {
+    event.sent = pending_.front().sent;
+    pending_.pop_front();
+  }
+  response_.reset();
+  response_state_ = kResponseHeader;
+  current_ = response_event();
+  // the next response has already started arriving
+  if(buf->readableBytes() > 0)
+    current_.first_byte = last_receive_;
+  if(requested && onResponseCallback_)
+    onResponseCallback_(event);
 }
 
 void Tunnel::onHighWaterMark(Tunnel::ServerClient which, const Tunnel::TcpConnectionPtr &con, size_t bytes_to_sent)
@@ -100,8 +448,9 @@ void Tunnel::onHighWaterMark(Tunnel::ServerClient which, const Tunnel::TcpConnec
            << " onHighWaterMark " << con->name() << " bytes " << bytes_to_sent;
   if(which == kServer)
   {
-    if(serverCon_->outputBuffer()->readableBytes() > 0)
+    if(clientCon_ && serverCon_->outputBuffer()->readableBytes() > 0)
     {
+      metrics::add(metrics::kStallsClient);
       clientCon_->stopRead();
       serverCon_->setWriteCompleteCallback(boost::bind(&Tunnel::onWriteCompleteWeak,
       boost::weak_ptr<Tunnel>(shared_from_this()), kServer, _1));
@@ -109,8 +458,9 @@ void Tunnel::onHighWaterMark(Tunnel::ServerClient which, const Tunnel::TcpConnec
   }
   else
   {
-    if(clientCon_->outputBuffer()->readableBytes() > 0)
+    if(clientCon_ && clientCon_->outputBuffer()->readableBytes() > 0)
     {
+      metrics::add(metrics::kStallsUpstream);
       serverCon_->stopRead();
       clientCon_->setWriteCompleteCallback(boost::bind(&Tunnel::onWriteCompleteWeak,
       boost::weak_ptr<Tunnel>(shared_from_this()), kClient, _1));
@@ -130,28 +480,75 @@ void Tunnel::onWriteComplete(Tunnel::ServerClient which, const Tunnel::TcpConnec
            << " onWriteComplete " << con->name();
   if(which == kServer)
   {
-    clientCon_->startRead();
+    if(clientCon_)
+      clientCon_->startRead();
     serverCon_->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
   }
   else
   {
-    serverCon_->startRead();
-    clientCon_->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
+    resume_client_read();
+    if(clientCon_)
+      clientCon_->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
   }
 }
 
+void Tunnel::resume_client_read()
+{
+  if(onResumeReadCallback_)
+    onResumeReadCallback_();
+  else
+    serverCon_->startRead();
+}
+
 void Tunnel::onTimeout()
 {
   LOG_ERROR << "connect to " << host_addr_ << " timeout!";
   if(serverCon_)
   {
     static muduo::string response("HTTP/1.1 504 Gateway Timeout\r\nProxy-Agent: zy_https/0.1\r\n\r\n");
+    metrics::add(metrics::kResponses504);
+    serverCon_->send(response.c_str());
+    eyeballs_->stop();
+    teardown();
+  }
+}
+
+void Tunnel::onConnectError()
+{
+  LOG_ERROR << "can't connect to any of " << eyeballs_->addresses() << " addresses of " << host_addr_;
+  if(timerId_)
+  {
+    loop_->cancel(*timerId_);
+    timerId_.reset();
+  }
+  if(serverCon_)
+  {
+    static muduo::string response("HTTP/1.1 502 Bad Gateway\r\nProxy-Agent: zy_https/0.1\r\n\r\n");
+    metrics::add(metrics::kResponses502);
     serverCon_->send(response.c_str());
-    client_.stop();
     teardown();
   }
 }
 
+void Tunnel::onConnectionWeak(const boost::weak_ptr<Tunnel> &wkTunnel, const Tunnel::TcpConnectionPtr &con)
+{
+  auto tunnel = wkTunnel.lock();
+  if(tunnel)
+    tunnel->onConnection(con);
+}
+
+void Tunnel::onMessageWeak(const boost::weak_ptr<Tunnel> &wkTunnel,
+                           const Tunnel::TcpConnectionPtr &con,
+                           muduo::net::Buffer *buf,
+                           muduo::Timestamp time)
+{
+  auto tunnel = wkTunnel.lock();
+  if(tunnel)
+    tunnel->onMessage(con, buf, time);
+  else
+    buf->retrieveAll();
+}
+
 void Tunnel::onHighWaterMarkWeak(const boost::weak_ptr<Tunnel> &wkTunnel,
                                  Tunnel::ServerClient which,
                                  const Tunnel::TcpConnectionPtr &con,
@@ -177,3 +574,17 @@ void Tunnel::onTimeoutWeak(const boost::weak_ptr<Tunnel> &wkTunnel)
   if(tunnel)
     tunnel->onTimeout();
 }
+
+void Tunnel::onSpliceCloseWeak(const boost::weak_ptr<Tunnel> &wkTunnel)
+{
+  auto tunnel = wkTunnel.lock();
+  if(tunnel)
+    tunnel->onSpliceClose();
+}
+
+void Tunnel::resumeWeak(const boost::weak_ptr<Tunnel> &wkTunnel)
+{
+  auto tunnel = wkTunnel.lock();
+  if(tunnel)
+    tunnel->resume();
+}
@@ -1,10 +1,25 @@
 #pragma once
 
-#include <muduo/net/TcpClient.h>
+#include <muduo/net/TcpConnection.h>
 #include <boost/noncopyable.hpp>
 #include <boost/enable_shared_from_this.hpp>
-#include <muduo/net/TcpClient.h>
 #include <muduo/net/TimerId.h>
+#include <deque>
+#include <vector>
+
+#include "http_header.h"
+#include "splicer.h"
+#include "happy_eyeballs.h"
+
+struct iovec;
+
+namespace muduo
+{
+namespace net
+{
+class EventLoop;
+}
+}
 
 namespace zy
 {
@@ -14,17 +29,76 @@ class Tunnel : boost::noncopyable, public boost::enable_shared_from_this<Tunnel>
  public:
   typedef muduo::net::TcpConnectionPtr TcpConnectionPtr;
   typedef boost::function<void()> onTransportCallback;
+  // 一个http响应结束时的统计, 用于连接复用判断和计数
+  struct response_event
+  {
+    int status;
+    bool keep_alive;        // the connection takes more requests after this response
+    bool close_delimited;   // ended by the server closing the connection
+    uint64_t header_bytes;  // status line and headers, interim responses included
+    uint64_t body_bytes;
+    // microseconds on the monotonic clock of metrics::now(), 0 if it hasn't happened
+    int64_t sent;           // request written to the server
+    int64_t first_byte;     // first byte of the response received
+    int64_t done;           // last byte handed to the client
+  };
+  typedef boost::function<void(const response_event&)> onResponseCallback;
+  typedef boost::function<void()> onCloseCallback;
+  typedef boost::function<void()> onResumeReadCallback;
+
+  const static size_t kHighWaterMark = 1024 * 1024;
 
-  Tunnel(muduo::net::EventLoop* loop, const muduo::net::InetAddress& addr,
+  // addrs are all the addresses of the remote server, connect() races them
+  Tunnel(muduo::net::EventLoop* loop, const std::vector<muduo::net::InetAddress>& addrs,
          const TcpConnectionPtr& serverCon, const onTransportCallback& cb, bool https = false);
 
-  void set_request(const std::string & request) { request_ = request; }
+  ~Tunnel();
 
   void set_timeout(double timeout) { timeout_ = timeout; }
 
+  // called after every complete http response has been passed to the client
+  void setResponseCallback(const onResponseCallback& cb) { onResponseCallback_ = cb; }
+
+  // called once the remote server has closed and everything it sent is delivered
+  void setCloseCallback(const onCloseCallback& cb) { onCloseCallback_ = cb; }
+
+  // 客户端连接由多个tunnel和proxy_server共同暂停读取, 恢复时交给owner判断, 不直接startRead()
+  void setResumeReadCallback(const onResumeReadCallback& cb) { onResumeReadCallback_ = cb; }
+
   void setup();
 
-  void connect() { client_.connect(); }
+  void connect();
+
+  // use an idle connection from upstream_pool instead of connect(), call after setup()
+  void attach(const TcpConnectionPtr& con, int sockfd);
+
+  // 把到远程服务器的连接交出去(放回upstream_pool), 之后tunnel不再使用它
+  TcpConnectionPtr detach(int* sockfd);
+
+  // a request has been forwarded, its response is expected in order
+  void request_sent(bool head);
+
+  // connected, keep-alive, every response finished and nothing buffered in either direction
+  bool reusable() const;
+
+  // connected and more requests can be sent to it
+  bool available() const;
+
+  // responses requested but not finished yet
+  size_t pending() const { return pending_.size(); }
+
+  // 一个客户端连接可能同时有多个tunnel, 只有轮到的那个才能向客户端写响应, 其余的数据先留在输入缓冲里
+  void set_active(bool active);
+
+  // connection to the remote server, empty before connected or after teardown
+  const TcpConnectionPtr& clientCon() const { return clientCon_; }
+
+  // CONNECT隧道建立后改用splice(2)转发, server_fd是客户端连接的socket
+  // return false if there is still data buffered in user space, forwarding goes on through Buffers then
+  bool start_splice(int server_fd);
+
+  // 发送到远程服务器, 输出缓冲为空时直接writev到socket, 写不完的部分才拷贝进TcpConnection的输出缓冲
+  void send(const std::vector<struct iovec>& iov);
 
   void onConnection(const TcpConnectionPtr& con);
 
@@ -37,14 +111,37 @@ class Tunnel : boost::noncopyable, public boost::enable_shared_from_this<Tunnel>
     kClient
   };
 
+  // called by eyeballs_ with a connected socket
+  void newConnection(int sockfd);
+
+  // eyeballs_ failed on every address
+  void onConnectError();
+
   void teardown();
 
+  // frame and pass the responses in buf to the client while active
+  void deliver(muduo::net::Buffer* buf);
+
+  // send the framed bytes at the front of buf
+  void flush(muduo::net::Buffer* buf);
+
+  // activated, deliver what was held back
+  void resume();
+
+  // the remote server has closed and nothing is held back any more
+  void on_closed();
+
   void onHighWaterMark(ServerClient which, const TcpConnectionPtr& con, size_t bytes_to_sent);
 
   void onWriteComplete(ServerClient which, const TcpConnectionPtr& con);
 
   void onTimeout();
 
+  static void onConnectionWeak(const boost::weak_ptr<Tunnel>& wkTunnel, const TcpConnectionPtr& con);
+
+  static void onMessageWeak(const boost::weak_ptr<Tunnel>& wkTunnel, const TcpConnectionPtr& con,
+                            muduo::net::Buffer* buf, muduo::Timestamp time);
+
   static void onHighWaterMarkWeak(const boost::weak_ptr<Tunnel>& wkTunnel, ServerClient which,
                                   const TcpConnectionPtr& con, size_t bytes_to_sent);
 
@@ -53,18 +150,66 @@ class Tunnel : boost::noncopyable, public boost::enable_shared_from_this<Tunnel>
 
   static void onTimeoutWeak(const boost::weak_ptr<Tunnel>& wkTunnel);
 
+  static void resumeWeak(const boost::weak_ptr<Tunnel>& wkTunnel);
+
+  static void onSpliceCloseWeak(const boost::weak_ptr<Tunnel>& wkTunnel);
+
+  // both directions of the spliced tunnel are finished
+  void onSpliceClose();
+
   void onHttpsConnection();
 
+  // reading the client connection may go on as far as this tunnel is concerned
+  void resume_client_read();
+
+  // status line and headers parsed, decide how the body ends
+  void start_response_body(muduo::net::Buffer* buf);
+
+  // the response at the front of pending_ is complete, buf is flushed before the callback runs
+  void finish_response(muduo::net::Buffer* buf);
+
+  struct pending_request
+  {
+    bool head;
+    int64_t sent;  // metrics::now()
+  };
+
+  enum ResponseState
+  {
+    kResponseHeader,     // waiting for the next status line
+    kResponseBody,       // framed by response_body_
+    kResponseUntilClose  // no framing, or an upgraded connection, forward until the server closes
+  };
+
+  typedef boost::shared_ptr<happy_eyeballs> EyeballsPtr;
+
   muduo::net::EventLoop* loop_;
-  muduo::net::TcpClient client_;
+  EyeballsPtr eyeballs_;
   TcpConnectionPtr serverCon_;
+  // owns the connection to the remote server until it is closed, like TcpClient::connection_
+  TcpConnectionPtr connection_;
   TcpConnectionPtr clientCon_;
+  int sockfd_;   // fd of connection_, only valid while connection_ is alive
   onTransportCallback onTransportCallback_;
+  onResponseCallback onResponseCallback_;
+  onCloseCallback onCloseCallback_;
+  onResumeReadCallback onResumeReadCallback_;
   std::unique_ptr<muduo::net::TimerId> timerId_;
   muduo::string host_addr_;
   double timeout_;
   bool https_;
-  std::string request_;
+  // 只为确定http响应的边界, 响应数据原样转发
+  http_response response_;
+  http_body response_body_;
+  ResponseState response_state_;
+  std::deque<pending_request> pending_;  // requests waiting for their responses
+  response_event current_;  // accounting of the response being delivered
+  int64_t last_receive_;  // metrics::now() of the last read from the server
+  size_t undelivered_;  // bytes at the front of the input buffer already framed, not sent yet
+  bool keep_alive_;
+  bool active_;
+  bool closed_;  // closed by the remote server, connection_ is kept until its input is delivered
+  std::unique_ptr<splicer> splicer_;  // only for https tunnels in splice mode
 };
 typedef boost::shared_ptr<Tunnel> TunnelPtr;
-}
\ No newline at end of file
+}
@@ -0,0 +1,174 @@
+#include "upstream_pool.h"
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/base/Logging.h>
+#include <boost/bind.hpp>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+using namespace zy;
+
+upstream_pool::upstream_pool(muduo::net::EventLoop *loop, size_t max_idle, double idle_timeout)
+  : loop_(loop),
+    sweep_timer_(),
+    max_idle_(max_idle),
+    idle_timeout_(idle_timeout),
+    idle_(),
+    idle_count_(0)
+{
+  // 每秒检查一次即可, 超时精度不需要更高
+  sweep_timer_ = loop_->runEvery(1.0, boost::bind(&upstream_pool::onSweep, this));
+}
+
+upstream_pool::~upstream_pool()
+{
+  loop_->cancel(sweep_timer_);
+  for(auto& item : idle_)
+  {
+    for(auto& idle : item.second)
+      idle.con->forceClose();
+  }
+}
+
+std::string upstream_pool::key_of(const muduo::net::InetAddress &addr)
+{
+  // family + port + raw address, connections to the same ip:port share a key
+  const struct sockaddr* sa = addr.getSockAddr();
+  std::string key(1, static_cast<char>(sa->sa_family));
+  uint16_t port = addr.portNetEndian();
+  key.append(reinterpret_cast<const char*>(&port), sizeof(port));
+  if(sa->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6* sin6 = reinterpret_cast<const struct sockaddr_in6*>(sa);
+    key.append(reinterpret_cast<const char*>(&sin6->sin6_addr), sizeof(sin6->sin6_addr));
+  }
+  else
+  {
+    uint32_t ip = addr.ipNetEndian();
+    key.append(reinterpret_cast<const char*>(&ip), sizeof(ip));
+  }
+  return key;
+}
+
+bool upstream_pool::healthy(const idle_connection &idle)
+{
+  if(!idle.con->connected() || idle.con->inputBuffer()->readableBytes() > 0)
+    return false;
+  // FIN or data may have arrived after the last poll, peek the socket before reusing it
+  char ch;
+  ssize_t n = ::recv(idle.sockfd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+bool upstream_pool::acquire(const muduo::net::InetAddress &addr, TcpConnectionPtr *con, int *sockfd)
+{
+  loop_->assertInLoopThread();
+  auto it = idle_.find(key_of(addr));
+  if(it != idle_.end())
+  {
+    idle_list& list = it->second;
+    while(!list.empty())
+    {
+      idle_connection idle = list.back();
+      list.pop_back();
+      -- idle_count_;
+      if(healthy(idle))
+      {
+        if(list.empty())
+          idle_.erase(it);
+        *con = idle.con;
+        *sockfd = idle.sockfd;
+        LOG_DEBUG << "reuse " << idle.con->name() << " to " << addr.toIpPort();
+        return true;
+      }
+      LOG_DEBUG << "drop broken idle connection " << idle.con->name();
+      idle.con->forceClose();
+    }
+    idle_.erase(it);
+  }
+  return false;
+}
+
+void upstream_pool::release(const TcpConnectionPtr &con, int sockfd)
+{
+  loop_->assertInLoopThread();
+  if(max_idle_ == 0 || !con->connected())
+  {
+    con->forceClose();
+    return;
+  }
+  con->setConnectionCallback(boost::bind(&upstream_pool::onIdleConnection, this, _1));
+  con->setMessageCallback(boost::bind(&upstream_pool::onIdleMessage, this, _1, _2, _3));
+  con->setHighWaterMarkCallback(muduo::net::HighWaterMarkCallback(), 0);
+  con->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
+  // the tunnel may have stopped reading because of backpressure, we need to see the FIN
+  con->startRead();
+  idle_list& list = idle_[key_of(con->peerAddress())];
+  if(list.size() >= max_idle_)
+  {
+    // the least recently used one goes away
+    list.front().con->forceClose();
+    list.pop_front();
+    -- idle_count_;
+  }
+  list.push_back(idle_connection{con, sockfd, muduo::Timestamp::now()});
+  ++ idle_count_;
+}
+
+bool upstream_pool::remove(const TcpConnectionPtr &con)
+{
+  auto it = idle_.find(key_of(con->peerAddress()));
+  if(it == idle_.end())
+    return false;
+  idle_list& list = it->second;
+  for(auto idle = list.begin(); idle != list.end(); ++idle)
+  {
+    if(idle->con == con)
+    {
+      list.erase(idle);
+      -- idle_count_;
+      if(list.empty())
+        idle_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+void upstream_pool::onIdleConnection(const TcpConnectionPtr &con)
+{
+  if(!con->connected())
+  {
+    LOG_DEBUG << "idle connection " << con->name() << " closed by server";
+    remove(con);
+  }
+}
+
+void upstream_pool::onIdleMessage(const TcpConnectionPtr &con, muduo::net::Buffer *buf, muduo::Timestamp)
+{
+  LOG_INFO << "unexpected " << buf->readableBytes() << " bytes on idle connection " << con->name();
+  buf->retrieveAll();
+  remove(con);
+  con->forceClose();
+}
+
+void upstream_pool::onSweep()
+{
+  muduo::Timestamp now = muduo::Timestamp::now();
+  for(auto it = idle_.begin(); it != idle_.end(); )
+  {
+    idle_list& list = it->second;
+    while(!list.empty() && muduo::timeDifference(now, list.front().since) >= idle_timeout_)
+    {
+      LOG_DEBUG << "close idle connection " << list.front().con->name();
+      list.front().con->forceClose();
+      list.pop_front();
+      -- idle_count_;
+    }
+    if(list.empty())
+      it = idle_.erase(it);
+    else
+      ++it;
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <muduo/net/TcpConnection.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TimerId.h>
+#include <muduo/base/Timestamp.h>
+#include <boost/noncopyable.hpp>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+namespace muduo
+{
+namespace net
+{
+class EventLoop;
+}
+}
+
+namespace zy
+{
+// 每个io线程一个, 缓存到远程服务器的空闲keep-alive连接, 以(ip, port)为key, 只在所属loop中使用
+class upstream_pool : boost::noncopyable
+{
+ public:
+  typedef muduo::net::TcpConnectionPtr TcpConnectionPtr;
+
+  // max_idle: idle connections kept for each (ip, port), idle_timeout: seconds before an idle one is closed
+  upstream_pool(muduo::net::EventLoop* loop, size_t max_idle = 8, double idle_timeout = 15);
+
+  ~upstream_pool();
+
+  // take the most recently used healthy connection to addr, return false if there is none
+  // callbacks of con must be replaced by the caller
+  bool acquire(const muduo::net::InetAddress& addr, TcpConnectionPtr* con, int* sockfd);
+
+  // con must have finished its last response and have nothing buffered
+  void release(const TcpConnectionPtr& con, int sockfd);
+
+  size_t idle() const { return idle_count_; }
+
+ private:
+  struct idle_connection
+  {
+    TcpConnectionPtr con;
+    int sockfd;
+    muduo::Timestamp since;
+  };
+  typedef std::deque<idle_connection> idle_list;
+
+  static std::string key_of(const muduo::net::InetAddress& addr);
+
+  // connection closed by the server while idle
+  void onIdleConnection(const TcpConnectionPtr& con);
+
+  // an idle connection should never receive data, e.g. a 408 sent before closing
+  void onIdleMessage(const TcpConnectionPtr& con, muduo::net::Buffer* buf, muduo::Timestamp);
+
+  // close connections idle for longer than idle_timeout_
+  void onSweep();
+
+  // remove con from the pool, return false if it is not there
+  bool remove(const TcpConnectionPtr& con);
+
+  static bool healthy(const idle_connection& idle);
+
+  muduo::net::EventLoop* loop_;
+  muduo::net::TimerId sweep_timer_;
+  size_t max_idle_;
+  double idle_timeout_;
+  // oldest at front, acquire() takes from back
+  std::unordered_map<std::string, idle_list> idle_;
+  size_t idle_count_;
+};
+}